@@ -0,0 +1,566 @@
+/*
+    Host-side allocator benchmark. Builds the kernel's allocators as a 32-bit Linux program, hands them a synthetic
+    multiboot memory map over a static buffer, and replays a malloc/free trace against them.
+
+    usage: alloc_bench [-e heap|tlsf|pgalloc] [-g random|worst] [-f pages] [-n ops] [-l slots] [-s seed] [-t trace]
+                       [-w trace] [-r runs] [-b cycles]
+
+    -e  allocator to replay against (default heap)
+    -g  trace to generate: random, or worst for the worst case of the TLSF pool (default random)
+    -f  fragment the memory map into runs of this many pages with a one page hole after each (at least 64)
+    -n  number of operations in a generated trace (default 1000000)
+    -l  number of allocation slots in a generated trace (default 4096)
+    -s  random seed for a generated trace (default 1)
+    -t  replay a recorded trace instead of generating one
+    -w  write the trace to a file before replaying it
+    -r  replay the trace this many times and keep each operation's fastest time, filtering out interrupts and page
+        faults (default 1, 5 with -g worst)
+    -b  fail if any malloc or free takes more than this many cycles (default none)
+
+    A trace has one operation per line. "a <slot> <size>" allocates size bytes into a slot, "f <slot>" frees the slot.
+    Lines starting with # are ignored.
+
+    The worst-case trace fills the pool with groups of four blocks, then frees the first and third of every group, so
+    the pool is as fragmented as it gets. Every free after that merges with free blocks on both sides, every malloc
+    splits the block it takes, and every request is just past the start of a second-level list, so it is rounded up
+    to the next one. Replaying it against a TLSF pool checks the steps each malloc and free took, which don't depend
+    on timing, against TLSF_MALLOC_MAX_STEPS and TLSF_FREE_MAX_STEPS. This runs as a CTest test. The exit status is
+    2 if a bound was exceeded.
+
+    alloc_bench uses the page allocator's buddy free map, alloc_bench_bitmap is the same program with the bitmap one.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <heap.h>
+#include <io.h>
+#include <multiboot.h>
+#include <pgalloc.h>
+#include <tlsf.h>
+
+/* Memory handed to the page allocator */
+#define BENCH_MEMORY_SIZE (64 * 1024 * 1024)
+
+/* Most entries in the memory map, and shortest run of a fragmented map. Boot memory, which holds the page database, is taken from one run */
+#define BENCH_MAX_MAP 1024
+#define BENCH_MIN_FRAGMENT 64
+
+/* Limits of a trace */
+#define BENCH_MAX_OPS (4 * 1024 * 1024)
+#define BENCH_MAX_SLOTS (128 * 1024)
+
+/* Pages of the TLSF pool, half of the memory */
+#define BENCH_TLSF_PAGES ((BENCH_MEMORY_SIZE / 4096) / 2)
+
+/* Request sizes of the worst-case trace. Each is 8 bytes past the start of a second-level list. The larger one fits
+   the block a group of four merges into, with 24 bytes to split off */
+#define BENCH_WORST_SIZE 264
+#define BENCH_WORST_MERGED_SIZE 776
+
+/* Default runs of the worst-case trace */
+#define BENCH_WORST_RUNS 5
+
+/* The kernel's malloc and free, renamed so they don't replace the C library's */
+void *kernel_malloc(size_t size);
+void kernel_free(void *ptr);
+
+/* Symbols normally provided by the linker script and boot code */
+int kernel_start;
+int kernel_end;
+multiboot_info_t *multiboot_info;
+
+/* Synthetic multiboot information */
+static multiboot_info_t bench_mbi;
+static multiboot_memory_map_t bench_mmap[BENCH_MAX_MAP];
+static uint8_t bench_memory[BENCH_MEMORY_SIZE] __attribute__((aligned(4096)));
+
+/* Trace being replayed */
+struct s_bench_op {
+    uint8_t alloc;
+    uint32_t slot;
+    uint32_t size;
+};
+
+typedef struct s_bench_op bench_op_t;
+
+static bench_op_t bench_ops[BENCH_MAX_OPS];
+static uint32_t bench_op_count;
+
+/* Replay state */
+static void *bench_slots[BENCH_MAX_SLOTS];
+static uint32_t bench_slot_sizes[BENCH_MAX_SLOTS];
+static uint32_t bench_alloc_cycles[BENCH_MAX_OPS];
+static uint32_t bench_free_cycles[BENCH_MAX_OPS];
+
+/* Allocator under test */
+static void *(*bench_alloc)(size_t size);
+static void (*bench_free)(void *ptr);
+static tlsf_t *bench_tlsf;
+
+/* xorshift32 */
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+/* Request sizes: mostly small objects, some medium blocks, a few multi-page buffers */
+static uint32_t bench_random_size(void) {
+    uint32_t r = bench_random() % 100;
+
+    if (r < 70) {
+        return 8 + (bench_random() % 249);
+    } else if (r < 95) {
+        return 257 + (bench_random() % 2816);
+    } else {
+        return 3073 + (bench_random() % 29696);
+    }
+}
+
+/* Generate a random trace. Each operation picks a slot, and frees it if it is in use or allocates it if it is not */
+static void bench_generate(uint32_t ops, uint32_t slots) {
+    static uint8_t used[BENCH_MAX_SLOTS];
+
+    for (uint32_t i=0; i<ops; i++) {
+        uint32_t slot = bench_random() % slots;
+
+        bench_ops[i].slot = slot;
+        bench_ops[i].alloc = !used[slot];
+        bench_ops[i].size = used[slot] ? 0 : bench_random_size();
+        used[slot] = !used[slot];
+    }
+
+    bench_op_count = ops;
+}
+
+/* Add an operation to the trace */
+static void bench_add(uint8_t alloc, uint32_t slot, uint32_t size) {
+    bench_ops[bench_op_count].alloc = alloc;
+    bench_ops[bench_op_count].slot = slot;
+    bench_ops[bench_op_count].size = size;
+    bench_op_count++;
+}
+
+/* Generate the worst-case trace of the TLSF pool. Group g is slots 4g to 4g+3, in the order they are in memory */
+static void bench_generate_worst(void) {
+    /* Leave some of the pool free, so the last allocations of the fill still split it */
+    uint32_t groups = ((BENCH_TLSF_PAGES * 4096) - sizeof(tlsf_t) - 4096) / (4 * (BENCH_WORST_SIZE + TLSF_BLOCK_HEADER_SIZE));
+    bench_op_count = 0;
+
+    /* Fill the pool, splitting the rest of it on every allocation */
+    for (uint32_t g=0; g<groups; g++) {
+        for (uint32_t i=0; i<4; i++) {
+            bench_add(1, (4 * g) + i, BENCH_WORST_SIZE);
+        }
+    }
+
+    /* Free the first and third block of every group. Their neighbours are in use, so there are two free blocks per group */
+    for (uint32_t g=0; g<groups; g++) {
+        bench_add(0, 4 * g, 0);
+        bench_add(0, (4 * g) + 2, 0);
+    }
+
+    /* Free the second block, merging it with the first and third */
+    for (uint32_t g=0; g<groups; g++) {
+        bench_add(0, (4 * g) + 1, 0);
+    }
+
+    /* Allocate from the merged blocks, splitting off the end of each */
+    for (uint32_t g=0; g<groups; g++) {
+        bench_add(1, 4 * g, BENCH_WORST_MERGED_SIZE);
+    }
+
+    /* Free the fourth block, merging it with the end split off before it. Then free the allocation between two free blocks */
+    for (uint32_t g=0; g<groups; g++) {
+        bench_add(0, (4 * g) + 3, 0);
+    }
+    for (uint32_t g=0; g<groups; g++) {
+        bench_add(0, 4 * g, 0);
+    }
+}
+
+/* Read a trace from a file. Returns non-zero if not successful */
+static int bench_read(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "alloc_bench: unable to open %s\n", path);
+        return 1;
+    }
+
+    char line[64];
+    bench_op_count = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] != 'a' && line[0] != 'f') {
+            continue;
+        }
+
+        if (bench_op_count == BENCH_MAX_OPS) {
+            fprintf(stderr, "alloc_bench: trace is longer than %d operations\n", BENCH_MAX_OPS);
+            fclose(f);
+            return 1;
+        }
+
+        char *p = line + 1;
+        bench_op_t *op = bench_ops + bench_op_count;
+        op->alloc = (line[0] == 'a');
+        op->slot = strtoul(p, &p, 10);
+        op->size = op->alloc ? strtoul(p, &p, 10) : 0;
+
+        if (op->slot >= BENCH_MAX_SLOTS) {
+            fprintf(stderr, "alloc_bench: slot %u is out of range\n", op->slot);
+            fclose(f);
+            return 1;
+        }
+
+        bench_op_count++;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Write the trace to a file. Returns non-zero if not successful */
+static int bench_write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "alloc_bench: unable to open %s\n", path);
+        return 1;
+    }
+
+    for (uint32_t i=0; i<bench_op_count; i++) {
+        if (bench_ops[i].alloc) {
+            fprintf(f, "a %u %u\n", bench_ops[i].slot, bench_ops[i].size);
+        } else {
+            fprintf(f, "f %u\n", bench_ops[i].slot);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* Page allocator as a malloc, for benchmarking it on its own */
+static void *bench_pgalloc(size_t size) {
+    return pgalloc((size + 4095) / 4096);
+}
+
+static void *bench_tlsf_malloc(size_t size) {
+    return tlsf_malloc(bench_tlsf, size);
+}
+
+static void bench_tlsf_free(void *ptr) {
+    tlsf_free(bench_tlsf, ptr);
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Print the median, 99th percentile and worst latency of a set of operations. Returns the worst */
+static uint32_t bench_print_latency(const char *name, uint32_t *cycles, uint32_t count) {
+    if (count == 0) {
+        printf("%-8s latency: no operations\n", name);
+        return 0;
+    }
+
+    qsort(cycles, count, sizeof(uint32_t), bench_compare);
+    printf("%-8s latency (cycles): p50 %u, p99 %u, max %u\n", name, cycles[count / 2], cycles[(uint32_t) (count * 0.99)], cycles[count - 1]);
+    return cycles[count - 1];
+}
+
+int main(int argc, char **argv) {
+    const char *engine = "heap";
+    const char *generator = "random";
+    const char *trace_in = NULL;
+    const char *trace_out = NULL;
+    uint32_t ops = 1000000;
+    uint32_t slots = 4096;
+    uint32_t fragment = 0;
+    uint32_t runs = 0;
+    uint32_t bound = 0;
+
+    for (int i=1; i<argc; i++) {
+        if (i + 1 == argc) {
+            fprintf(stderr, "alloc_bench: missing value for %s\n", argv[i]);
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-e") == 0) {
+            engine = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0) {
+            generator = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            bound = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            fragment = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            ops = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            slots = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            bench_seed = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            trace_in = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0) {
+            trace_out = argv[++i];
+        } else {
+            fprintf(stderr, "alloc_bench: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (ops > BENCH_MAX_OPS || slots == 0 || slots > BENCH_MAX_SLOTS || bench_seed == 0) {
+        fprintf(stderr, "alloc_bench: at most %d operations and %d slots, and a non-zero seed\n", BENCH_MAX_OPS, BENCH_MAX_SLOTS);
+        return 1;
+    }
+
+    if (fragment != 0 && (fragment < BENCH_MIN_FRAGMENT || (BENCH_MEMORY_SIZE / 4096) / (fragment + 1) > BENCH_MAX_MAP - 3)) {
+        fprintf(stderr, "alloc_bench: runs of a fragmented map must be at least %d pages, and at most %d runs\n", BENCH_MIN_FRAGMENT, BENCH_MAX_MAP - 3);
+        return 1;
+    }
+
+    /* The worst-case trace is only the worst case for a TLSF pool, and is replayed several times against a bound by default */
+    int worst = (strcmp(generator, "worst") == 0);
+    if (worst && strcmp(engine, "tlsf") != 0) {
+        fprintf(stderr, "alloc_bench: the worst-case trace is for -e tlsf\n");
+        return 1;
+    } else if (!worst && strcmp(generator, "random") != 0) {
+        fprintf(stderr, "alloc_bench: unknown trace %s\n", generator);
+        return 1;
+    }
+
+    if (runs == 0) {
+        runs = worst ? BENCH_WORST_RUNS : 1;
+    }
+
+    /* Get the trace */
+    if (trace_in != NULL) {
+        if (bench_read(trace_in)) {
+            return 1;
+        }
+    } else if (worst) {
+        bench_generate_worst();
+    } else {
+        bench_generate(ops, slots);
+    }
+
+    if (trace_out != NULL && bench_write(trace_out)) {
+        return 1;
+    }
+
+    /* Memory map: low memory, the benchmark's memory and a reserved hole, like a small PC */
+    uint32_t entries = 0;
+    bench_mmap[entries].size = sizeof(multiboot_memory_map_t) - sizeof(uint32_t);
+    bench_mmap[entries].addr = 0x0;
+    bench_mmap[entries].len = 0x9fc00;
+    bench_mmap[entries].type = MULTIBOOT_MEMORY_RESERVED;
+    entries++;
+
+    /* A fragmented map leaves a page out after every run, so free memory can't be merged across runs */
+    uint32_t run = fragment ? (fragment + 1) * 4096 : BENCH_MEMORY_SIZE;
+    for (uint32_t offset = 0; offset < BENCH_MEMORY_SIZE; offset += run) {
+        bench_mmap[entries].size = sizeof(multiboot_memory_map_t) - sizeof(uint32_t);
+        bench_mmap[entries].addr = (uint32_t) bench_memory + offset;
+        bench_mmap[entries].len = (BENCH_MEMORY_SIZE - offset < run) ? BENCH_MEMORY_SIZE - offset : run;
+        if (fragment && bench_mmap[entries].len == run) {
+            bench_mmap[entries].len -= 4096;
+        }
+        bench_mmap[entries].type = MULTIBOOT_MEMORY_AVAILABLE;
+        entries++;
+    }
+
+    bench_mmap[entries].size = sizeof(multiboot_memory_map_t) - sizeof(uint32_t);
+    bench_mmap[entries].addr = 0xfffc0000;
+    bench_mmap[entries].len = 0x40000;
+    bench_mmap[entries].type = MULTIBOOT_MEMORY_RESERVED;
+    entries++;
+
+    bench_mbi.flags = MULTIBOOT_INFO_MEM_MAP;
+    bench_mbi.mmap_addr = bench_mmap;
+    bench_mbi.mmap_length = entries * sizeof(multiboot_memory_map_t);
+    multiboot_info = &bench_mbi;
+
+    if (pgalloc_init()) {
+        fprintf(stderr, "alloc_bench: unable to initialize page allocator\n");
+        return 1;
+    }
+    heap_init();
+
+    /* Pick the allocator */
+    if (strcmp(engine, "heap") == 0) {
+        bench_alloc = kernel_malloc;
+        bench_free = kernel_free;
+    } else if (strcmp(engine, "tlsf") == 0) {
+        bench_tlsf = tlsf_create(pgalloc(BENCH_TLSF_PAGES), BENCH_TLSF_PAGES * 4096);
+        if (bench_tlsf == NULL) {
+            fprintf(stderr, "alloc_bench: unable to create a pool of %u pages\n", BENCH_TLSF_PAGES);
+            return 1;
+        }
+        bench_alloc = bench_tlsf_malloc;
+        bench_free = bench_tlsf_free;
+    } else if (strcmp(engine, "pgalloc") == 0) {
+        bench_alloc = bench_pgalloc;
+        bench_free = pgfree;
+    } else {
+        fprintf(stderr, "alloc_bench: unknown allocator %s\n", engine);
+        return 1;
+    }
+
+    pgalloc_stats_t pgalloc_before;
+    pgalloc_get_stats(&pgalloc_before);
+    uint32_t peak_pages = 0;
+    uint64_t live_bytes = 0;
+    uint64_t peak_live_bytes = 0;
+    uint32_t allocs = 0;
+    uint32_t frees = 0;
+    uint32_t failed = 0;
+
+    /* Most steps a malloc and a free of the TLSF pool took */
+    uint32_t malloc_steps = 0;
+    uint32_t free_steps = 0;
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (uint32_t run=0; run<runs; run++) {
+        /* Every run does the same operations, so the i-th malloc or free of each run is compared with the others */
+        allocs = 0;
+        frees = 0;
+        failed = 0;
+        live_bytes = 0;
+
+        for (uint32_t i=0; i<bench_op_count; i++) {
+            bench_op_t *op = bench_ops + i;
+
+            if (op->alloc) {
+                /* Recorded traces may allocate into a slot that is in use, that leaks like the original program did */
+                uint32_t steps = (bench_tlsf != NULL) ? bench_tlsf->steps : 0;
+                uint64_t t0 = rdtsc();
+                void *ptr = bench_alloc(op->size);
+                uint64_t t1 = rdtsc();
+
+                if (run == 0 || (uint32_t) (t1 - t0) < bench_alloc_cycles[allocs]) {
+                    bench_alloc_cycles[allocs] = (uint32_t) (t1 - t0);
+                }
+                allocs++;
+
+                if (bench_tlsf != NULL && bench_tlsf->steps - steps > malloc_steps) {
+                    malloc_steps = bench_tlsf->steps - steps;
+                }
+
+                if (ptr == NULL) {
+                    failed++;
+                    continue;
+                }
+
+                bench_slots[op->slot] = ptr;
+                bench_slot_sizes[op->slot] = op->size;
+                live_bytes += op->size;
+                if (live_bytes > peak_live_bytes) {
+                    peak_live_bytes = live_bytes;
+                }
+            } else {
+                if (bench_slots[op->slot] == NULL) {
+                    continue;
+                }
+
+                uint32_t steps = (bench_tlsf != NULL) ? bench_tlsf->steps : 0;
+                uint64_t t0 = rdtsc();
+                bench_free(bench_slots[op->slot]);
+                uint64_t t1 = rdtsc();
+
+                if (run == 0 || (uint32_t) (t1 - t0) < bench_free_cycles[frees]) {
+                    bench_free_cycles[frees] = (uint32_t) (t1 - t0);
+                }
+                frees++;
+
+                if (bench_tlsf != NULL && bench_tlsf->steps - steps > free_steps) {
+                    free_steps = bench_tlsf->steps - steps;
+                }
+
+                bench_slots[op->slot] = NULL;
+                live_bytes -= bench_slot_sizes[op->slot];
+            }
+
+            /* Pages taken from the page allocator. Reading the counters is not timed */
+            pgalloc_stats_t pgalloc_now;
+            pgalloc_get_stats(&pgalloc_now);
+            uint32_t used_pages = pgalloc_before.pages_free - pgalloc_now.pages_free;
+            if (used_pages > peak_pages) {
+                peak_pages = used_pages;
+            }
+        }
+
+        /* Free what is left before the next run, so it starts where this one did. The last run's allocations stay live */
+        if (run + 1 < runs) {
+            for (uint32_t i=0; i<BENCH_MAX_SLOTS; i++) {
+                if (bench_slots[i] != NULL) {
+                    bench_free(bench_slots[i]);
+                    bench_slots[i] = NULL;
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + ((end.tv_nsec - begin.tv_nsec) / 1e9);
+
+    uint64_t total_cycles = 0;
+    for (uint32_t i=0; i<allocs; i++) {
+        total_cycles += bench_alloc_cycles[i];
+    }
+    for (uint32_t i=0; i<frees; i++) {
+        total_cycles += bench_free_cycles[i];
+    }
+
+    /* Fragmentation with the trace's remaining allocations still live */
+    pgalloc_stats_t pgalloc_after;
+    pgalloc_get_stats(&pgalloc_after);
+    heap_stats_t heap_after;
+    heap_get_stats(&heap_after);
+
+    uint32_t free_pages = pgalloc_after.pages_free;
+    uint32_t largest_pages = pgalloc_after.largest_free;
+    uint32_t free_heap = heap_after.bytes_free;
+    uint32_t largest_heap = heap_after.largest_free;
+
+    printf("allocator: %s, %u operations (%u mallocs, %u frees, %u failed), %u runs\n", engine, bench_op_count, allocs, frees, failed, runs);
+    printf("throughput: %.0f ops/sec including bookkeeping, %.1f cycles/op in the allocator\n", runs * (allocs + frees) / seconds, (double) total_cycles / (allocs + frees));
+    uint32_t worst_malloc = bench_print_latency("malloc", bench_alloc_cycles, allocs);
+    uint32_t worst_free = bench_print_latency("free", bench_free_cycles, frees);
+    printf("peak footprint: %u KiB of pages for %llu KiB requested\n", peak_pages * 4, (unsigned long long) (peak_live_bytes / 1024));
+    printf("external fragmentation: pages %.1f%% (%u free, largest run %u), heap %.1f%% (%u bytes free, largest block %u)\n",
+        free_pages ? 100.0 * (1.0 - ((double) largest_pages / free_pages)) : 0.0, free_pages, largest_pages,
+        free_heap ? 100.0 * (1.0 - ((double) largest_heap / free_heap)) : 0.0, free_heap, largest_heap);
+
+    /* Steps don't depend on timing, so the worst-case trace always checks them. A failed allocation would skip the paths being measured */
+    if (worst) {
+        if (malloc_steps > TLSF_MALLOC_MAX_STEPS || free_steps > TLSF_FREE_MAX_STEPS || failed != 0) {
+            printf("steps: FAILED, worst malloc took %u, worst free took %u, bounds are %u and %u, %u mallocs failed\n", malloc_steps, free_steps, TLSF_MALLOC_MAX_STEPS, TLSF_FREE_MAX_STEPS, failed);
+            return 2;
+        }
+        printf("steps: passed, worst malloc took %u, worst free took %u, bounds are %u and %u\n", malloc_steps, free_steps, TLSF_MALLOC_MAX_STEPS, TLSF_FREE_MAX_STEPS);
+    }
+
+    if (bound != 0) {
+        uint32_t worst_op = (worst_malloc > worst_free) ? worst_malloc : worst_free;
+        if (worst_op > bound || failed != 0) {
+            printf("bound: FAILED, worst operation took %u cycles, bound is %u, %u mallocs failed\n", worst_op, bound, failed);
+            return 2;
+        }
+        printf("bound: passed, worst operation took %u cycles, bound is %u\n", worst_op, bound);
+    }
+
+    return 0;
+}
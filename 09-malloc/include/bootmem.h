@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocate memory during boot, before the page allocator is initialized. Alignment must be a power of two. The memory is not cleared and can't be freed. Returns NULL if not successful, or if bootmem_finish has been called */
+void *bootmem_alloc(size_t size, size_t align);
+
+/* Stop handing out boot memory, and get the pages it used. Bounds in bytes, page aligned */
+void bootmem_finish(uint32_t *start, uint32_t *end);
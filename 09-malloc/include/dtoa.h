@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Bits of the mantissa of a double without the implicit 1, and the bias of its exponent */
+#define DTOA_MANTISSA_BITS 52
+#define DTOA_EXPONENT_BIAS 1023
+
+/* Bits the powers of 5 are scaled to, and the number of small powers of 5 the others are made from */
+#define DTOA_POW5_BITS 125
+#define DTOA_POW5_COUNT 26
+
+/* Most significant digits the exact value of a double has (767), plus one to round with */
+#define DTOA_DIGITS_MAX 768
+
+/* 32 bit words of a bignum holding a double's whole part (up to 2^1024) or its fraction (up to 1074 bits) */
+#define DTOA_BIG_WORDS 35
+
+/* Find the digits of a finite double greater than 0, rounded to nearest (ties to even) at a number of significant digits, or with fixed at a number of digits after the decimal point. The first digit is at 10 to the exponent, and any past the ones written are 0. Returns the number of digits written, 0 if it rounds to 0 */
+int dtoa_round(double v, int precision, bool fixed, char *digits, int *exponent);
+
+/* Find the shortest decimal that reads back as the same double, for finite doubles greater than 0. The double is the returned mantissa times 10 to the exponent */
+uint64_t dtoa_shortest(double v, int *exponent);
@@ -1,23 +1,124 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
-/* Linked list entry that resides right before each block of memory */
+/* Boundary tag that resides right before each block of memory. prev_size is the footer of the previous block, so both neighbours of a block can be found without searching */
 struct s_heap_entry {
-    struct s_heap_entry *next;
-    uint32_t size;
+    uint32_t prev_size;         /* size of the previous block, 0 if this is the first block in the page */
+    uint32_t size;              /* size of this block, HEAP_ENTRY_INUSE is set while it is allocated */
+    struct s_heap_entry *next;  /* free list links, only valid while free. They reside in the block's memory */
+    struct s_heap_entry *prev;
 };
 
 typedef struct s_heap_entry heap_entry_t;
 
-/* Add a free block to the back of the list */
-void heap_add_free_block_back(heap_entry_t *blk);
+/* Header at the start of each arena. Arenas are runs of pages that the heap carves into blocks */
+struct s_heap_arena {
+    struct s_heap_arena *next;
+    struct s_heap_arena *prev;
+    uint32_t pages;
+    uint32_t reserved;          /* keeps the first block aligned to 8 bytes */
+};
+
+typedef struct s_heap_arena heap_arena_t;
+
+/* Heap counters. Sizes are in bytes */
+struct s_heap_stats {
+    uint32_t bytes_inuse;       /* memory held by allocations, including rounding up to a size class, block or page */
+    uint32_t bytes_free;        /* memory in free blocks of the free list */
+    uint32_t largest_free;      /* largest free block */
+    uint32_t free_blocks;       /* number of free blocks */
+    uint32_t allocs;            /* successful allocations */
+    uint32_t frees;
+    uint32_t failed;            /* allocations that returned NULL */
+    uint32_t pgalloc_calls;     /* page allocations made by the heap, for heap pages and large requests */
+    uint32_t pgfree_calls;
+    uint32_t vmalloc_calls;     /* large requests served by vmalloc, as no run of free pages was long enough */
+    uint32_t arenas;            /* arenas owned by the heap, including empty ones */
+    uint32_t arenas_empty;      /* empty arenas kept for reuse */
+};
+
+typedef struct s_heap_stats heap_stats_t;
+
+/* Size of the boundary tag in front of each block. The list links are not included, they overlap the memory of the block */
+#define HEAP_ENTRY_HEADER_SIZE 8
+
+/* Set in the size of a block while it is allocated */
+#define HEAP_ENTRY_INUSE 0x1
+
+/* Pages in each arena. Blocks merge across the pages of an arena, but never across arenas */
+#define HEAP_ARENA_PAGES 16
+
+/* Kernel space arenas are taken from once paging is on. Its pages are mapped to zeroed frames by the page fault handler the first time they are touched, so an arena only takes memory for the pages in use */
+#define HEAP_REGION_START 0xC8000000
+#define HEAP_REGION_END 0xCC000000
+
+/* Pages of the region mapped together by a fault, so filling an arena doesn't fault on every page */
+#define HEAP_FAULT_AROUND 4
+
+/* Number of empty arenas kept for reuse before they are returned to the page allocator */
+#define HEAP_ARENA_CACHE_SIZE 2
+
+/* Size of the block that fills an entire arena. The end of the arena holds an in-use boundary tag with no memory, which keeps blocks from merging past it */
+#define HEAP_ARENA_BLOCK_SIZE ((HEAP_ARENA_PAGES * 4096) - sizeof(heap_arena_t) - (2 * HEAP_ENTRY_HEADER_SIZE))
+
+/* Free blocks under this size have a free list for each size. Larger ones have a list for each eighth of a power of two */
+#define HEAP_FREE_LINEAR 256
+#define HEAP_FREE_SL_LOG2 3
+
+/* Number of free lists, enough for blocks up to the one filling an arena */
+#define HEAP_FREE_CLASSES 96
 
-/* Add a free block to the front of the list */
-void heap_add_free_block_front(heap_entry_t *blk);
+/* Largest request served by the size-class bins. Anything larger goes to the page allocator */
+#define HEAP_BIN_MAX_SIZE 3072
+
+/* Number of size classes. Each one is a kmem cache */
+#define HEAP_BIN_COUNT 17
+
+/* Kernel space the slabs of the size-class bins are taken from once paging is on. It is demand-zero like the arena region, but faults map a page at a time, since a slab is often only partly used */
+#define HEAP_BIN_REGION_START 0xCC000000
+#define HEAP_BIN_REGION_END 0xD0000000
+
+/* Pages in each window of the bin region. A window holds slabs of one size, aligned to it, so the largest slab fills a window */
+#define HEAP_BIN_WINDOW_PAGES 8
+
+/* Number of windows in the bin region */
+#define HEAP_BIN_WINDOWS ((HEAP_BIN_REGION_END - HEAP_BIN_REGION_START) / (HEAP_BIN_WINDOW_PAGES * 4096))
+
+/* Check if memory is in the part of kernel space arenas are taken from */
+static inline int heap_region_addr(const void *ptr) {
+    return (uint32_t) ptr >= HEAP_REGION_START && (uint32_t) ptr < HEAP_REGION_END;
+}
+
+/* Check if memory is in the part of kernel space bin slabs are taken from */
+static inline int heap_bin_region_addr(const void *ptr) {
+    return (uint32_t) ptr >= HEAP_BIN_REGION_START && (uint32_t) ptr < HEAP_BIN_REGION_END;
+}
+
+/* Add a free block to the front of the list of its size class */
+void heap_add_free_block(heap_entry_t *blk);
+
+/* Allocate a block from the free list, expanding the heap by an arena if nothing fits. size must be a multiple of 8 and fit in an arena. Returns NULL if not successful */
+heap_entry_t *heap_alloc_block(size_t size);
+
+/* Get the arena memory belongs to. Returns NULL if it is not in an arena */
+heap_arena_t *heap_arena_of(void *ptr);
+
+/* Get the heap's counters. They are maintained by every operation, so this doesn't walk any lists */
+void heap_get_stats(heap_stats_t *stats);
+
+/* Initialize the heap. Must be called after pgalloc_init, and after vmm_init for arenas to come from the demand-zero region */
+void heap_init(void);
 
 /* Print diagnostic information about the heap */
 void heap_print_diagnostics();
 
-/* Remove a block from the free block list */
-void heap_remove_free_block(heap_entry_t *blk);
\ No newline at end of file
+/* Return a block to the free list, merging it with free neighbours. The in-use bit must already be clear */
+void heap_release_block(heap_entry_t *blk);
+
+/* Remove a block from the list of its size class */
+void heap_remove_free_block(heap_entry_t *blk);
+
+/* Shrink an allocated block to size, a multiple of 8. What is left over is freed if it can hold a free block */
+void heap_shrink_block(heap_entry_t *blk, size_t size);
\ No newline at end of file
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdint.h>
 
 /* x86 outb instruction */
@@ -51,3 +53,35 @@ static inline uint32_t inl(uint16_t port)
                    : "Nd"(port) );
     return ret;
 }
+
+/* x86 cpuid instruction */
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    asm volatile ( "cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0) );
+}
+
+/* x86 cpuid instruction, for leaves that take a subleaf in ecx */
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    asm volatile ( "cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf) );
+}
+
+/* x86 invlpg instruction, removes a page from the TLB */
+static inline void invlpg(void *addr)
+{
+    asm volatile ( "invlpg (%0)" : : "r"(addr) : "memory" );
+}
+
+/* Load cr3 with the physical address of a page directory, which also flushes the TLB */
+static inline void load_cr3(uint32_t page_directory)
+{
+    asm volatile ( "mov %0, %%cr3" : : "r"(page_directory) : "memory" );
+}
+
+/* x86 rdtsc instruction */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile ( "rdtsc" : "=a"(lo), "=d"(hi) );
+    return ((uint64_t) hi << 32) | lo;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of caches in the cache pool */
+#define KMEM_CACHE_POOL_SIZE 32
+
+/* Number of 32-bit words in a slab's free bitmap, enough for 8 byte objects */
+#define KMEM_SLAB_BITMAP_WORDS 16
+
+/* Most pages in a slab. Slabs of large objects have more than one page, so less of each is wasted */
+#define KMEM_SLAB_MAX_PAGES 8
+
+/* Marks a page as a slab. It can't be confused with the next link of the heap_arena_t at the start of an arena, which is NULL or a kernel space address */
+#define KMEM_SLAB_MAGIC 0x51ab51ab
+
+/* Object constructor. Called once for each object when its slab is created, not on every allocation */
+typedef void (*kmem_ctor_t)(void *obj);
+
+/* Where a cache's slabs come from, for caches whose slabs aren't whole pages from pgalloc. alloc returns a run of pages aligned to the slab size or NULL, free gives one back and returns the number of frames freed, and head finds the first page of the slab memory is in, or NULL if it isn't in one */
+struct s_kmem_source {
+    void *(*alloc)(uint32_t pages);
+    uint32_t (*free)(void *slab, uint32_t pages);
+    void *(*head)(void *ptr);
+};
+
+typedef struct s_kmem_source kmem_source_t;
+
+/* Status of a cache in the pool */
+enum e_kmem_cache_status {
+    KMEM_CACHE_FREE,
+    KMEM_CACHE_INUSE
+};
+
+typedef enum e_kmem_cache_status kmem_cache_status_t;
+
+/* Header at the start of each slab. A slab is a run of pages holding objects of a single cache */
+struct s_kmem_slab {
+    uint32_t magic;
+    struct s_kmem_slab *next;
+    struct s_kmem_slab *prev;
+    struct s_kmem_cache *cache;
+    uint32_t free_count;
+    uint32_t bitmap[KMEM_SLAB_BITMAP_WORDS]; /* a set bit is a free slot */
+};
+
+typedef struct s_kmem_slab kmem_slab_t;
+
+/* Cache of objects of one size. Objects are packed in slabs after the header, with no per-object header */
+struct s_kmem_cache {
+    kmem_cache_status_t pool_status;
+    const char *name;
+    uint32_t size;
+    uint32_t first;             /* offset of the first object in a slab */
+    uint32_t slots;             /* objects per slab */
+    uint32_t pages;             /* pages per slab */
+    kmem_ctor_t ctor;
+    const kmem_source_t *source; /* where slabs come from, NULL for pgalloc */
+    kmem_slab_t *partial;       /* slabs with at least one free slot */
+
+    /* usage counters */
+    uint32_t slabs;
+    uint32_t objects_inuse;
+    uint32_t allocs;
+    uint32_t frees;
+};
+
+typedef struct s_kmem_cache kmem_cache_t;
+
+/* Allocate an object from a cache. Returns NULL if not successful */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/* Create a cache of objects of the given size and alignment (0 for 8 bytes). ctor may be NULL. The name is not copied. Returns NULL if not successful */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor);
+
+/* Destroy a cache. Returns non-zero if it still has objects allocated */
+int kmem_cache_destroy(kmem_cache_t *cache);
+
+/* Free an object back to its cache */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Take a cache's slabs from a source other than pgalloc. Must be called before the cache has any slabs */
+void kmem_cache_set_source(kmem_cache_t *cache, const kmem_source_t *source);
+
+/* Return a cache's empty slabs to the page allocator or their source. Returns the number of pages freed */
+uint32_t kmem_cache_shrink(kmem_cache_t *cache);
+
+/* Print usage of every cache */
+void kmem_print_diagnostics(void);
+
+/* Get the slab from pgalloc an object resides in. Returns NULL if the pointer is not the start of an object in a slab */
+kmem_slab_t *kmem_slab_of(void *ptr);
+
+/* Get the slab from a source an object resides in. Returns NULL if the pointer is not the start of an object in one of its slabs */
+kmem_slab_t *kmem_source_slab_of(const kmem_source_t *source, void *ptr);
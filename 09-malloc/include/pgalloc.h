@@ -3,62 +3,270 @@
 #include <stddef.h>
 #include <stdint.h>
 
-/* Number of entries in the free block pool */
-#define PGALLOC_FREE_BLOCK_POOL_SIZE 64
+#include <vmm.h>
 
-/* Number of entries in the multipage allocation list */
-#define PGALLOC_MULTIPAGE_LIST_SIZE 64
+/* Number of block sizes of the buddy free map. A block of order n is 2^n pages and is aligned to its size, so the largest block is 2^15 pages (128 MiB) */
+#define PGALLOC_ORDER_COUNT 16
 
-/* Status of free block in the pool */
-enum e_pgalloc_block_status {
-    PGALLOC_BLOCK_FREE,
-    PGALLOC_BLOCK_INUSE
+/* Zones, by which physical addresses can reach them. Zones start at these frames */
+#define PGALLOC_ZONE_COUNT 3
+#define PGALLOC_ZONE_NORMAL_START 0x1000        /* 16 MiB, the limit of ISA DMA */
+#define PGALLOC_ZONE_HIGH_START VMM_DIRECT_MAP_FRAMES   /* 3 GiB, the end of the direct map */
+#define PGALLOC_ZONE_HIGH_END 0x100000          /* 4 GiB, the most a page table entry reaches without PAE */
+
+/* Pages pgalloc_zero_idle keeps zeroed ahead of time */
+#define PGALLOC_ZERO_POOL_SIZE 32
+
+/* Page colors: frames that map to the same sets of the largest cache have the same color. Used when the cache size can't be found with cpuid, and the most colors there can be */
+#define PGALLOC_COLORS_DEFAULT 16
+#define PGALLOC_COLORS_MAX 1024
+
+/* Color argument asking for a page of any color */
+#define PGALLOC_COLOR_ANY 0xffffffff
+
+/* Number of shrinkers that can be registered */
+#define PGALLOC_SHRINKER_COUNT 8
+
+enum e_pgalloc_zone {
+    PGALLOC_ZONE_DMA,           /* under 16 MiB, reachable by ISA DMA */
+    PGALLOC_ZONE_NORMAL,        /* 16 MiB to the end of the direct map */
+    PGALLOC_ZONE_HIGH           /* outside the direct map, only reachable by mapping it. Memory above 4 GiB isn't used, it would need PAE paging */
+};
+
+typedef enum e_pgalloc_zone pgalloc_zone_t;
+
+/* Page flags. A page with none of these is free, or is not memory the allocator manages */
+#define PGALLOC_PAGE_FREE 0x1       /* first page of a free block, only used by the buddy free map */
+#define PGALLOC_PAGE_ALLOC 0x2      /* first page of an allocation */
+#define PGALLOC_PAGE_TAIL 0x4       /* any other page of an allocation */
+
+/* Number of owners */
+#define PGALLOC_OWNER_COUNT 8
+
+/* Owners of allocations, so memory can be traced back to the allocator that uses it */
+enum e_pgalloc_owner {
+    PGALLOC_OWNER_NONE,         /* free, or allocated with pgalloc directly */
+    PGALLOC_OWNER_HEAP,         /* heap arena */
+    PGALLOC_OWNER_LARGE,        /* malloc request served with whole pages */
+    PGALLOC_OWNER_SLAB,         /* kmem slab */
+    PGALLOC_OWNER_BOOT,         /* taken from the boot memory allocator before pgalloc_init, never freed */
+    PGALLOC_OWNER_PGTABLE,      /* page table of vmm_map */
+    PGALLOC_OWNER_VMALLOC,      /* frame mapped into a vmalloc area */
+    PGALLOC_OWNER_DEMAND        /* frame mapped into a demand-zero region by the page fault handler */
+};
+
+typedef enum e_pgalloc_owner pgalloc_owner_t;
+
+/* Gives back pages a cache holds onto but can do without, when pgalloc is out of memory. Asked for at least the given number of pages, it returns the number it freed */
+typedef uint32_t (*pgalloc_shrink_t)(uint32_t pages);
+
+/* Cache that gives back memory under pressure */
+struct s_pgalloc_shrinker {
+    const char *name;
+    pgalloc_shrink_t shrink;
+    uint32_t pages;             /* pages it has given back */
 };
 
-typedef enum e_pgalloc_block_status pgalloc_block_status_t;
+typedef struct s_pgalloc_shrinker pgalloc_shrinker_t;
 
-/* Free block list entry */
+/* Moves the references to a single page allocation of an owner to a copy of it, so compaction can free the original. Returns non-zero if it couldn't */
+typedef int (*pgalloc_migrate_t)(void *from, void *to);
+
+/* Free block list entry. It resides in the first page of the free block itself, or in its page database entry in high memory, which can't be written without mapping it */
 struct s_pgalloc_free_block {
-    pgalloc_block_status_t pool_status;
-    uint32_t base;
-    uint32_t len;
     struct s_pgalloc_free_block *next;
+    struct s_pgalloc_free_block *prev;
 };
 
 typedef struct s_pgalloc_free_block pgalloc_free_block_t;
 
-/* Multipage allocation list entry */
-struct s_pgalloc_multipage {
-    uint32_t base;
+/* Page database entry. There is one for every page frame the allocator manages */
+struct s_pgalloc_page {
+    uint8_t flags;
+    uint8_t order;              /* first page of a free block: its order */
+    uint16_t owner;             /* pages of an allocation: a pgalloc_owner_t */
+    union {
+        struct {
+            uint32_t pages;     /* first page of an allocation: its length. Other pages of an allocation: the distance back to the first page */
+            void *virt;         /* pages of an allocation: where vmm_map last mapped it in kernel space, or NULL */
+        };
+        pgalloc_free_block_t links;     /* first page of a free block in high memory: its list links, with the buddy free map */
+    };
+};
+
+typedef struct s_pgalloc_page pgalloc_page_t;
+
+/* Run of usable memory, in frames */
+struct s_pgalloc_range {
+    uint32_t frame;
     uint32_t pages;
 };
 
-typedef struct s_pgalloc_multipage pgalloc_multipage_t;
+typedef struct s_pgalloc_range pgalloc_range_t;
+
+/* Page allocator counters. Sizes are in pages */
+struct s_pgalloc_stats {
+    uint32_t pages_total;       /* pages given to the allocator by pgalloc_init, including boot memory */
+    uint32_t boot_pages;        /* pages used by the boot memory allocator, these count as allocated */
+    uint32_t pages_free;
+    uint32_t largest_free;      /* largest free block, or run of free pages with the bitmap free map */
+    uint32_t free_blocks;       /* number of free blocks, or runs of free pages with the bitmap free map */
+    uint32_t allocs;            /* successful allocations */
+    uint32_t frees;
+    uint32_t failed;            /* allocations that returned NULL */
+    uint32_t zero_pool;         /* zeroed pages waiting in the pool, these count as allocated */
+    uint32_t zero_hits;         /* pgalloc_zeroed calls served from the pool */
+    uint32_t zero_misses;       /* pgalloc_zeroed calls that cleared memory themselves */
+    uint32_t compactions;       /* free blocks made by moving pages out of them */
+    uint32_t pages_migrated;    /* pages moved by compaction */
+    uint32_t shrinks;           /* times the shrinkers were called as memory ran out */
+    uint32_t zone_total[PGALLOC_ZONE_COUNT];    /* pages in each zone, including memory above 4 GiB that isn't used */
+    uint32_t zone_free[PGALLOC_ZONE_COUNT];
+};
+
+typedef struct s_pgalloc_stats pgalloc_stats_t;
 
 /* Boundaries of the kernel. Their location is determined by the linker script and correspond to the first byte of the kernel and the first byte after the kernel, respectively. Not intended to be accessed. */
 extern int kernel_start;
 extern int kernel_end;
 
-/* Allocate pages. Returns NULL if not successful */
+/* Names of the zones */
+extern const char *pgalloc_zone_names[PGALLOC_ZONE_COUNT];
+
+/* Page database, with an entry for each page frame from the first to the last free frame */
+extern pgalloc_page_t *pgalloc_page_db;
+extern uint32_t pgalloc_first_frame;
+extern uint32_t pgalloc_frame_count;
+
+/* Get the database entry of a frame. Returns NULL if the frame is outside the database */
+static inline pgalloc_page_t *pgalloc_frame(uint32_t frame) {
+    if (frame < pgalloc_first_frame || frame - pgalloc_first_frame >= pgalloc_frame_count) {
+        return NULL;
+    }
+
+    return pgalloc_page_db + (frame - pgalloc_first_frame);
+}
+
+/* Number of page colors of the largest cache, a power of two. Set by pgalloc_init */
+extern uint32_t pgalloc_color_count;
+
+/* Get the color of a page, the sets of the largest cache it maps to */
+static inline uint32_t pgalloc_color_of(void *ptr) {
+    return ((uint32_t) ptr >> 12) & (pgalloc_color_count - 1);
+}
+
+/* Get the zone a frame is in */
+static inline pgalloc_zone_t pgalloc_zone_of(uint32_t frame) {
+    if (frame < PGALLOC_ZONE_NORMAL_START) {
+        return PGALLOC_ZONE_DMA;
+    } else if (frame < PGALLOC_ZONE_HIGH_START) {
+        return PGALLOC_ZONE_NORMAL;
+    }
+
+    return PGALLOC_ZONE_HIGH;
+}
+
+/* Allocate pages from the normal zone, or the zones it falls back to. Returns NULL if not successful */
 void *pgalloc(size_t pages);
 
-/* Add a block of free memory to the pool. Length in pages. Returns non-zero if not successful */
-int pgalloc_add_free_block(uint32_t base, uint32_t len);
+/* Allocate pages from a zone, or the zones it falls back to, starting at a frame of the given color. Consecutive frames have consecutive colors, so the pages spread over the cache from there. Returns NULL if not successful */
+void *pgalloc_color(pgalloc_zone_t zone, size_t pages, uint32_t color);
+
+/* Move movable pages out of an aligned block of a zone until the whole block is free, so an allocation of the given number of pages fits. Returns non-zero if no block could be freed */
+int pgalloc_compact(pgalloc_zone_t zone, size_t pages);
+
+/* Add a run of free memory to the allocator. Length in pages. The run must be in one zone */
+void pgalloc_add_free_block(uint32_t base, uint32_t len);
+
+/* Get the page allocator's counters. They are maintained by every operation, except the largest free run of the bitmap free map which is found by scanning the bitmap */
+void pgalloc_get_stats(pgalloc_stats_t *stats);
 
-/* Allocate a free block list entry from the pool. Returns NULL if not successful */
-pgalloc_free_block_t *pgalloc_alloc_free_block();
+/* Allocate pages from the high zone only, without falling back or asking the shrinkers. They can't be read or written until they are mapped, so this is for memory only reached through a mapping. Returns NULL if the zone has no run that long */
+void *pgalloc_high(size_t pages);
 
-/* Free a free block list entry */
-void pgalloc_free_free_block(pgalloc_free_block_t *blk);
+/* Grow a page allocation in place to the given number of pages, using the free pages right after it. Returns non-zero if not successful */
+int pgalloc_grow(void *ptr, size_t pages);
+
+/* Get the first page of the allocation memory is in. Returns NULL if it is not in an allocation */
+void *pgalloc_head(void *ptr);
 
 /* Initialize the page allocator. Returns non-zero if not successful */
 int pgalloc_init(void);
 
+/* Get where the page of a page allocation memory is in was last mapped in kernel space. Returns NULL if it isn't mapped, or isn't allocated */
+void *pgalloc_mapping(void *ptr);
+
+/* Get the owner of the allocation memory is in */
+pgalloc_owner_t pgalloc_owner(void *ptr);
+
+/* Get the database entry of the page memory is in. Returns NULL if the page is not managed by the allocator */
+pgalloc_page_t *pgalloc_page_of(void *ptr);
+
+/* Get the number of pages in a page allocation */
+size_t pgalloc_pages(void *ptr);
+
 /* Print current state of the page allocator system */
 void pgalloc_print_diagnostics(void);
 
-/* Register a multi-page allocation in the list of multi-page allocations */
-int pgalloc_register_multipage(uint32_t base, uint32_t pages);
+/* Register a cache's shrinker, called before an allocation fails. The name is not copied. Returns non-zero if not successful */
+int pgalloc_register_shrinker(const char *name, pgalloc_shrink_t shrink);
+
+/* Set the zones a zone falls back to when it is out of memory, in the order they are tried, starting with the zone itself. Returns non-zero if the list is not valid */
+int pgalloc_set_fallback(pgalloc_zone_t zone, const pgalloc_zone_t *zones, int count);
+
+/* Spread allocations of more than one page over the page colors, each starting at the color after the end of the one before, so buffers allocated one after another don't start on the same cache sets */
+void pgalloc_set_coloring(int enable);
+
+/* Record where the page of a page allocation memory is in is mapped in kernel space, or NULL once it is unmapped. Called by vmm_map and vmm_unmap */
+void pgalloc_set_mapping(void *ptr, void *virt);
+
+/* Make single page allocations of an owner movable by compaction, with a function that moves the references to them */
+void pgalloc_set_migrate(pgalloc_owner_t owner, pgalloc_migrate_t migrate);
+
+/* Set the owner of a page allocation */
+void pgalloc_set_owner(void *ptr, pgalloc_owner_t owner);
+
+/* Ask the shrinkers to give back at least the given number of pages, in the order they were registered. Returns the number of pages freed */
+uint32_t pgalloc_shrink(uint32_t pages);
+
+/* Zero one page for the zeroed pool, for the idle loop to call before halting. Returns non-zero if there was nothing to do */
+int pgalloc_zero_idle(void);
+
+/* Allocate zeroed pages. Single pages come from the pool zeroed while idle, anything else is cleared on the spot. Returns NULL if not successful */
+void *pgalloc_zeroed(size_t pages);
+
+/* Allocate pages from a zone, or the zones it falls back to. Returns NULL if not successful */
+void *pgalloc_zone(pgalloc_zone_t zone, size_t pages);
 
 /* Free a page allocation */
-void pgfree(void *ptr);
\ No newline at end of file
+void pgfree(void *ptr);
+
+/*
+    Free map: which frames are free, and finding runs of them. pgalloc.c keeps the page database and counters, and
+    leaves this to pgalloc_buddy.c (buddy free lists, the default) or pgalloc_bitmap.c (a bit per frame, built with
+    the PGALLOC_BITMAP option). Frames are frame numbers, the address shifted right by 12.
+*/
+
+/* Take a run of free frames from a zone. Returns non-zero if there is no run that long */
+int pgalloc_map_alloc(pgalloc_zone_t zone, uint32_t pages, uint32_t *frame);
+
+/* Take a run of free frames from a zone, starting at a frame of the given color. Returns non-zero if there is no such run */
+int pgalloc_map_alloc_color(pgalloc_zone_t zone, uint32_t pages, uint32_t color, uint32_t *frame);
+
+/* Take the given run of frames out of the free map. Returns non-zero if any of them is not free, nothing is taken then */
+int pgalloc_map_claim(uint32_t frame, uint32_t count);
+
+/* Add a run of frames in one zone to the free map */
+void pgalloc_map_free(uint32_t frame, uint32_t count);
+
+/* Fill in the largest free run and the number of free blocks or runs */
+void pgalloc_map_get_stats(pgalloc_stats_t *stats);
+
+/* Initialize the free map, with no free frames, in the memory reserved for it. Called after the page database is set up */
+void pgalloc_map_init(void *mem);
+
+/* Get the number of pages the free map needs to be reserved for it */
+uint32_t pgalloc_map_pages(uint32_t frames);
+
+/* Print the free map */
+void pgalloc_map_print_diagnostics(void);
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <stdarg.h>
+#include <stddef.h>
+
 #define EOF (-1)
 
 int printf(const char* __restrict, ...);
-int putchar(int);
\ No newline at end of file
+int putchar(int);
+int snprintf(char* __restrict, size_t, const char* __restrict, ...);
+int vprintf(const char* __restrict, va_list);
+int vsnprintf(char* __restrict, size_t, const char* __restrict, va_list);
@@ -2,8 +2,17 @@
 
 #include <stddef.h>
 
+/* Allocate memory aligned to a power of two. Returns NULL if not successful */
+void *aligned_alloc(size_t alignment, size_t size);
+
+/* Allocate zeroed memory for an array. Returns NULL if not successful */
+void *calloc(size_t nmemb, size_t size);
+
 /* Free memory */
 void free(void *ptr);
 
 /* Allocate memory */
-void *malloc(size_t size);
\ No newline at end of file
+void *malloc(size_t size);
+
+/* Resize memory, moving it only if it can't be resized in place. Returns NULL if not successful, the original memory is left untouched */
+void *realloc(void *ptr, size_t size);
\ No newline at end of file
@@ -4,4 +4,6 @@
 
 void* memmove(void* dstptr, const void* srcptr, size_t size);
 
+void* memset(void* dstptr, int value, size_t size);
+
 size_t strlen(const char *str);
\ No newline at end of file
@@ -21,7 +21,7 @@ void terminal_putchar(char c);
 /* Put the character at the given position with the given color */
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y);
 
-/* Write a string of a given size */
+/* Write a string of a given size, moving the cursor once at the end */
 void terminal_write(const char* data, size_t size);
 
 /* Write a null-terminated string */
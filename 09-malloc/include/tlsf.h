@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* log2 of the number of second-level lists per first-level size class */
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+
+/* Blocks smaller than this all go in the first first-level class, split linearly in steps of 8 bytes */
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3)
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT)
+
+/* Blocks are smaller than 2^TLSF_FL_MAX bytes */
+#define TLSF_FL_MAX 30
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+/* Size of the header in front of each block. The free list links are not included, they overlap the memory of the block */
+#define TLSF_BLOCK_HEADER_SIZE 8
+
+/* Set in the size of a block while it is free */
+#define TLSF_BLOCK_FREE 0x1
+
+/* Most steps (free list insertions and removals, and bit scans) a malloc or a free takes */
+#define TLSF_MALLOC_MAX_STEPS 4
+#define TLSF_FREE_MAX_STEPS 3
+
+/* Header that resides right before each block of memory */
+struct s_tlsf_block {
+    struct s_tlsf_block *prev_phys;     /* block right before this one in memory, NULL for the first block */
+    uint32_t size;                      /* size of this block, TLSF_BLOCK_FREE is set while it is free */
+    struct s_tlsf_block *next_free;     /* free list links, only valid while free. They reside in the block's memory */
+    struct s_tlsf_block *prev_free;
+};
+
+typedef struct s_tlsf_block tlsf_block_t;
+
+/* Control structure of a pool. It resides at the start of the pool's memory */
+struct s_tlsf {
+    uint32_t fl_bitmap;                                 /* a set bit is a first-level class with a free block */
+    uint32_t sl_bitmap[TLSF_FL_COUNT];                  /* a set bit is a second-level list with a free block */
+    tlsf_block_t *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    uint32_t steps;                                     /* free list insertions and removals and bit scans so far, to check the bound on each operation */
+};
+
+typedef struct s_tlsf tlsf_t;
+
+/* Create a pool in the given memory. Returns NULL if the memory is too small */
+tlsf_t *tlsf_create(void *mem, size_t bytes);
+
+/* Free memory back to a pool */
+void tlsf_free(tlsf_t *tlsf, void *ptr);
+
+/* Allocate memory from a pool. Returns NULL if not successful */
+void *tlsf_malloc(tlsf_t *tlsf, size_t size);
+
+/* Print the free lists of a pool */
+void tlsf_print_diagnostics(tlsf_t *tlsf);
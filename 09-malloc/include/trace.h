@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <io.h>
+
+/* Number of records in the trace ring. Must be a power of two */
+#define TRACE_RING_SIZE 512
+
+/* Allocator events */
+enum e_trace_event {
+    TRACE_NONE,
+
+    /* heap */
+    TRACE_MALLOC,                   /* ptr: -, arg: requested size */
+    TRACE_MALLOC_ZERO,              /* ptr: -, arg: - */
+    TRACE_MALLOC_PAGES,             /* ptr: -, arg: pages requested from pgalloc */
+    TRACE_MALLOC_EXACT,             /* ptr: block, arg: size */
+    TRACE_MALLOC_LARGEST,           /* ptr: block, arg: size */
+    TRACE_MALLOC_NO_FIT,            /* ptr: largest block, arg: its size */
+    TRACE_MALLOC_EXPAND,            /* ptr: new arena, arg: pages */
+    TRACE_MALLOC_NO_PAGE,           /* ptr: -, arg: - */
+    TRACE_MALLOC_VMALLOC,           /* ptr: -, arg: pages requested from vmalloc */
+    TRACE_MALLOC_SPLIT,             /* ptr: allocated block, arg: size remaining in the free block */
+    TRACE_MALLOC_WHOLE,             /* ptr: allocated block, arg: size */
+    TRACE_MALLOC_ALIGNED,           /* ptr: -, arg: alignment */
+    TRACE_MALLOC_BAD_ALIGN,         /* ptr: -, arg: alignment */
+    TRACE_REALLOC,                  /* ptr: memory, arg: requested size */
+    TRACE_REALLOC_IN_PLACE,         /* ptr: memory, arg: requested size */
+    TRACE_REALLOC_MOVE,             /* ptr: new memory, arg: requested size */
+    TRACE_FREE,                     /* ptr: memory, arg: - */
+    TRACE_FREE_DOUBLE,              /* ptr: memory, arg: - */
+    TRACE_FREE_MERGE_NEXT,          /* ptr: block, arg: size of the following block */
+    TRACE_FREE_MERGE_PREV,          /* ptr: previous block, arg: merged size */
+    TRACE_FREE_INSERT,              /* ptr: block, arg: size */
+    TRACE_FREE_INVALID,             /* ptr: memory, arg: - */
+    TRACE_FREE_KEEP_ARENA,          /* ptr: block filling the arena, arg: empty arenas kept */
+    TRACE_FREE_RELEASE,             /* ptr: arena returned to pgalloc, arg: pages */
+    TRACE_HEAP_REMOVE_NULL,         /* ptr: -, arg: - */
+
+    /* object caches */
+    TRACE_KMEM_GROW,                /* ptr: new slab, arg: object size */
+    TRACE_KMEM_NO_PAGE,             /* ptr: -, arg: object size */
+    TRACE_KMEM_SHRINK,              /* ptr: released slab, arg: object size */
+    TRACE_KMEM_BAD_FREE,            /* ptr: object, arg: object size of the cache it was freed to */
+    TRACE_KMEM_DOUBLE_FREE,         /* ptr: object, arg: object size */
+
+    /* boot memory */
+    TRACE_BOOTMEM,                  /* ptr: memory, arg: size */
+    TRACE_BOOTMEM_NO_ROOM,          /* ptr: -, arg: size */
+    TRACE_BOOTMEM_DONE,             /* ptr: -, arg: size */
+
+    /* page allocator */
+    TRACE_PGALLOC,                  /* ptr: allocation, arg: pages */
+    TRACE_PGALLOC_BAD_SIZE,         /* ptr: -, arg: pages */
+    TRACE_PGALLOC_TOO_LARGE,        /* ptr: -, arg: pages */
+    TRACE_PGALLOC_NO_FIT,           /* ptr: -, arg: pages */
+    TRACE_PGALLOC_BAD_ZONE,         /* ptr: -, arg: zone */
+    TRACE_PGALLOC_FALLBACK,         /* ptr: -, arg: zone tried next */
+    TRACE_PGALLOC_SPLIT,            /* ptr: block, arg: order of the halves */
+    TRACE_PGALLOC_GROW,             /* ptr: allocation, arg: pages after growing */
+    TRACE_PGALLOC_NO_GROW,          /* ptr: allocation, arg: pages requested */
+    TRACE_PGFREE,                   /* ptr: allocation, arg: pages */
+    TRACE_PGFREE_BAD,               /* ptr: memory, arg: - */
+    TRACE_PGFREE_MERGE,             /* ptr: merged block, arg: its order */
+    TRACE_PGALLOC_ZEROED,           /* ptr: page from the zeroed pool, arg: pages left in the pool */
+    TRACE_PGALLOC_ZERO_MISS,        /* ptr: allocation cleared on the spot, arg: pages */
+    TRACE_PGALLOC_ZERO_IDLE,        /* ptr: page cleared for the pool, arg: pages in the pool */
+    TRACE_PGALLOC_COMPACT,          /* ptr: block made free, arg: pages moved out of it */
+    TRACE_PGALLOC_NO_COMPACT,       /* ptr: -, arg: pages */
+    TRACE_PGALLOC_SHRINK,           /* ptr: -, arg: pages the shrinkers freed */
+    TRACE_PGALLOC_BAD_COLOR,        /* ptr: -, arg: color */
+
+    /* paging */
+    TRACE_VMM_MAP,                  /* ptr: page, arg: physical address */
+    TRACE_VMM_BAD_MAP,              /* ptr: page, arg: physical address */
+    TRACE_VMM_NO_TABLE,             /* ptr: page, arg: physical address */
+    TRACE_VMM_UNMAP,                /* ptr: page, arg: physical address it was mapped to */
+    TRACE_VMM_BAD_UNMAP,            /* ptr: page, arg: - */
+    TRACE_VMM_FAULT,                /* ptr: address that faulted, arg: pages mapped */
+
+    /* vmalloc */
+    TRACE_VMALLOC,                  /* ptr: -, arg: pages */
+    TRACE_VMALLOC_NO_SPACE,         /* ptr: -, arg: pages */
+    TRACE_VMALLOC_NO_PAGE,          /* ptr: -, arg: pages */
+    TRACE_VMALLOC_FLUSH,            /* ptr: -, arg: pages unmapped */
+    TRACE_VFREE,                    /* ptr: memory, arg: pages */
+    TRACE_VFREE_BAD,                /* ptr: memory, arg: - */
+
+    /* tlsf */
+    TRACE_TLSF_DOUBLE_FREE,         /* ptr: memory, arg: - */
+
+    TRACE_EVENT_COUNT
+};
+
+typedef enum e_trace_event trace_event_t;
+
+/* One event in the trace ring */
+struct s_trace_record {
+    uint32_t tsc;       /* low 32 bits of the time stamp counter */
+    uint32_t event;
+    uint32_t ptr;
+    uint32_t arg;
+};
+
+typedef struct s_trace_record trace_record_t;
+
+/* Trace ring and the count of records ever written to it */
+extern trace_record_t trace_ring[TRACE_RING_SIZE];
+extern uint32_t trace_count;
+
+/* Record an event. No formatting is done here, trace_dump decodes the records later */
+static inline void trace(trace_event_t event, const void *ptr, uint32_t arg) {
+    uint32_t i = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED) & (TRACE_RING_SIZE - 1);
+
+    trace_ring[i].tsc = (uint32_t) rdtsc();
+    trace_ring[i].event = event;
+    trace_ring[i].ptr = (uint32_t) ptr;
+    trace_ring[i].arg = arg;
+}
+
+/* Print the records in the trace ring, oldest first */
+void trace_dump(void);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel space vmalloc maps its areas in */
+#define VMALLOC_START 0xD0000000
+#define VMALLOC_END 0xF0000000
+
+/* Pages of freed areas that are kept mapped before their TLB entries are flushed all at once */
+#define VMALLOC_LAZY_PAGES 256
+
+/* Area of kernel space mapped by vmalloc. Each one is followed by an unmapped guard page */
+struct s_vmalloc_area {
+    struct s_vmalloc_area *next;    /* areas in order of address */
+    uint32_t start;
+    uint32_t pages;                 /* mapped pages, not counting the guard page */
+    uint32_t freed;                 /* freed, waiting for the next flush to be unmapped */
+};
+
+typedef struct s_vmalloc_area vmalloc_area_t;
+
+/* Check if memory is in the part of kernel space vmalloc uses */
+static inline int vmalloc_addr(const void *ptr) {
+    return (uint32_t) ptr >= VMALLOC_START && (uint32_t) ptr < VMALLOC_END;
+}
+
+/* Free memory allocated with vmalloc */
+void vfree(void *ptr);
+
+/* Allocate memory that is contiguous in kernel space, mapped from frames anywhere in memory. Always page aligned. Returns NULL if not successful, or if vmalloc_init hasn't been called */
+void *vmalloc(size_t size);
+
+/* Unmap freed areas and return their frames to pgalloc, with a single TLB flush */
+void vmalloc_flush(void);
+
+/* Initialize vmalloc. Must be called after vmm_init and pgalloc_init */
+void vmalloc_init(void);
+
+/* Get the number of pages of a vmalloc area. Returns 0 if the pointer is not the start of one */
+size_t vmalloc_pages(void *ptr);
+
+/* Print current state of vmalloc */
+void vmalloc_print_diagnostics(void);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Virtual address the kernel is linked at. The same value is in linker.ld and boot.s. Host builds of the allocators set it to 0, as they don't page */
+#ifndef KERNEL_VMA
+#define KERNEL_VMA 0xC0000000
+#endif
+
+/* Physical address of a kernel symbol */
+#define KERNEL_PHYS(addr) ((uint32_t)(addr) - KERNEL_VMA)
+
+/* Frames below this are in the direct map, at a virtual address equal to their physical address. Everything above it is kernel space */
+#define VMM_DIRECT_MAP_FRAMES ((KERNEL_VMA != 0) ? (KERNEL_VMA >> 12) : 0x100000)
+
+/* Page directory and page table entry flags */
+#define VMM_PRESENT 0x001
+#define VMM_WRITE 0x002
+#define VMM_USER 0x004
+#define VMM_WRITE_THROUGH 0x008
+#define VMM_NO_CACHE 0x010
+#define VMM_ACCESSED 0x020
+#define VMM_DIRTY 0x040
+#define VMM_LARGE 0x080             /* page directory entry maps a 4 MiB page (PSE) */
+
+/* Page fault error code bits */
+#define VMM_FAULT_PRESENT 0x1       /* the page was present, so the access broke its protection */
+#define VMM_FAULT_WRITE 0x2
+#define VMM_FAULT_USER 0x4
+
+/* Number of demand-zero regions that can be registered */
+#define VMM_REGION_COUNT 4
+
+/* Part of kernel space that is reserved up front and mapped one page at a time, to a zeroed frame the first time the page is touched */
+struct s_vmm_region {
+    uint32_t start;             /* 0 if the slot is unused */
+    uint32_t end;
+    uint32_t fault_around;      /* pages mapped together on a fault, in an aligned group around the page touched. A power of two */
+};
+
+typedef struct s_vmm_region vmm_region_t;
+
+/* Page directory of the kernel's address space. boot.s fills in the first entries */
+extern uint32_t vmm_page_directory[1024];
+
+/* Page fault ISR in fault.s, calls vmm_page_fault */
+void page_fault_wrap(void);
+
+/* Reserve pages of kernel space that are mapped to zeroed frames on first touch, with fault_around pages mapped at a time. Returns non-zero if not successful, or if vmm_init hasn't been called */
+int vmm_demand_zero(void *start, size_t pages, uint32_t fault_around);
+
+/* Flush the whole TLB, after pages were unmapped with vmm_unmap_lazy */
+void vmm_flush(void);
+
+/* Check if a page fault is being handled. The code that faulted may be stopped halfway through changing its data */
+int vmm_in_fault(void);
+
+/* Map the direct map and the whole kernel with 4 MiB pages. Must be called before anything uses memory above the first 4 MiB, including bootmem_alloc and pgalloc_init */
+void vmm_init(void);
+
+/* Map a page of kernel space to a frame. Page tables are allocated from pgalloc. Returns non-zero if not successful, or if the page is already mapped */
+int vmm_map(void *virt, uint32_t phys, uint32_t flags);
+
+/* Point the mapping of a frame at another frame, once its contents were copied there. The page table entry is found from where the page database records vmm_map mapped the frame (pgalloc_mapping). Returns non-zero if the frame is not mapped by a page table */
+int vmm_migrate(void *from, void *to);
+
+/* Handle a page fault. A page of a demand-zero region is mapped to a zeroed frame, anything else halts the kernel */
+void vmm_page_fault(uint32_t addr, uint32_t error);
+
+/* Get the physical address virtual memory is mapped to. Returns non-zero if it is not mapped */
+int vmm_phys(void *virt, uint32_t *phys);
+
+/* Print current state of the kernel's address space */
+void vmm_print_diagnostics(void);
+
+/* Unmap the pages of a demand-zero region that have been touched and free their frames, so they read as zero again. Returns the number of frames freed */
+uint32_t vmm_release(void *start, size_t pages);
+
+/* Remove the mapping of a page */
+void vmm_unmap(void *virt);
+
+/* Remove the mapping of a page without invalidating its TLB entry, so many pages can be unmapped with one vmm_flush. The frame must not be reused before then. Returns non-zero if the page was not mapped */
+int vmm_unmap_lazy(void *virt, uint32_t *phys);
@@ -5,14 +5,21 @@
 .set MAGIC,    0x1BADB002       /* 'magic number' lets bootloader find the header */
 .set CHECKSUM, -(MAGIC + FLAGS) /* checksum of above, to prove we are multiboot */
 
+/* Virtual address the kernel is linked at, the same as in linker.ld and vmm.h */
+.set KERNEL_VMA, 0xC0000000
+
+/* Page directory entry flags: present, writable, 4 MiB page */
+.set PDE_4M,   0x83
+
 /* 
 Declare a multiboot header that marks the program as a kernel. These are magic
 values that are documented in the multiboot standard. The bootloader will
 search for this signature in the first 8 KiB of the kernel file, aligned at a
 32-bit boundary. The signature is in its own section so the header can be
-forced to be within the first 8 KiB of the kernel file.
+forced to be within the first 8 KiB of the kernel file. It is linked at its
+physical address, as paging is off when the bootloader reads it.
 */
-.section .multiboot
+.section .multiboot.data, "aw"
 .align 4
 .long MAGIC
 .long FLAGS
@@ -40,8 +47,10 @@ stack_top:
 The linker script specifies _start as the entry point to the kernel and the
 bootloader will jump to this position once the kernel has been loaded. It
 doesn't make sense to return from this function as the bootloader is gone.
+_start runs before paging is on, so it is linked at its physical address like
+the multiboot header. The rest of the kernel is linked in the higher half.
 */
-.section .text
+.section .multiboot.text, "ax"
 .global _start
 .type _start, @function
 _start:
@@ -58,6 +67,43 @@ _start:
 	machine.
 	*/
 
+	/*
+	The kernel is linked at KERNEL_VMA + 2 MiB, so paging has to be on
+	before any of it runs. The first 4 MiB of memory are mapped twice with
+	a single 4 MiB page each: at 0, so this code keeps running after paging
+	is enabled, and at KERNEL_VMA, where the kernel is linked. vmm_init
+	adds the rest of memory to the same page directory later. The page
+	directory is in the bss, which the bootloader has cleared, and is
+	reached by its physical address since paging is still off. ebx holds
+	the multiboot information, so it is left alone.
+	*/
+	movl $(vmm_page_directory - KERNEL_VMA), %ecx
+	movl $PDE_4M, (%ecx)
+	movl $PDE_4M, ((KERNEL_VMA >> 22) * 4)(%ecx)
+	movl %ecx, %cr3
+
+	/* Enable 4 MiB pages (PSE) */
+	movl %cr4, %ecx
+	orl $0x00000010, %ecx
+	movl %ecx, %cr4
+
+	/* Enable paging, and write protection for the kernel too */
+	movl %cr0, %ecx
+	orl $0x80010000, %ecx
+	movl %ecx, %cr0
+
+	/* Jump to the higher half with an absolute jump */
+	movl $higher_half, %ecx
+	jmp *%ecx
+
+/*
+Set the size of the _start symbol to the current location '.' minus its start.
+This is useful when debugging or when you implement call tracing.
+*/
+.size _start, . - _start
+
+.section .text
+higher_half:
 	/*
 	To set up a stack, we set the esp register to point to the top of the
 	stack (as it grows downwards on x86 systems). This is necessarily done
@@ -71,7 +117,7 @@ _start:
 	environment where crucial features are offline. Note that the
 	processor is not fully initialized yet: Features such as floating
 	point instructions and instruction set extensions are not initialized
-	yet. The GDT should be loaded here. Paging should be enabled here.
+	yet. The GDT should be loaded here.
 	C++ features such as global constructors and exceptions will require
 	runtime support to work as well.
 	*/
@@ -79,6 +125,54 @@ _start:
 	/* Store the pointer to the Multiboot data structure */
 	movl %ebx, (multiboot_info)
 
+	/*
+	The bootloader's GDT may be anywhere in memory, including memory the
+	allocators hand out, and every interrupt reloads CS from it. Load one
+	of our own.
+	*/
+	call gdt_init
+	lgdt (gdt_gdtr)
+
+	/* Load CS */
+	jmp $0x8,$higher_half_reload_cs
+higher_half_reload_cs:
+	/* Load DS, ES, FS, GS, SS */
+	mov $0x10,%ax
+	mov %ax,%ds
+	mov %ax,%es
+	mov %ax,%fs
+	mov %ax,%gs
+	mov %ax,%ss
+
+	/*
+	Initialize the FPU, which printf uses for doubles. Clear EM (emulate)
+	and TS (task switched) in cr0 so x87 instructions run instead of
+	faulting, set MP (monitor coprocessor) so wait does too, and NE so FPU
+	errors are reported as exception 16 instead of through the legacy IRQ
+	13 wiring. fninit then resets it to round to nearest with all
+	exceptions masked.
+	*/
+	movl %cr0, %ecx
+	andl $~0x0000000C, %ecx
+	orl $0x00000022, %ecx
+	movl %ecx, %cr0
+	fninit
+
+	/*
+	Enable SSE if the CPU has it (cpuid leaf 1, edx bit 25): OSFXSR in cr4
+	lets SSE instructions and fxsave run, and OSXMMEXCPT reports their
+	unmasked exceptions as exception 19. The multiboot pointer in ebx was
+	stored above, so cpuid may overwrite it.
+	*/
+	movl $1, %eax
+	cpuid
+	testl $0x02000000, %edx
+	jz higher_half_no_sse
+	movl %cr4, %ecx
+	orl $0x00000600, %ecx
+	movl %ecx, %cr4
+higher_half_no_sse:
+
 	/*
 	Enter the high-level kernel. The ABI requires the stack is 16-byte
 	aligned at the time of the call instruction (which afterwards pushes
@@ -105,8 +199,3 @@ _start:
 1:	hlt
 	jmp 1b
 
-/*
-Set the size of the _start symbol to the current location '.' minus its start.
-This is useful when debugging or when you implement call tracing.
-*/
-.size _start, . - _start
@@ -0,0 +1,121 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bootmem.h>
+#include <multiboot.h>
+#include <pgalloc.h>
+#include <trace.h>
+
+/*
+    Boot memory allocator. Hands out memory by moving a pointer through one run of available memory, normally the
+    part of the memory map entry holding the kernel that comes after it, so it works before anything else is set up.
+    Nothing is ever freed. pgalloc_init takes its own arrays from it, then calls bootmem_finish and keeps the pages
+    that were used out of the free map, recorded as an allocation owned by the boot allocator.
+*/
+
+/* Region boot memory is taken from, and the next free byte in it */
+static uint32_t bootmem_start = 0;
+static uint32_t bootmem_next = 0;
+static uint32_t bootmem_limit = 0;
+
+/* Whether the region has been picked, and whether bootmem_finish has been called */
+static int bootmem_ready = 0;
+static int bootmem_done = 0;
+
+/* Take memory that is in use out of the region. Bounds in bytes */
+static void bootmem_avoid(uint32_t start, uint32_t end) {
+    if (end <= bootmem_start || start >= bootmem_limit) {
+        return;
+    }
+
+    if (start <= bootmem_start) {
+        bootmem_start = (end + 0xfff) & ~0xfff;
+        if (bootmem_start > bootmem_limit) {
+            bootmem_start = bootmem_limit;
+        }
+    } else {
+        bootmem_limit = start & ~0xfff;
+    }
+}
+
+/* Pick the region from the memory map: the available memory right after the kernel, or the largest run of available memory in the direct map if the kernel isn't in available memory */
+static void bootmem_setup(void) {
+    uint32_t kernel = (KERNEL_PHYS(&kernel_end) + 0xfff) & ~0xfff;
+    uint64_t limit = (uint64_t) VMM_DIRECT_MAP_FRAMES << 12;
+    if (limit > 0xfffff000) {
+        limit = 0xfffff000;
+    }
+    int map_size = multiboot_info->mmap_length / sizeof(multiboot_memory_map_t);
+
+    bootmem_ready = 1;
+    for (int i=0; i<map_size; i++) {
+        if (multiboot_info->mmap_addr[i].type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+
+        uint64_t first = (multiboot_info->mmap_addr[i].addr + 0xfff) & ~0xfffull;
+        uint64_t last = (multiboot_info->mmap_addr[i].addr + multiboot_info->mmap_addr[i].len) & ~0xfffull;
+
+        /* Only memory in the direct map, and not the first page, so no allocation is at NULL */
+        if (first < 0x1000) {
+            first = 0x1000;
+        }
+        if (last > limit) {
+            last = limit;
+        }
+        if (first >= last) {
+            continue;
+        }
+
+        if (kernel >= first && kernel < last) {
+            bootmem_start = kernel;
+            bootmem_limit = (uint32_t) last;
+            break;
+        }
+
+        if (last - first > bootmem_limit - bootmem_start) {
+            bootmem_start = (uint32_t) first;
+            bootmem_limit = (uint32_t) last;
+        }
+    }
+
+    /* The multiboot information is still read by pgalloc_init */
+    bootmem_avoid((uint32_t) multiboot_info, (uint32_t) multiboot_info + sizeof(multiboot_info_t));
+    bootmem_avoid((uint32_t) multiboot_info->mmap_addr, (uint32_t) multiboot_info->mmap_addr + multiboot_info->mmap_length);
+
+    bootmem_next = bootmem_start;
+}
+
+/* Allocate memory during boot, before the page allocator is initialized. Alignment must be a power of two. The memory is not cleared and can't be freed. Returns NULL if not successful, or if bootmem_finish has been called */
+void *bootmem_alloc(size_t size, size_t align) {
+    if (!bootmem_ready) {
+        bootmem_setup();
+    }
+
+    if (bootmem_done) {
+        trace(TRACE_BOOTMEM_DONE, NULL, size);
+        return NULL;
+    }
+
+    uint32_t addr = (bootmem_next + align - 1) & ~(align - 1);
+    if (addr < bootmem_next || addr > bootmem_limit || size > bootmem_limit - addr) {
+        trace(TRACE_BOOTMEM_NO_ROOM, NULL, size);
+        return NULL;
+    }
+
+    bootmem_next = addr + size;
+
+    trace(TRACE_BOOTMEM, (void *) addr, size);
+    return (void *) addr;
+}
+
+/* Stop handing out boot memory, and get the pages it used. Bounds in bytes, page aligned */
+void bootmem_finish(uint32_t *start, uint32_t *end) {
+    if (!bootmem_ready) {
+        bootmem_setup();
+    }
+
+    bootmem_done = 1;
+    *start = bootmem_start;
+    *end = (bootmem_next + 0xfff) & ~0xfff;
+}
@@ -0,0 +1,591 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <dtoa.h>
+
+/*
+    Decimal digits of doubles, for printf. dtoa_shortest finds the shortest digits that read back as the same double
+    with Ryu (Ulf Adams, 2018): the double and the halfway points to its neighbours are scaled by a power of ten with
+    a 64 by 128 bit multiplication each, then digits are dropped while the scaled interval still holds a number. The
+    125 bit powers of 5 it multiplies by are made from a table of every 26th power times a small power of 5, plus a
+    correction of 0 to 3, instead of a table of all 668 of them. Dividing by 5, 10 and 100 is done by multiplying by
+    the inverse, since 64 bit division is a call into libgcc. dtoa_round finds the exact digits of a double with a
+    bignum on the stack, 9 at a time, and rounds them to the digits asked for.
+*/
+
+/* 5^0 to 5^25 */
+static const uint64_t DTOA_POW5[DTOA_POW5_COUNT] = {
+    1ULL, 5ULL, 25ULL, 125ULL,
+    625ULL, 3125ULL, 15625ULL, 78125ULL,
+    390625ULL, 1953125ULL, 9765625ULL, 48828125ULL,
+    244140625ULL, 1220703125ULL, 6103515625ULL, 30517578125ULL,
+    152587890625ULL, 762939453125ULL, 3814697265625ULL, 19073486328125ULL,
+    95367431640625ULL, 476837158203125ULL, 2384185791015625ULL, 11920928955078125ULL,
+    59604644775390625ULL, 298023223876953125ULL,
+};
+
+/* 5^(26i) to 125 bits, low and high half */
+static const uint64_t DTOA_POW5_SPLIT[13][2] = {
+    { 0ULL, 1152921504606846976ULL },
+    { 0ULL, 1490116119384765625ULL },
+    { 1032610780636961552ULL, 1925929944387235853ULL },
+    { 7910200175544436838ULL, 1244603055572228341ULL },
+    { 16941905809032713930ULL, 1608611746708759036ULL },
+    { 13024893955298202172ULL, 2079081953128979843ULL },
+    { 6607496772837067824ULL, 1343575221513417750ULL },
+    { 17332926989895652603ULL, 1736530273035216783ULL },
+    { 13037379183483547984ULL, 2244412773384604712ULL },
+    { 1605989338741628675ULL, 1450417759929778918ULL },
+    { 9630225068416591280ULL, 1874621017369538693ULL },
+    { 665883850346957067ULL, 1211445438634777304ULL },
+    { 14931890668723713708ULL, 1565756531257009982ULL },
+};
+
+/* 2^(bits + 124) / 5^(26i), rounded up, low and high half */
+static const uint64_t DTOA_POW5_INV_SPLIT[15][2] = {
+    { 1ULL, 2305843009213693952ULL },
+    { 5955668970331000884ULL, 1784059615882449851ULL },
+    { 8982663654677661702ULL, 1380349269358112757ULL },
+    { 7286864317269821294ULL, 2135987035920910082ULL },
+    { 7005857020398200553ULL, 1652639921975621497ULL },
+    { 17965325103354776697ULL, 1278668206209430417ULL },
+    { 8928596168509315048ULL, 1978643211784836272ULL },
+    { 10075671573058298858ULL, 1530901034580419511ULL },
+    { 597001226353042382ULL, 1184477304306571148ULL },
+    { 1527430471115325346ULL, 1832889850782397517ULL },
+    { 12533209867169019542ULL, 1418129833677084982ULL },
+    { 5577825024675947042ULL, 2194449627517475473ULL },
+    { 11006974540203867551ULL, 1697873161311732311ULL },
+    { 10313493231639821582ULL, 1313665730009899186ULL },
+    { 12701016819766672773ULL, 2032799256770390445ULL },
+};
+
+/* What the products of two table entries are short of the exact value, two bits each */
+static const uint32_t DTOA_POW5_OFFSETS[21] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x40000000, 0x59695995, 0x55545555, 0x56555515,
+    0x41150504, 0x40555410, 0x44555145, 0x44504540,
+    0x45555550, 0x40004000, 0x96440440, 0x55565565,
+    0x54454045, 0x40154151, 0x55559155, 0x51405555,
+    0x00000105,
+};
+static const uint32_t DTOA_POW5_INV_OFFSETS[22] = {
+    0x54544554, 0x04055545, 0x10041000, 0x00400414,
+    0x40010000, 0x41155555, 0x00000454, 0x00010044,
+    0x40000000, 0x44000041, 0x50454450, 0x55550054,
+    0x51655554, 0x40004000, 0x01000001, 0x00010500,
+    0x51515411, 0x05555554, 0x50411500, 0x40040000,
+    0x05040110, 0x00000000,
+};
+
+/* Parts of a double */
+static inline uint64_t dtoa_bits(double v) {
+    union { double d; uint64_t u; } bits = { .d = v };
+    return bits.u;
+}
+
+/* Multiply two 64 bit numbers into 128 bits, with 32 bit multiplications */
+static inline uint64_t dtoa_umul128(uint64_t a, uint64_t b, uint64_t *high) {
+    uint32_t a_lo = (uint32_t) a, a_hi = (uint32_t)(a >> 32);
+    uint32_t b_lo = (uint32_t) b, b_hi = (uint32_t)(b >> 32);
+
+    uint64_t b00 = (uint64_t) a_lo * b_lo;
+    uint64_t b01 = (uint64_t) a_lo * b_hi;
+    uint64_t b10 = (uint64_t) a_hi * b_lo;
+    uint64_t b11 = (uint64_t) a_hi * b_hi;
+
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t) mid1;
+
+    *high = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t) b00;
+}
+
+/* High 64 bits of a 64 by 64 bit multiplication */
+static inline uint64_t dtoa_umulh(uint64_t a, uint64_t b) {
+    uint64_t high;
+    dtoa_umul128(a, b, &high);
+    return high;
+}
+
+/* Shift a 128 bit number right by 1 to 63 bits, keeping the low 64 bits */
+static inline uint64_t dtoa_shiftright128(uint64_t lo, uint64_t hi, uint32_t dist) {
+    return (hi << (64 - dist)) | (lo >> dist);
+}
+
+/* Divide by 5, 10 and 100 */
+static inline uint64_t dtoa_div5(uint64_t x) {
+    return dtoa_umulh(x, 0xCCCCCCCCCCCCCCCDULL) >> 2;
+}
+
+static inline uint64_t dtoa_div10(uint64_t x) {
+    return dtoa_umulh(x, 0xCCCCCCCCCCCCCCCDULL) >> 3;
+}
+
+static inline uint64_t dtoa_div100(uint64_t x) {
+    return dtoa_umulh(x >> 2, 0x28F5C28F5C28F5C3ULL) >> 2;
+}
+
+/* Bits of 5^e, for 0 <= e <= 3528. 1 for 5^0 */
+static inline int32_t dtoa_pow5_bits(int32_t e) {
+    return (int32_t)(((uint32_t) e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) and floor(log10(5^e)), for 0 <= e <= 1650 */
+static inline uint32_t dtoa_log10_pow2(int32_t e) {
+    return ((uint32_t) e * 78913) >> 18;
+}
+
+static inline uint32_t dtoa_log10_pow5(int32_t e) {
+    return ((uint32_t) e * 732923) >> 20;
+}
+
+/* Number of times 5 divides a number that isn't 0 */
+static uint32_t dtoa_pow5_factor(uint64_t v) {
+    uint32_t count = 0;
+    for (;;) {
+        uint64_t q = dtoa_div5(v);
+        if ((uint32_t) v - 5 * (uint32_t) q != 0) {
+            return count;
+        }
+        v = q;
+        count++;
+    }
+}
+
+/* Check if 5^p or 2^p divides a number */
+static inline bool dtoa_multiple_of_pow5(uint64_t v, uint32_t p) {
+    return dtoa_pow5_factor(v) >= p;
+}
+
+static inline bool dtoa_multiple_of_pow2(uint64_t v, uint32_t p) {
+    return (v & ((1ULL << p) - 1)) == 0;
+}
+
+/* Get 5^i scaled to 125 bits, from the entry for the multiple of 26 below it */
+static void dtoa_pow5(uint32_t i, uint64_t *result) {
+    uint32_t base = i / DTOA_POW5_COUNT;
+    uint32_t base2 = base * DTOA_POW5_COUNT;
+    uint32_t offset = i - base2;
+    const uint64_t *mul = DTOA_POW5_SPLIT[base];
+    if (offset == 0) {
+        result[0] = mul[0];
+        result[1] = mul[1];
+        return;
+    }
+
+    uint64_t m = DTOA_POW5[offset];
+    uint64_t high1;
+    uint64_t low1 = dtoa_umul128(m, mul[1], &high1);
+    uint64_t high0;
+    uint64_t low0 = dtoa_umul128(m, mul[0], &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+
+    uint32_t delta = dtoa_pow5_bits(i) - dtoa_pow5_bits(base2);
+    result[0] = dtoa_shiftright128(low0, sum, delta) + ((DTOA_POW5_OFFSETS[i / 16] >> ((i % 16) << 1)) & 3);
+    result[1] = dtoa_shiftright128(sum, high1, delta);
+}
+
+/* Get 2^(bits of 5^i + 124) / 5^i rounded up, from the entry for the multiple of 26 above it */
+static void dtoa_pow5_inv(uint32_t i, uint64_t *result) {
+    uint32_t base = (i + DTOA_POW5_COUNT - 1) / DTOA_POW5_COUNT;
+    uint32_t base2 = base * DTOA_POW5_COUNT;
+    uint32_t offset = base2 - i;
+    const uint64_t *mul = DTOA_POW5_INV_SPLIT[base];
+    if (offset == 0) {
+        result[0] = mul[0];
+        result[1] = mul[1];
+        return;
+    }
+
+    uint64_t m = DTOA_POW5[offset];
+    uint64_t high1;
+    uint64_t low1 = dtoa_umul128(m, mul[1], &high1);
+    uint64_t high0;
+    uint64_t low0 = dtoa_umul128(m, mul[0] - 1, &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+
+    uint32_t delta = dtoa_pow5_bits(base2) - dtoa_pow5_bits(i);
+    result[0] = dtoa_shiftright128(low0, sum, delta) + 1 + ((DTOA_POW5_INV_OFFSETS[i / 16] >> ((i % 16) << 1)) & 3);
+    result[1] = dtoa_shiftright128(sum, high1, delta);
+}
+
+/* Multiply by a 125 bit power of 5 and shift right by j, which is more than 64 */
+static inline uint64_t dtoa_mul_shift(uint64_t m, const uint64_t *mul, int32_t j) {
+    uint64_t high1;
+    uint64_t low1 = dtoa_umul128(m, mul[1], &high1);
+    uint64_t high0;
+    dtoa_umul128(m, mul[0], &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+    return dtoa_shiftright128(sum, high1, j - 64);
+}
+
+/* Find the shortest decimal that reads back as the same double, for finite doubles greater than 0 */
+uint64_t dtoa_shortest(double v, int *exponent) {
+    uint64_t bits = dtoa_bits(v);
+    uint64_t ieee_mantissa = bits & ((1ULL << DTOA_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (uint32_t)(bits >> DTOA_MANTISSA_BITS) & 0x7ff;
+
+    /* The double is m2 * 2^e2. Two more bits make room for the halfway points to its neighbours */
+    int32_t e2;
+    uint64_t m2;
+    if (ieee_exponent == 0) {
+        e2 = 1 - DTOA_EXPONENT_BIAS - DTOA_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t) ieee_exponent - DTOA_EXPONENT_BIAS - DTOA_MANTISSA_BITS - 2;
+        m2 = (1ULL << DTOA_MANTISSA_BITS) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+
+    /* The interval of numbers that read back as this double is mm to mp, around mv. The gap below is half as wide at a power of 2 */
+    uint64_t mv = 4 * m2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+    /* Scale them by a power of ten: vr, vp and vm are mv, mp and mm times 2^e2 / 10^e10 */
+    uint64_t vr, vp, vm;
+    uint64_t mul[2];
+    int32_t e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+    if (e2 >= 0) {
+        uint32_t q = dtoa_log10_pow2(e2) - (e2 > 3);
+        e10 = (int32_t) q;
+        int32_t k = DTOA_POW5_BITS + dtoa_pow5_bits(q) - 1;
+        int32_t i = -e2 + (int32_t) q + k;
+        dtoa_pow5_inv(q, mul);
+        vr = dtoa_mul_shift(4 * m2, mul, i);
+        vp = dtoa_mul_shift(4 * m2 + 2, mul, i);
+        vm = dtoa_mul_shift(4 * m2 - 1 - mm_shift, mul, i);
+
+        /* Whether the digits dropped below are all 0. Only possible if 5^q divides them */
+        if (q <= 21) {
+            uint32_t mv_mod5 = (uint32_t) mv - 5 * (uint32_t) dtoa_div5(mv);
+            if (mv_mod5 == 0) {
+                vr_trailing_zeros = dtoa_multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = dtoa_multiple_of_pow5(mv - 1 - mm_shift, q);
+            } else {
+                vp -= dtoa_multiple_of_pow5(mv + 2, q);
+            }
+        }
+    } else {
+        uint32_t q = dtoa_log10_pow5(-e2) - (-e2 > 1);
+        e10 = (int32_t) q + e2;
+        int32_t i = -e2 - (int32_t) q;
+        int32_t k = dtoa_pow5_bits(i) - DTOA_POW5_BITS;
+        int32_t j = (int32_t) q - k;
+        dtoa_pow5(i, mul);
+        vr = dtoa_mul_shift(4 * m2, mul, j);
+        vp = dtoa_mul_shift(4 * m2 + 2, mul, j);
+        vm = dtoa_mul_shift(4 * m2 - 1 - mm_shift, mul, j);
+
+        /* Whether the digits dropped below are all 0. Only possible if 2^q divides them */
+        if (q <= 1) {
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vr_trailing_zeros = dtoa_multiple_of_pow2(mv, q);
+        }
+    }
+
+    /* Drop digits while the interval still holds a number with fewer of them */
+    int32_t removed = 0;
+    uint32_t last_removed = 0;
+    uint64_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        /* Rare: the bounds or the double itself end in zeros, so ties have to be looked at */
+        for (;;) {
+            uint64_t vp_div10 = dtoa_div10(vp);
+            uint64_t vm_div10 = dtoa_div10(vm);
+            if (vp_div10 <= vm_div10) {
+                break;
+            }
+            uint32_t vm_mod10 = (uint32_t) vm - 10 * (uint32_t) vm_div10;
+            uint64_t vr_div10 = dtoa_div10(vr);
+            uint32_t vr_mod10 = (uint32_t) vr - 10 * (uint32_t) vr_div10;
+            vm_trailing_zeros &= vm_mod10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = vr_mod10;
+            vr = vr_div10;
+            vp = vp_div10;
+            vm = vm_div10;
+            removed++;
+        }
+
+        if (vm_trailing_zeros) {
+            for (;;) {
+                uint64_t vm_div10 = dtoa_div10(vm);
+                uint32_t vm_mod10 = (uint32_t) vm - 10 * (uint32_t) vm_div10;
+                if (vm_mod10 != 0) {
+                    break;
+                }
+                uint64_t vp_div10 = dtoa_div10(vp);
+                uint64_t vr_div10 = dtoa_div10(vr);
+                uint32_t vr_mod10 = (uint32_t) vr - 10 * (uint32_t) vr_div10;
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = vr_mod10;
+                vr = vr_div10;
+                vp = vp_div10;
+                vm = vm_div10;
+                removed++;
+            }
+        }
+
+        /* Exactly halfway rounds to even */
+        if (vr_trailing_zeros && last_removed == 5 && (vr & 1) == 0) {
+            last_removed = 4;
+        }
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+    } else {
+        /* Common: two digits at a time first */
+        bool round_up = false;
+        uint64_t vp_div100 = dtoa_div100(vp);
+        uint64_t vm_div100 = dtoa_div100(vm);
+        if (vp_div100 > vm_div100) {
+            uint64_t vr_div100 = dtoa_div100(vr);
+            uint32_t vr_mod100 = (uint32_t) vr - 100 * (uint32_t) vr_div100;
+            round_up = vr_mod100 >= 50;
+            vr = vr_div100;
+            vp = vp_div100;
+            vm = vm_div100;
+            removed += 2;
+        }
+
+        for (;;) {
+            uint64_t vp_div10 = dtoa_div10(vp);
+            uint64_t vm_div10 = dtoa_div10(vm);
+            if (vp_div10 <= vm_div10) {
+                break;
+            }
+            uint64_t vr_div10 = dtoa_div10(vr);
+            uint32_t vr_mod10 = (uint32_t) vr - 10 * (uint32_t) vr_div10;
+            round_up = vr_mod10 >= 5;
+            vr = vr_div10;
+            vp = vp_div10;
+            vm = vm_div10;
+            removed++;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+
+    *exponent = e10 + removed;
+    return output;
+}
+
+/* Digits of an exact value being collected by dtoa_round */
+struct s_dtoa_digits {
+    char *digits;
+    int count;          /* digits kept */
+    int exponent;       /* power of ten of the next digit */
+    int first;          /* power of ten of the first digit that isn't 0 */
+    int needed;         /* digits wanted, known from the first digit that isn't 0 */
+    int precision;
+    bool fixed;
+    bool started;       /* a digit that isn't 0 has been seen */
+    bool sticky;        /* a digit that isn't 0 has been seen after the one to round with */
+};
+typedef struct s_dtoa_digits dtoa_digits_t;
+
+/* Take the next digit of an exact value. Returns true once the rest don't matter */
+static bool dtoa_put(dtoa_digits_t *d, uint32_t digit) {
+    if (!d->started) {
+        if (digit == 0) {
+            /* Leading zeros. Past the last digit wanted, the value rounds to 0 */
+            d->exponent--;
+            return d->fixed && d->exponent < -d->precision - 1;
+        }
+
+        d->started = true;
+        d->first = d->exponent;
+        d->needed = d->fixed ? d->first + 1 + d->precision : d->precision;
+        if (d->needed < 0) {
+            return true;
+        }
+    }
+
+    d->exponent--;
+    if (d->count <= d->needed && d->count < DTOA_DIGITS_MAX) {
+        d->digits[d->count++] = '0' + digit;
+        return false;
+    }
+
+    d->sticky |= digit != 0;
+    return d->sticky;
+}
+
+/* Take a number of digits from the top of a chunk. Returns true once the rest don't matter */
+static bool dtoa_put_chunk(dtoa_digits_t *d, uint32_t chunk, int count) {
+    char buf[9];
+    for (int i=count-1; i>=0; i--) {
+        buf[i] = chunk % 10;
+        chunk /= 10;
+    }
+
+    for (int i=0; i<count; i++) {
+        if (dtoa_put(d, buf[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Put a number of up to 53 bits into a bignum, shifted left. Returns the words in use */
+static int dtoa_big_set(uint32_t *big, int words, uint64_t v, int shift) {
+    for (int i=0; i<words; i++) {
+        big[i] = 0;
+    }
+
+    int word = shift / 32;
+    int bit = shift % 32;
+    big[word] = (uint32_t)(v << bit);
+    big[word + 1] = (uint32_t)(v >> (32 - bit));
+    if (bit != 0) {
+        big[word + 2] = (uint32_t)(v >> (64 - bit));
+    }
+
+    while (words > 0 && big[words - 1] == 0) {
+        words--;
+    }
+    return words;
+}
+
+/* Put the digits of a whole number that isn't 0, given as chunks of 9 from the bottom up */
+static bool dtoa_put_whole(dtoa_digits_t *d, const uint32_t *chunks, int count) {
+    /* The top chunk has no leading zeros */
+    int top = 1;
+    for (uint32_t p = 10; top < 9 && chunks[count - 1] >= p; p *= 10) {
+        top++;
+    }
+    d->exponent = top + 9 * (count - 1) - 1;
+
+    if (dtoa_put_chunk(d, chunks[count - 1], top)) {
+        return true;
+    }
+    for (int i=count-2; i>=0; i--) {
+        if (dtoa_put_chunk(d, chunks[i], 9)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Find the digits of a finite double greater than 0, rounded to a number of digits */
+int dtoa_round(double v, int precision, bool fixed, char *digits, int *exponent) {
+    uint64_t bits = dtoa_bits(v);
+    uint64_t m = bits & ((1ULL << DTOA_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (uint32_t)(bits >> DTOA_MANTISSA_BITS) & 0x7ff;
+    int e2 = 1 - DTOA_EXPONENT_BIAS - DTOA_MANTISSA_BITS;
+    if (ieee_exponent != 0) {
+        m |= 1ULL << DTOA_MANTISSA_BITS;
+        e2 = (int) ieee_exponent - DTOA_EXPONENT_BIAS - DTOA_MANTISSA_BITS;
+    }
+
+    dtoa_digits_t d = { digits, 0, -1, 0, 0, precision, fixed, false, false };
+    uint32_t big[DTOA_BIG_WORDS];
+    uint32_t chunks[DTOA_BIG_WORDS + 1];
+    int count = 0;
+
+    if (e2 >= 0) {
+        /* A whole number, m * 2^e2. Its digits come from dividing by 10^9 */
+        int words = dtoa_big_set(big, DTOA_BIG_WORDS, m, e2);
+        while (words > 0) {
+            uint32_t rem = 0;
+            for (int i=words-1; i>=0; i--) {
+                uint64_t cur = ((uint64_t) rem << 32) | big[i];
+                big[i] = (uint32_t)(cur / 1000000000);
+                rem = (uint32_t)(cur % 1000000000);
+            }
+            chunks[count++] = rem;
+            while (words > 0 && big[words - 1] == 0) {
+                words--;
+            }
+        }
+        dtoa_put_whole(&d, chunks, count);
+    } else {
+        /* The whole part fits in 53 bits */
+        int k = -e2;
+        uint64_t whole = (k < 64) ? m >> k : 0;
+        bool done = false;
+        if (whole != 0) {
+            for (uint64_t rest = whole; rest != 0; rest /= 1000000000) {
+                chunks[count++] = (uint32_t)(rest % 1000000000);
+            }
+            done = dtoa_put_whole(&d, chunks, count);
+        }
+
+        /* The fraction is a bignum over 2^(32 * words). Multiplying it by 10^9 carries out the next 9 digits */
+        uint64_t fraction = (k < 64) ? m & ((1ULL << k) - 1) : m;
+        int words = (k + 31) / 32;
+        dtoa_big_set(big, words, fraction, 32 * words - k);
+        int low = 0;
+        while (!done && fraction != 0) {
+            uint32_t carry = 0;
+            for (int i=low; i<words; i++) {
+                uint64_t cur = (uint64_t) big[i] * 1000000000 + carry;
+                big[i] = (uint32_t) cur;
+                carry = (uint32_t)(cur >> 32);
+            }
+            while (low < words && big[low] == 0) {
+                low++;
+            }
+
+            done = dtoa_put_chunk(&d, carry, 9);
+            if (low == words) {
+                break;
+            }
+            if (!done && d.started && d.count > d.needed) {
+                /* Everything needed is there, the rest only matters if it isn't 0 */
+                d.sticky = true;
+                break;
+            }
+        }
+    }
+
+    /* Rounds to 0 */
+    if (!d.started || d.needed < 0) {
+        *exponent = 0;
+        return 0;
+    }
+
+    /* Round to nearest at the digit after the ones wanted, ties to even */
+    *exponent = d.first;
+    count = d.count;
+    if (count > d.needed) {
+        char r = digits[d.needed];
+        bool odd = d.needed > 0 && ((digits[d.needed - 1] - '0') & 1);
+        bool up = r > '5' || (r == '5' && (d.sticky || odd));
+        count = d.needed;
+
+        if (up) {
+            int i = count - 1;
+            while (i >= 0 && digits[i] == '9') {
+                i--;
+            }
+            if (i < 0) {
+                digits[0] = '1';
+                count = 1;
+                (*exponent)++;
+            } else {
+                digits[i]++;
+                count = i + 1;
+            }
+        }
+    }
+
+    return count;
+}
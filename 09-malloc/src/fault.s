@@ -0,0 +1,20 @@
+/*
+Page fault ISR. The CPU pushes an error code, and the address that faulted is
+in cr2. vmm_page_fault either maps the page or halts, so when it returns the
+instruction that faulted is run again.
+*/
+.global page_fault_wrap
+.align 4
+.type page_fault_wrap, @function
+page_fault_wrap:
+    pushal
+    cld
+    pushl 32(%esp)          /* error code, above the 8 registers of pushal */
+    movl %cr2, %eax
+    pushl %eax
+    call vmm_page_fault
+    addl $8, %esp
+    popal
+    addl $4, %esp           /* pop the error code */
+    iret
+.size page_fault_wrap, . - page_fault_wrap
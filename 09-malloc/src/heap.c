@@ -1,176 +1,785 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <heap.h>
+#include <kmem.h>
 #include <pgalloc.h>
+#include <trace.h>
+#include <vmalloc.h>
+#include <vmm.h>
 
-heap_entry_t *heap_free_head = NULL;
-heap_entry_t *heap_free_tail = NULL;
+/* Free blocks, in a doubly linked list for each size class, and a bitmap of the size classes with a free block */
+static heap_entry_t *heap_free_lists[HEAP_FREE_CLASSES];
+static uint32_t heap_free_bitmap[(HEAP_FREE_CLASSES + 31) / 32];
+
+/* Size of the largest free block, if valid. It is cleared when that block leaves the free lists, and found again from the largest size class when read */
+static uint32_t heap_largest_free = 0;
+static int heap_largest_valid = 1;
+
+/* Arenas owned by the heap */
+heap_arena_t *heap_arenas = NULL;
+
+/* Object size of each size class */
+static const uint32_t heap_bin_sizes[HEAP_BIN_COUNT] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072};
+
+/* Cache names of each size class */
+static const char *heap_bin_names[HEAP_BIN_COUNT] = {
+    "malloc-8", "malloc-16", "malloc-24", "malloc-32", "malloc-48", "malloc-64",
+    "malloc-96", "malloc-128", "malloc-192", "malloc-256", "malloc-384", "malloc-512",
+    "malloc-768", "malloc-1024", "malloc-1536", "malloc-2048", "malloc-3072"
+};
+
+/* Size classes */
+kmem_cache_t *heap_bins[HEAP_BIN_COUNT];
+
+/* Smallest size class that fits a request, indexed by the request size divided by 8 */
+uint8_t heap_bin_index[(HEAP_BIN_MAX_SIZE / 8) + 1];
+
+/* Counters, kept up to date by every operation so they can be read at any time */
+static heap_stats_t heap_stats;
+
+/* Set if arenas come from the demand-zero region, and which of its arena-sized slots are in use */
+static int heap_region = 0;
+static uint32_t heap_region_slots[(HEAP_REGION_END - HEAP_REGION_START) / (HEAP_ARENA_PAGES * 4096 * 32)];
+
+/* Set if bin slabs come from the bin region. Each window has the pages of its slabs, 0 if it has none, and a bit for each of its slabs in use */
+static int heap_bin_region = 0;
+static uint8_t heap_bin_window_pages[HEAP_BIN_WINDOWS];
+static uint8_t heap_bin_window_used[HEAP_BIN_WINDOWS];
+
+/* Get the free list a block of a size goes in */
+static inline uint32_t heap_free_class(uint32_t size) {
+    if (size < HEAP_FREE_LINEAR) {
+        return size / 8;
+    }
+
+    /* The power of two the size is in, then which part of it */
+    uint32_t log2 = 31 - __builtin_clz(size);
+    uint32_t part = (size >> (log2 - HEAP_FREE_SL_LOG2)) & ((1 << HEAP_FREE_SL_LOG2) - 1);
+    return (HEAP_FREE_LINEAR / 8) + ((log2 - __builtin_ctz(HEAP_FREE_LINEAR)) << HEAP_FREE_SL_LOG2) + part;
+}
+
+/* Get the largest size class with a free block. Returns -1 if there are no free blocks */
+static int heap_largest_class(void) {
+    for (int i=(HEAP_FREE_CLASSES + 31) / 32 - 1; i>=0; i--) {
+        if (heap_free_bitmap[i] != 0) {
+            return (i * 32) + 31 - __builtin_clz(heap_free_bitmap[i]);
+        }
+    }
+
+    return -1;
+}
+
+/* Get a new arena, from the demand-zero region if there is one, otherwise from pgalloc. Returns NULL if not successful */
+static heap_arena_t *heap_new_arena(void) {
+    if (!heap_region) {
+        heap_arena_t *arena = (heap_arena_t *) pgalloc(HEAP_ARENA_PAGES);
+        if (arena != NULL) {
+            pgalloc_set_owner(arena, PGALLOC_OWNER_HEAP);
+            heap_stats.pgalloc_calls++;
+        }
+        return arena;
+    }
+
+    /* Nothing is mapped yet. Pages get their frames when the arena's boundary tags and blocks are first written */
+    for (uint32_t i=0; i<sizeof(heap_region_slots)/sizeof(heap_region_slots[0]); i++) {
+        if (heap_region_slots[i] != 0xffffffff) {
+            uint32_t bit = __builtin_ctz(~heap_region_slots[i]);
+            heap_region_slots[i] |= 1 << bit;
+            return (heap_arena_t *)(HEAP_REGION_START + (((i * 32) + bit) * HEAP_ARENA_PAGES * 4096));
+        }
+    }
+
+    return NULL;
+}
+
+/* Give back an empty arena whose block is in the free list, unmapping the frames of a region arena. Returns the number of pages freed */
+static uint32_t heap_free_arena(heap_entry_t *blk) {
+    heap_arena_t *arena = (heap_arena_t *)((void *) blk - sizeof(heap_arena_t));
+    trace(TRACE_FREE_RELEASE, arena, arena->pages);
+    heap_remove_free_block(blk);
+
+    if (arena->prev != NULL) {
+        arena->prev->next = arena->next;
+    } else {
+        heap_arenas = arena->next;
+    }
+    if (arena->next != NULL) {
+        arena->next->prev = arena->prev;
+    }
+
+    heap_stats.arenas--;
+    heap_stats.arenas_empty--;
+
+    if (!heap_region_addr(arena)) {
+        heap_stats.pgfree_calls++;
+        pgfree(arena);
+        return HEAP_ARENA_PAGES;
+    }
+
+    uint32_t slot = ((uint32_t) arena - HEAP_REGION_START) / (HEAP_ARENA_PAGES * 4096);
+    uint32_t freed = vmm_release(arena, HEAP_ARENA_PAGES);
+    heap_region_slots[slot / 32] &= ~(1 << (slot % 32));
+    return freed;
+}
+
+/* Get a slab for a bin from the bin region, in a window with slabs of the same size if there is one with room. Nothing is mapped until the slab is written. Returns NULL if not successful */
+static void *heap_bin_slab_alloc(uint32_t pages) {
+    uint32_t slabs = HEAP_BIN_WINDOW_PAGES / pages;
+    uint32_t full = (1 << slabs) - 1;
+    int empty = -1;
+
+    for (uint32_t i=0; i<HEAP_BIN_WINDOWS; i++) {
+        if (heap_bin_window_pages[i] == pages && heap_bin_window_used[i] != full) {
+            uint32_t slot = __builtin_ctz(~heap_bin_window_used[i]);
+            heap_bin_window_used[i] |= 1 << slot;
+            return (void *)(HEAP_BIN_REGION_START + (i * HEAP_BIN_WINDOW_PAGES * 4096) + (slot * pages * 4096));
+        }
+        if (empty < 0 && heap_bin_window_pages[i] == 0) {
+            empty = i;
+        }
+    }
+
+    if (empty < 0) {
+        return NULL;
+    }
+
+    heap_bin_window_pages[empty] = pages;
+    heap_bin_window_used[empty] = 1;
+    return (void *)(HEAP_BIN_REGION_START + (empty * HEAP_BIN_WINDOW_PAGES * 4096));
+}
+
+/* Give back a slab of the bin region, unmapping the frames it touched. Returns the number of pages freed */
+static uint32_t heap_bin_slab_free(void *slab, uint32_t pages) {
+    uint32_t offset = (uint32_t) slab - HEAP_BIN_REGION_START;
+    uint32_t window = offset / (HEAP_BIN_WINDOW_PAGES * 4096);
+    uint32_t slot = (offset % (HEAP_BIN_WINDOW_PAGES * 4096)) / (pages * 4096);
+
+    uint32_t freed = vmm_release(slab, pages);
+    heap_bin_window_used[window] &= ~(1 << slot);
+    if (heap_bin_window_used[window] == 0) {
+        heap_bin_window_pages[window] = 0;
+    }
+    return freed;
+}
+
+/* Get the first page of the bin region slab memory is in. Returns NULL if it isn't in a slab in use */
+static void *heap_bin_slab_head(void *ptr) {
+    if (!heap_bin_region_addr(ptr)) {
+        return NULL;
+    }
+
+    uint32_t offset = (uint32_t) ptr - HEAP_BIN_REGION_START;
+    uint32_t window = offset / (HEAP_BIN_WINDOW_PAGES * 4096);
+    uint32_t pages = heap_bin_window_pages[window];
+    if (pages == 0) {
+        return NULL;
+    }
+
+    uint32_t slot = (offset % (HEAP_BIN_WINDOW_PAGES * 4096)) / (pages * 4096);
+    if (!(heap_bin_window_used[window] & (1 << slot))) {
+        return NULL;
+    }
+
+    return (void *)(HEAP_BIN_REGION_START + (window * HEAP_BIN_WINDOW_PAGES * 4096) + (slot * pages * 4096));
+}
+
+/* Slabs of the size-class bins once paging is on */
+static const kmem_source_t heap_bin_source = {
+    .alloc = heap_bin_slab_alloc,
+    .free = heap_bin_slab_free,
+    .head = heap_bin_slab_head,
+};
+
+/* Get the slab of a size-class bin or other kmem cache an object resides in. Returns NULL if the pointer is not the start of an object in a slab */
+static kmem_slab_t *heap_slab_of(void *ptr) {
+    if (heap_bin_region_addr(ptr)) {
+        return kmem_source_slab_of(&heap_bin_source, ptr);
+    }
+
+    return kmem_slab_of(ptr);
+}
+
+/* Shrinker of the empty arenas kept for reuse */
+static uint32_t heap_shrink(uint32_t pages) {
+    /* A fault in an arena can stop the heap halfway through changing the free list */
+    if (vmm_in_fault()) {
+        return 0;
+    }
+
+    /* Empty arenas are the largest blocks there are, so only their free list is looked at */
+    uint32_t freed = 0;
+    heap_entry_t *blk = heap_free_lists[heap_free_class(HEAP_ARENA_BLOCK_SIZE)];
+    while (blk != NULL && freed < pages && heap_stats.arenas_empty != 0) {
+        heap_entry_t *next = blk->next;
+
+        if (blk->size == HEAP_ARENA_BLOCK_SIZE) {
+            freed += heap_free_arena(blk);
+        }
+
+        blk = next;
+    }
+
+    return freed;
+}
+
+/* Get which allocator memory came from. Region arenas and bin slabs are outside the direct map, so they aren't in the page database */
+static pgalloc_owner_t heap_owner(void *ptr) {
+    if (heap_region_addr(ptr)) {
+        return (heap_arena_of(ptr) != NULL) ? PGALLOC_OWNER_HEAP : PGALLOC_OWNER_NONE;
+    }
+    if (heap_bin_region_addr(ptr)) {
+        return (heap_bin_slab_head(ptr) != NULL) ? PGALLOC_OWNER_SLAB : PGALLOC_OWNER_NONE;
+    }
+
+    return pgalloc_owner(ptr);
+}
+
+/* Allocate whole pages for a large request, physically contiguous if possible and from vmalloc if no run of free pages is long enough. Returns NULL if not successful */
+static void *heap_alloc_pages(size_t pages, int zeroed) {
+    trace(TRACE_MALLOC_PAGES, NULL, pages);
+    void *ptr = zeroed ? pgalloc_zeroed(pages) : pgalloc(pages);
+    heap_stats.pgalloc_calls++;
+
+    if (ptr != NULL) {
+        pgalloc_set_owner(ptr, PGALLOC_OWNER_LARGE);
+        return ptr;
+    }
+
+    /* A fragmented free map can have enough free pages, just not next to each other */
+    if (pages > 1) {
+        trace(TRACE_MALLOC_VMALLOC, NULL, pages);
+        ptr = vmalloc(pages * 4096);
+    }
+
+    if (ptr != NULL) {
+        heap_stats.vmalloc_calls++;
+        if (zeroed) {
+            memset(ptr, 0, pages * 4096);
+        }
+    }
+    return ptr;
+}
+
+/* Allocate memory aligned to a power of two. Returns NULL if not successful */
+void *aligned_alloc(size_t alignment, size_t size) {
+    trace(TRACE_MALLOC_ALIGNED, NULL, alignment);
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > 4096) {
+        trace(TRACE_MALLOC_BAD_ALIGN, NULL, alignment);
+        return NULL;
+    }
+
+    /* Everything malloc returns is aligned to 8 bytes */
+    if (alignment <= 8) {
+        return malloc(size);
+    }
+
+    if (size == 0) {
+        trace(TRACE_MALLOC_ZERO, NULL, 0);
+        return NULL;
+    }
+    size = (size + 7) & ~0x7;
+
+    /* Large requests and page alignment are served with whole pages, which are always page aligned */
+    if (size + alignment + (2 * HEAP_ENTRY_HEADER_SIZE) > HEAP_BIN_MAX_SIZE) {
+        size_t pages = (size + 4095) / 4096;
+
+        void *ptr = heap_alloc_pages(pages, 0);
+        if (ptr == NULL) {
+            heap_stats.failed++;
+            return NULL;
+        }
+
+        heap_stats.allocs++;
+        heap_stats.bytes_inuse += pages * 4096;
+        return ptr;
+    }
+
+    /* Get a block with room to move the start up to the alignment. Size-class bins are skipped, their objects are only aligned to 8 bytes */
+    heap_entry_t *blk = heap_alloc_block(size + alignment + (2 * HEAP_ENTRY_HEADER_SIZE));
+    if (blk == NULL) {
+        heap_stats.failed++;
+        return NULL;
+    }
+
+    uint32_t start = (uint32_t) blk + HEAP_ENTRY_HEADER_SIZE;
+    uint32_t aligned = (start + alignment - 1) & ~(alignment - 1);
+
+    /* The memory skipped at the front becomes a free block, so it must have room for a boundary tag and list links */
+    if (aligned != start && aligned - start < 2 * HEAP_ENTRY_HEADER_SIZE) {
+        aligned += alignment;
+    }
+
+    if (aligned != start) {
+        uint32_t gap = aligned - start;
+        uint32_t blk_size = blk->size & ~HEAP_ENTRY_INUSE;
+
+        /* Move the boundary tag up to the aligned memory */
+        heap_entry_t *moved = (heap_entry_t *)(aligned - HEAP_ENTRY_HEADER_SIZE);
+        moved->prev_size = gap - HEAP_ENTRY_HEADER_SIZE;
+        moved->size = (blk_size - gap) | HEAP_ENTRY_INUSE;
+
+        heap_entry_t *next = (heap_entry_t *)(aligned + blk_size - gap);
+        next->prev_size = blk_size - gap;
+
+        /* Free the front */
+        blk->size = gap - HEAP_ENTRY_HEADER_SIZE;
+        heap_release_block(blk);
+
+        blk = moved;
+    }
+
+    /* Free the rest after the requested size */
+    heap_shrink_block(blk, size);
+
+    heap_stats.allocs++;
+    heap_stats.bytes_inuse += blk->size & ~HEAP_ENTRY_INUSE;
+    return (void *) aligned;
+}
+
+/* Allocate zeroed memory for an array. Returns NULL if not successful */
+void *calloc(size_t nmemb, size_t size) {
+    /* Check for overflow */
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    /* Whole pages come from pgalloc_zeroed, which may have cleared them while the CPU was idle */
+    size_t bytes = nmemb * size;
+    if (bytes > HEAP_BIN_MAX_SIZE) {
+        size_t pages = (bytes + 4095) / 4096;
+
+        void *ptr = heap_alloc_pages(pages, 1);
+        if (ptr == NULL) {
+            heap_stats.failed++;
+            return NULL;
+        }
+
+        heap_stats.allocs++;
+        heap_stats.bytes_inuse += pages * 4096;
+        return ptr;
+    }
+
+    void *ptr = malloc(bytes);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    /* Freed blocks keep their old contents, so the memory is always cleared */
+    memset(ptr, 0, bytes);
+    return ptr;
+}
 
 /* Free memory */
 void free(void *ptr) {
-    /* Check if it is a full page allocation */
-    uint32_t addr = (uint32_t) ptr;
-    if ((addr & 0xfff) == 0) {
-        pgfree(ptr);
+    trace(TRACE_FREE, ptr, 0);
+
+    if (ptr == NULL) {
         return;
     }
 
-    int merged = 0;
-    heap_entry_t *blk = (heap_entry_t *)(ptr - sizeof(heap_entry_t));
-    heap_entry_t *merged_blk = heap_free_head;
-    uint32_t blk_begin = (uint32_t) ((void *) blk);
-    uint32_t blk_end = blk_begin + sizeof(heap_entry_t) + blk->size;
-    
-    /* Don't merge blocks across pages */
-    if ((blk_begin & 0xfff) != 0) {
-        /* Check if after a free block, if so merge */
-        while (merged_blk != NULL) {
-            /* Calculate bounds of merged_blk */
-            uint32_t merged_blk_begin = (uint32_t) ((void *) merged_blk);
-            uint32_t merged_blk_end = merged_blk_begin + sizeof(heap_entry_t) + merged_blk->size;
-
-            /* blk is after merged_blk */
-            if (blk_begin == merged_blk_end) {
-                printf("free: adjacent after\n");
-                merged_blk->size += sizeof(heap_entry_t) + blk->size;
-                blk = merged_blk;
-                merged = 1;
-                break;
-            }
+    /* vmalloc areas are outside the direct map, so they aren't in the page database */
+    if (vmalloc_addr(ptr)) {
+        size_t pages = vmalloc_pages(ptr);
+        if (pages == 0) {
+            trace(TRACE_FREE_INVALID, ptr, 0);
+            return;
+        }
 
-            merged_blk = merged_blk->next;
+        heap_stats.frees++;
+        heap_stats.bytes_inuse -= pages * 4096;
+        vfree(ptr);
+        return;
+    }
+
+    /* The page database tells which allocator the pages came from */
+    pgalloc_owner_t owner = heap_owner(ptr);
+
+    if (owner == PGALLOC_OWNER_LARGE && ((uint32_t) ptr & 0xfff) == 0) {
+        /* Full page allocation */
+        heap_stats.frees++;
+        heap_stats.bytes_inuse -= pgalloc_pages(ptr) * 4096;
+        heap_stats.pgfree_calls++;
+        pgfree(ptr);
+        return;
+    } else if (owner == PGALLOC_OWNER_SLAB) {
+        /* Object in a slab, such as the size-class bins */
+        kmem_slab_t *slab = heap_slab_of(ptr);
+        if (slab != NULL) {
+            heap_stats.frees++;
+            heap_stats.bytes_inuse -= slab->cache->size;
+            kmem_cache_free(slab->cache, ptr);
+            return;
         }
     }
 
-    merged_blk = heap_free_head;
-    blk_begin = (uint32_t) ((void *) blk);
-    blk_end = blk_begin + sizeof(heap_entry_t) + blk->size;
+    if (owner != PGALLOC_OWNER_HEAP) {
+        trace(TRACE_FREE_INVALID, ptr, 0);
+        return;
+    }
 
-    /* Don't merge blocks across pages */
-    if ((blk_end & 0xfff) != 0) {
-        /* Check if before a free block, if so merge */
-        while (merged_blk != NULL) {
-            /* Calculate bounds of merged_blk */
-            uint32_t merged_blk_begin = (uint32_t) ((void *) merged_blk);
+    heap_entry_t *blk = (heap_entry_t *)(ptr - HEAP_ENTRY_HEADER_SIZE);
 
-            /* blk is before merged_blk */
-            if (blk_end == merged_blk_begin) {
-                printf("free: adjacent before\n");
-                blk->size += sizeof(heap_entry_t) + merged_blk->size;
-                heap_remove_free_block(merged_blk);
-                merged = 1;
-                break;
-            }
+    /* Catch double frees before they corrupt the free list */
+    if (!(blk->size & HEAP_ENTRY_INUSE)) {
+        trace(TRACE_FREE_DOUBLE, ptr, 0);
+        return;
+    }
+    blk->size &= ~HEAP_ENTRY_INUSE;
+
+    heap_stats.frees++;
+    heap_stats.bytes_inuse -= blk->size;
+    heap_release_block(blk);
+}
+
+/* Add a free block to the front of the list of its size class */
+void heap_add_free_block(heap_entry_t *blk) {
+    uint32_t cls = heap_free_class(blk->size);
+
+    heap_stats.bytes_free += blk->size;
+    heap_stats.free_blocks++;
+
+    blk->next = heap_free_lists[cls];
+    blk->prev = NULL;
+
+    if (blk->next != NULL) {
+        blk->next->prev = blk;
+    }
+    heap_free_lists[cls] = blk;
+    heap_free_bitmap[cls / 32] |= 1u << (cls % 32);
+
+    if (heap_largest_valid && blk->size > heap_largest_free) {
+        heap_largest_free = blk->size;
+    }
+}
+
+/* Allocate a block from the free list, expanding the heap by an arena if nothing fits. size must be a multiple of 8 and fit in an arena. Returns NULL if not successful */
+heap_entry_t *heap_alloc_block(size_t size) {
+    heap_entry_t *blk = NULL;
+    uint32_t cls = heap_free_class(size);
+
+    /* Small sizes have a free list each, so the first block in the list of the size is an exact fit */
+    if (size < HEAP_FREE_LINEAR && heap_free_lists[cls] != NULL) {
+        blk = heap_free_lists[cls];
+        trace(TRACE_MALLOC_EXACT, blk, blk->size);
+    }
+
+    /* If an exact fit wasn't found, take a block from the largest size class */
+    int largest = (blk == NULL) ? heap_largest_class() : -1;
+    if (largest > (int) cls) {
+        /* Every block in a larger class than the size's fits */
+        blk = heap_free_lists[largest];
+        trace(TRACE_MALLOC_LARGEST, blk, blk->size);
+    } else if (largest == (int) cls) {
+        /* In the size's own class, blocks can be smaller than the size, so its list is searched for one that fits */
+        for (blk = heap_free_lists[largest]; blk != NULL && blk->size < size; blk = blk->next) {
+        }
+
+        if (blk != NULL) {
+            trace(TRACE_MALLOC_LARGEST, blk, blk->size);
+        } else {
+            trace(TRACE_MALLOC_NO_FIT, heap_free_lists[largest], heap_free_lists[largest]->size);
+        }
+    }
+
+    /* If there's still no block that can fulfill the request, get a new arena */
+    if (blk == NULL) {
+        heap_arena_t *arena = heap_new_arena();
+        trace(TRACE_MALLOC_EXPAND, arena, HEAP_ARENA_PAGES);
 
-            merged_blk = merged_blk->next;
+        if (arena == NULL) {
+            trace(TRACE_MALLOC_NO_PAGE, NULL, 0);
+            return NULL;
+        }
+
+        arena->pages = HEAP_ARENA_PAGES;
+        arena->prev = NULL;
+        arena->next = heap_arenas;
+        if (heap_arenas != NULL) {
+            heap_arenas->prev = arena;
         }
+        heap_arenas = arena;
+
+        heap_stats.arenas++;
+        heap_stats.arenas_empty++;
+
+        /* One block filling the arena after its header, followed by an in-use boundary tag at the end of the arena */
+        blk = (heap_entry_t *)((void *) arena + sizeof(heap_arena_t));
+        blk->prev_size = 0;
+        blk->size = HEAP_ARENA_BLOCK_SIZE;
+
+        heap_entry_t *end = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + HEAP_ARENA_BLOCK_SIZE);
+        end->prev_size = HEAP_ARENA_BLOCK_SIZE;
+        end->size = HEAP_ENTRY_INUSE;
+
+        /* Add to the list */
+        heap_add_free_block(blk);
     }
 
-    /* Wasn't merged? Add to the front of the list */
-    if (!merged) {
-        printf("free: block not merged, adding to the list\n");
-        heap_add_free_block_front(blk);
+    /* An empty arena is about to be used */
+    if (blk->size == HEAP_ARENA_BLOCK_SIZE) {
+        heap_stats.arenas_empty--;
     }
 
-    /* Check if the merged block is a full page. If so, return to the page allocator */
-    addr = (uint32_t) ((void *)blk);
-    if (((addr & 0xfff) == 0) && (blk->size = (4096 - sizeof(heap_entry_t)))) {
+    /* Can this block be split? The remaining free block must have room for its list links */
+    if (blk->size >= size + HEAP_ENTRY_HEADER_SIZE + 8) {
+        uint32_t remaining = blk->size - size - HEAP_ENTRY_HEADER_SIZE;
+
+        /* Allocate from the front, so the free memory follows the block and realloc can grow into it */
+        heap_entry_t *rest = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + size);
+        rest->prev_size = size;
+        rest->size = remaining;
+
+        /* Update the footer of the remaining block */
+        heap_entry_t *next = (heap_entry_t *)((void *) rest + HEAP_ENTRY_HEADER_SIZE + remaining);
+        next->prev_size = remaining;
+
+        /* The remaining block is smaller, so it goes in the list of its own size class */
+        heap_remove_free_block(blk);
+        heap_add_free_block(rest);
+
+        blk->size = size;
+        trace(TRACE_MALLOC_SPLIT, blk, remaining);
+    } else {
+        /* Block cannot be split, remove from list */
+        trace(TRACE_MALLOC_WHOLE, blk, blk->size);
         heap_remove_free_block(blk);
-        pgfree(blk);
     }
+
+    /* Mark as allocated */
+    blk->size |= HEAP_ENTRY_INUSE;
+    return blk;
 }
 
-/* Add a free block to the back of the list */
-void heap_add_free_block_back(heap_entry_t *blk) {
-    if (heap_free_head == NULL) {
-        heap_free_head = blk;
-    } else {
-        heap_free_tail->next = blk;
+/* Get the arena memory belongs to. Returns NULL if it is not in an arena */
+heap_arena_t *heap_arena_of(void *ptr) {
+    /* Region arenas are aligned to their size, in slots marked in use */
+    if (heap_region_addr(ptr)) {
+        uint32_t slot = ((uint32_t) ptr - HEAP_REGION_START) / (HEAP_ARENA_PAGES * 4096);
+        if (!(heap_region_slots[slot / 32] & (1 << (slot % 32)))) {
+            return NULL;
+        }
+
+        return (heap_arena_t *)(HEAP_REGION_START + (slot * HEAP_ARENA_PAGES * 4096));
+    }
+
+    if (pgalloc_owner(ptr) != PGALLOC_OWNER_HEAP) {
+        return NULL;
+    }
+
+    return (heap_arena_t *) pgalloc_head(ptr);
+}
+
+/* Get the heap's counters. They are maintained by every operation, so only the list of the largest size class is walked, and only if the largest free block was taken since the last call */
+void heap_get_stats(heap_stats_t *stats) {
+    if (!heap_largest_valid) {
+        int largest = heap_largest_class();
+
+        heap_largest_free = 0;
+        for (heap_entry_t *blk = (largest >= 0) ? heap_free_lists[largest] : NULL; blk != NULL; blk = blk->next) {
+            if (blk->size > heap_largest_free) {
+                heap_largest_free = blk->size;
+            }
+        }
+        heap_largest_valid = 1;
     }
-    heap_free_tail = blk;
+
+    *stats = heap_stats;
+    stats->largest_free = heap_largest_free;
 }
 
-/* Add a free block to the front of the list */
-void heap_add_free_block_front(heap_entry_t *blk) {
-    if (heap_free_head == NULL) {
-        heap_free_tail = blk;
+/* Initialize the heap. Must be called after pgalloc_init, and after vmm_init for arenas to come from the demand-zero region */
+void heap_init(void) {
+    /* Without paging, as in host builds, arenas come straight from pgalloc */
+    heap_region = !vmm_demand_zero((void *) HEAP_REGION_START, (HEAP_REGION_END - HEAP_REGION_START) >> 12, HEAP_FAULT_AROUND);
+    heap_bin_region = !vmm_demand_zero((void *) HEAP_BIN_REGION_START, (HEAP_BIN_REGION_END - HEAP_BIN_REGION_START) >> 12, 1);
+    pgalloc_register_shrinker("heap", heap_shrink);
+
+    /* Set up the size classes, with their slabs in the bin region if there is one */
+    for (int i=0; i<HEAP_BIN_COUNT; i++) {
+        heap_bins[i] = kmem_cache_create(heap_bin_names[i], heap_bin_sizes[i], 0, NULL);
+        if (heap_bin_region && heap_bins[i] != NULL) {
+            kmem_cache_set_source(heap_bins[i], &heap_bin_source);
+        }
+    }
+
+    /* Fill in the request size to size class lookup table */
+    int bin = 0;
+    for (uint32_t i=0; i<=(HEAP_BIN_MAX_SIZE / 8); i++) {
+        while (heap_bin_sizes[bin] < (i * 8)) {
+            bin++;
+        }
+        heap_bin_index[i] = bin;
     }
-    blk->next = heap_free_head;
-    heap_free_head = blk;
 }
 
 /* Print diagnostic information about the heap */
 void heap_print_diagnostics() {
-    printf(" heap free list: <");
+    printf(" heap bins: <");
 
-    heap_entry_t *ent = heap_free_head;
-    while (ent != NULL) {
-        printf("%p:%d",ent->next,ent->size);
-        if (ent->next != NULL) {
+    int first = 1;
+    for (int i=0; i<HEAP_BIN_COUNT; i++) {
+        /* Only show size classes that own slabs */
+        if (heap_bins[i] == NULL || heap_bins[i]->slabs == 0) {
+            continue;
+        }
+
+        if (!first) {
             printf(",");
         }
+        printf("%d:%d",heap_bins[i]->size,heap_bins[i]->slabs);
+        first = 0;
+    }
+
+    printf(">\n");
+    printf(" heap arenas: <");
+
+    for (heap_arena_t *arena = heap_arenas; arena != NULL; arena = arena->next) {
+        printf("%p:%d",arena,arena->pages);
+        if (arena->next != NULL) {
+            printf(",");
+        }
+    }
 
-        ent = ent->next;
+    printf(">\n");
+    printf(" heap free lists: <");
+
+    first = 1;
+    for (int i=0; i<HEAP_FREE_CLASSES; i++) {
+        for (heap_entry_t *ent = heap_free_lists[i]; ent != NULL; ent = ent->next) {
+            if (!first) {
+                printf(",");
+            }
+            printf("%p:%d",ent,ent->size);
+            first = 0;
+        }
     }
 
     printf(">\n");
 }
 
-/* Remove a block from the free block list */
-void heap_remove_free_block(heap_entry_t *blk) {
-    /* Protect from blk = NULL */
-    if (blk == NULL) {
-        printf("heap_remove_free_block: tried to remove NULL from free list\n");
-        return;
+/* Return a block to the free list, merging it with free neighbours. The in-use bit must already be clear */
+void heap_release_block(heap_entry_t *blk) {
+    /* The boundary tag after this block tells if the following block is free, if so merge */
+    heap_entry_t *next = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + blk->size);
+    if (!(next->size & HEAP_ENTRY_INUSE)) {
+        trace(TRACE_FREE_MERGE_NEXT, blk, next->size);
+        heap_remove_free_block(next);
+        blk->size += HEAP_ENTRY_HEADER_SIZE + next->size;
     }
 
-    /* Removing the head is a special case */
-    if (blk == heap_free_head) {
-        heap_free_head = blk->next;
-        if (heap_free_head == NULL) {
-            heap_free_tail = NULL;
+    /* The footer of the previous block tells where it starts. If it is free, merge. A prev_size of 0 is the start of the page */
+    if (blk->prev_size != 0) {
+        heap_entry_t *prev = (heap_entry_t *)((void *) blk - HEAP_ENTRY_HEADER_SIZE - blk->prev_size);
+
+        if (!(prev->size & HEAP_ENTRY_INUSE)) {
+            /* The previous block grows, which can move it to the list of a larger size class */
+            heap_remove_free_block(prev);
+            prev->size += HEAP_ENTRY_HEADER_SIZE + blk->size;
+
+            blk = prev;
+            trace(TRACE_FREE_MERGE_PREV, blk, blk->size);
+        } else {
+            trace(TRACE_FREE_INSERT, blk, blk->size);
         }
     } else {
-        heap_entry_t *prev = heap_free_head;
+        trace(TRACE_FREE_INSERT, blk, blk->size);
+    }
+    heap_add_free_block(blk);
 
-        /* Search for the previous block */
-        while (prev != NULL) {
-            if (prev->next == blk) {
-                break;
-            }
-        }
+    /* Update the footer of the merged block */
+    next = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + blk->size);
+    next->prev_size = blk->size;
 
-        /* Does the previous block actually exist? Can't remove a block if its not in the list */
-        if (prev != NULL) {
-            prev->next = blk->next;
-        } else {
+    /* Check if the merged block fills the arena. A few empty arenas stay in the free list, so usage that goes up and down doesn't keep allocating and freeing arenas */
+    if (blk->size == HEAP_ARENA_BLOCK_SIZE) {
+        heap_stats.arenas_empty++;
+
+        if (heap_stats.arenas_empty <= HEAP_ARENA_CACHE_SIZE) {
+            trace(TRACE_FREE_KEEP_ARENA, blk, heap_stats.arenas_empty);
             return;
         }
 
-        /* Removing the tail is a special case */
-        if (heap_free_tail == blk) {
-            heap_free_tail = prev;
+        heap_free_arena(blk);
+    }
+}
+
+/* Remove a block from the list of its size class */
+void heap_remove_free_block(heap_entry_t *blk) {
+    /* Protect from blk = NULL */
+    if (blk == NULL) {
+        trace(TRACE_HEAP_REMOVE_NULL, NULL, 0);
+        return;
+    }
+
+    /* Removing the head is a special case, and clears the size class from the bitmap if its list is now empty */
+    uint32_t cls = heap_free_class(blk->size);
+    if (blk->prev != NULL) {
+        blk->prev->next = blk->next;
+    } else {
+        heap_free_lists[cls] = blk->next;
+        if (blk->next == NULL) {
+            heap_free_bitmap[cls / 32] &= ~(1u << (cls % 32));
         }
     }
+
+    if (blk->next != NULL) {
+        blk->next->prev = blk->prev;
+    }
+
+    heap_stats.bytes_free -= blk->size;
+    heap_stats.free_blocks--;
+
+    if (blk->size == heap_largest_free) {
+        heap_largest_valid = 0;
+    }
+}
+
+/* Shrink an allocated block to size, a multiple of 8. What is left over is freed if it can hold a free block */
+void heap_shrink_block(heap_entry_t *blk, size_t size) {
+    uint32_t blk_size = blk->size & ~HEAP_ENTRY_INUSE;
+
+    if (blk_size < size + HEAP_ENTRY_HEADER_SIZE + 8) {
+        return;
+    }
+
+    blk->size = size | HEAP_ENTRY_INUSE;
+
+    heap_entry_t *rest = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + size);
+    rest->prev_size = size;
+    rest->size = blk_size - size - HEAP_ENTRY_HEADER_SIZE;
+    heap_release_block(rest);
 }
 
 /* Allocate memory */
 void *malloc(size_t size) {
+    trace(TRACE_MALLOC, NULL, size);
+
     /* Is size 0? */
     if (size == 0) {
-        printf("malloc: size was zero\n");
+        trace(TRACE_MALLOC_ZERO, NULL, 0);
         return NULL;
     }
 
     /* Round up size to nearest 8 bytes */
     if ((size % 8) != 0) {
         size = (size + 8) & ~0x7;
-        printf("malloc: rounding up to %d bytes\n",size);
     }
 
-    /* If the request is >3072 bytes, use page allocator instead. */
-    if (size >= 3072) {
+    void *ptr;
+    size_t used;
+
+    if (size <= HEAP_BIN_MAX_SIZE) {
+        /* Requests up to 3072 bytes are served by the size-class bins */
+        kmem_cache_t *bin = heap_bins[heap_bin_index[size / 8]];
+        ptr = kmem_cache_alloc(bin);
+        used = bin->size;
+    } else {
+        /* If the request is >3072 bytes, use page allocator instead. */
         size_t pages = size / 4096;
 
         /* Round up pages */
@@ -178,91 +787,111 @@ void *malloc(size_t size) {
             pages++;
         }
 
-        printf("malloc: using pgalloc for size %d (%d pages)\n",size,pages);
-        return pgalloc(pages);
+        ptr = heap_alloc_pages(pages, 0);
+        used = pages * 4096;
     }
 
-    /* First search for an exact size fit */
-    heap_entry_t *blk = heap_free_head;
-    while (blk != NULL) {
-        if (blk->size == size) {
-            /* blk now has a pointer to the entry of the exact size */
-            printf("malloc: found block of exact size\n");
-            break;
-        }
-
-        blk = blk->next;
+    if (ptr == NULL) {
+        heap_stats.failed++;
+        return NULL;
     }
 
-    /* If an exact fit wasn't found, search for the largest free block */
-    if (blk == NULL && heap_free_head != NULL) {
-        heap_entry_t *largest = heap_free_head;
+    heap_stats.allocs++;
+    heap_stats.bytes_inuse += used;
+    return ptr;
+}
 
-        blk = heap_free_head;
-        while (blk != NULL) {
+/* Resize memory, moving it only if it can't be resized in place. Returns NULL if not successful, the original memory is left untouched */
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
 
-            /* a larger block was found */
-            if (blk->size > largest->size) {
-                largest = blk;
-            }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
 
-            blk = blk->next;
-        }
+    trace(TRACE_REALLOC, ptr, size);
 
-        /* Does block actually exist? */
-        if (largest != NULL) {
-            printf("malloc: largest block found was %d bytes\n",largest->size);
+    size_t rounded = (size + 7) & ~0x7;
+    size_t old_size;
+    pgalloc_owner_t owner = heap_owner(ptr);
 
-            /* Must still check that this block can fulfill the request */
-            if (largest->size >= size) {
-                printf("malloc: using largest block\n");
-                blk = largest;
-            } else {
-                printf("malloc: largest block is not large enough\n");
-                blk = NULL;
-            }
+    if (vmalloc_addr(ptr)) {
+        /* vmalloc area. Shrinking keeps the pages, growing moves it */
+        size_t pages = vmalloc_pages(ptr);
+        if (pages == 0) {
+            trace(TRACE_FREE_INVALID, ptr, 0);
+            return NULL;
         }
-    }
+        old_size = pages * 4096;
 
-    /* If there's still no block that can fulfill the request, get a new one from the page allocator */
-    if (blk == NULL) {
-        printf("malloc: expanding from pgalloc\n");
-        blk = (heap_entry_t *) pgalloc(1);
+        if ((size + 4095) / 4096 <= pages) {
+            trace(TRACE_REALLOC_IN_PLACE, ptr, size);
+            return ptr;
+        }
+    } else if (owner == PGALLOC_OWNER_LARGE && ((uint32_t) ptr & 0xfff) == 0) {
+        /* Page allocation. Shrinking keeps the pages, growing takes the free pages right after it */
+        size_t pages = pgalloc_pages(ptr);
+        size_t needed = (size + 4095) / 4096;
+        old_size = pages * 4096;
+
+        if (needed <= pages) {
+            trace(TRACE_REALLOC_IN_PLACE, ptr, size);
+            return ptr;
+        }
 
-        if (blk == NULL) {
-            printf("malloc: could not obtain a page to fill request\n");
+        if (!pgalloc_grow(ptr, needed)) {
+            heap_stats.bytes_inuse += (needed - pages) * 4096;
+            trace(TRACE_REALLOC_IN_PLACE, ptr, size);
+            return ptr;
+        }
+    } else if (owner != PGALLOC_OWNER_HEAP) {
+        /* Object in a size-class bin. It can only grow as far as its slot */
+        kmem_slab_t *slab = owner == PGALLOC_OWNER_SLAB ? heap_slab_of(ptr) : NULL;
+        if (slab == NULL) {
+            trace(TRACE_FREE_INVALID, ptr, 0);
             return NULL;
         }
+        old_size = slab->cache->size;
 
-        blk->next = NULL;
-        blk->size = 4096 - sizeof(heap_entry_t);
+        if (rounded <= old_size) {
+            trace(TRACE_REALLOC_IN_PLACE, ptr, size);
+            return ptr;
+        }
+    } else {
+        heap_entry_t *blk = (heap_entry_t *)(ptr - HEAP_ENTRY_HEADER_SIZE);
+        old_size = blk->size & ~HEAP_ENTRY_INUSE;
 
-        /* Add to the list */
-        heap_add_free_block_back(blk);
-    }
+        /* Take the following block if it is free and the two together are large enough */
+        heap_entry_t *next = (heap_entry_t *)(ptr + old_size);
+        if (rounded > old_size && !(next->size & HEAP_ENTRY_INUSE) && old_size + HEAP_ENTRY_HEADER_SIZE + next->size >= rounded) {
+            heap_remove_free_block(next);
+            blk->size += HEAP_ENTRY_HEADER_SIZE + next->size;
 
-    /* Can this block be split? */
-    uint32_t total_size = size + 8;
-    uint32_t remaining = blk->size - total_size;
-    if (remaining >= 8) {
-        printf("malloc: splitting the block (r=%d)\n",remaining);
+            next = (heap_entry_t *)((void *) blk + HEAP_ENTRY_HEADER_SIZE + (blk->size & ~HEAP_ENTRY_INUSE));
+            next->prev_size = blk->size & ~HEAP_ENTRY_INUSE;
+        }
 
-        /* Shrink the block */
-        blk->size = remaining;
+        /* Give back whatever is left over past the new size */
+        if (rounded <= (blk->size & ~HEAP_ENTRY_INUSE)) {
+            heap_shrink_block(blk, rounded);
+            heap_stats.bytes_inuse += (blk->size & ~HEAP_ENTRY_INUSE) - old_size;
+            trace(TRACE_REALLOC_IN_PLACE, ptr, size);
+            return ptr;
+        }
+    }
 
-        /* Get pointer to the block just allocated */
-        void *blkraw = (void *) blk;
-        blkraw += sizeof(heap_entry_t) + remaining;
-        blk = (heap_entry_t *) blkraw;
-        blk->next = NULL;
-        blk->size = size;
-    } else {
-        /* Block cannot be split, remove from list */
-        printf("malloc: removing block from list\n");
-        heap_remove_free_block(blk);
+    /* Can't be resized in place, move it */
+    void *moved = malloc(size);
+    if (moved == NULL) {
+        return NULL;
     }
 
-    /* Return the pointer */
-    void *ptr = (void *) blk;
-    return ptr + sizeof(heap_entry_t);
-}
\ No newline at end of file
+    memmove(moved, ptr, old_size < size ? old_size : size);
+    free(ptr);
+
+    trace(TRACE_REALLOC_MOVE, moved, size);
+    return moved;
+}
@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <gdt.h>
 #include <heap.h>
+#include <interrupt.h>
+#include <kmem.h>
 #include <multiboot.h>
 #include <pgalloc.h>
 #include <terminal.h>
+#include <tlsf.h>
+#include <trace.h>
+#include <vmalloc.h>
+#include <vmm.h>
 
 /* Check if the compiler thinks you are targeting the wrong operating system. */
 #if defined(__linux__)
@@ -17,6 +24,36 @@
 #endif
 
 multiboot_info_t *multiboot_info;
+
+/* Example kernel object for the object cache demo */
+struct s_timer {
+	uint32_t deadline;
+	void (*callback)(void);
+	struct s_timer *next;
+};
+
+/* Constructor for timers. Runs once per object when its slab is created */
+static void timer_ctor(void *obj) {
+	struct s_timer *timer = (struct s_timer *) obj;
+	timer->deadline = 0;
+	timer->callback = NULL;
+	timer->next = NULL;
+}
+
+/* Work the idle loop does each time the CPU wakes: rebuild a long free run for later large allocations, then clear pages ahead of time until the zeroed pool is full */
+static void kernel_idle_work(void) {
+	pgalloc_compact(PGALLOC_ZONE_NORMAL, 256);
+	while (!pgalloc_zero_idle()) {
+	}
+}
+
+/* Idle loop. The work is done before each hlt, so it never delays an interrupt being handled. No interrupt sources are enabled yet, so the first wait lasts until an NMI */
+static void kernel_idle(void) {
+	for (;;) {
+		kernel_idle_work();
+		interrupt_wait();
+	}
+}
  
 void kernel_main(void) 
 {
@@ -26,6 +63,13 @@ void kernel_main(void)
 	/* Print something on the screen */
 	printf("Hello, kernel World!\n");
 
+	/* Initialize the IDT, with a page fault handler for demand-zero memory */
+	interrupt_init();
+	interrupt_set(INTERRUPT_PAGE_FAULT, GDT_KERNEL_CS, page_fault_wrap, IDT_PRESENT | IDT_32BIT_INTERRUPT);
+
+	/* Map all of memory, before anything uses more than the first 4 MiB */
+	vmm_init();
+
 	/* Initialize the page allocator */
 	int r = pgalloc_init();
 	if (r) {
@@ -33,6 +77,10 @@ void kernel_main(void)
 		return;
 	}
 
+	/* Initialize the heap and vmalloc */
+	heap_init();
+	vmalloc_init();
+
 	/* Print initial state */
 	heap_print_diagnostics();
 	pgalloc_print_diagnostics();
@@ -46,8 +94,9 @@ void kernel_main(void)
 	printf(" malloc(16) gave %p\n",p2);
 	heap_print_diagnostics();
 
-	void *p3 = malloc(1234);
-	printf(" malloc(1234) gave %p\n",p3);
+	/* Size classes go up to 3072 bytes, aligned memory comes from a heap arena */
+	void *p3 = aligned_alloc(256, 1234);
+	printf(" aligned_alloc(256, 1234) gave %p\n",p3);
 	heap_print_diagnostics();
 
 	void *pbig = malloc(12345);
@@ -55,6 +104,9 @@ void kernel_main(void)
 	heap_print_diagnostics();
 	pgalloc_print_diagnostics();
 	
+	/* The heap's arena only took frames for the pages it touched */
+	vmm_print_diagnostics();
+
 	/* Free one in between */
 	free(p2);
 	heap_print_diagnostics();
@@ -73,5 +125,94 @@ void kernel_main(void)
 	heap_print_diagnostics();
 	pgalloc_print_diagnostics();
 
-	/* After this, the heap and page allocators should be just like they were when they were initialized */
+	/* After this, the heap and page allocators should be just like they were when they were initialized, apart from an empty arena kept for reuse */
+
+	/* A growing buffer is resized in place while it still fits its size class */
+	char *buf = malloc(600);
+	char *grown = realloc(buf, 700);
+	printf(" realloc(%p, 700) gave %p\n",buf,grown);
+	void *dma = aligned_alloc(1024, 700);
+	printf(" aligned_alloc(1024, 700) gave %p\n",dma);
+	free(grown);
+	free(dma);
+	heap_print_diagnostics();
+
+	/* Counters can be read at any time without walking the lists */
+	heap_stats_t hs;
+	heap_get_stats(&hs);
+	printf(" heap: %d allocs, %d frees, %d bytes in use, %d pgalloc calls\n",hs.allocs,hs.frees,hs.bytes_inuse,hs.pgalloc_calls);
+	pgalloc_stats_t ps;
+	pgalloc_get_stats(&ps);
+	printf(" pgalloc: %d of %d pages free, largest run %d\n",ps.pages_free,ps.pages_total,ps.largest_free);
+
+	/* Reports can be laid out in memory before they are printed */
+	char row[64];
+	snprintf(row,sizeof(row),"%-8s|%8u|%8u|%#010x","pgalloc",ps.pages_free,ps.pages_total,ps.pages_free << 12);
+	printf(" %s\n",row);
+	printf(" %.1f%% of pages free, %!g MiB\n",100.0 * ps.pages_free / ps.pages_total,ps.pages_free / 256.0);
+
+	/* Show what the allocators did */
+	trace_dump();
+
+	/* Fixed size objects can have their own cache */
+	kmem_cache_t *timer_cache = kmem_cache_create("timer", sizeof(struct s_timer), 0, timer_ctor);
+	struct s_timer *t1 = kmem_cache_alloc(timer_cache);
+	struct s_timer *t2 = kmem_cache_alloc(timer_cache);
+	printf(" kmem_cache_alloc(timer) gave %p and %p\n",t1,t2);
+	kmem_print_diagnostics();
+
+	/* Objects go back to the cache in their constructed state */
+	kmem_cache_free(timer_cache, t1);
+	kmem_cache_free(timer_cache, t2);
+	kmem_cache_destroy(timer_cache);
+
+	/* Devices using ISA DMA need memory under 16 MiB */
+	void *isa = pgalloc_zone(PGALLOC_ZONE_DMA, 4);
+	printf(" pgalloc_zone(DMA, 4) gave %p\n",isa);
+	pgfree(isa);
+
+	/* Buffers used together shouldn't share cache sets */
+	void *hot = pgalloc_color(PGALLOC_ZONE_NORMAL, 2, 0);
+	void *cold = pgalloc_color(PGALLOC_ZONE_NORMAL, 2, 2);
+	printf(" pgalloc_color gave %p (color %d) and %p (color %d)\n",hot,pgalloc_color_of(hot),cold,pgalloc_color_of(cold));
+	pgfree(hot);
+	pgfree(cold);
+	pgalloc_print_diagnostics();
+
+	/* A page can be mapped anywhere in kernel space, here above the vmalloc area, and reached through both mappings */
+	uint32_t *frame = pgalloc(1);
+	uint32_t *window = (uint32_t *) 0xF0000000;
+	vmm_map(window, (uint32_t) frame, VMM_WRITE);
+	window[0] = 0x1234;
+	printf(" vmm_map(%p) to %p, read back %x through the direct map\n",window,frame,frame[0]);
+	vmm_print_diagnostics();
+	vmm_unmap(window);
+	pgfree(frame);
+
+	/* Large buffers are contiguous in kernel space, but their frames can be anywhere */
+	void *vbuf = vmalloc(40000);
+	printf(" vmalloc(40000) gave %p\n",vbuf);
+	vmalloc_print_diagnostics();
+	vfree(vbuf);
+	vmalloc_flush();
+	vmalloc_print_diagnostics();
+
+	/* A TLSF pool in pre-reserved memory, for allocations that need a bounded latency */
+	tlsf_t *pool = tlsf_create(pgalloc(16), 16 * 4096);
+	void *q1 = tlsf_malloc(pool, 100);
+	void *q2 = tlsf_malloc(pool, 5000);
+	printf(" tlsf_malloc(100) gave %p, tlsf_malloc(5000) gave %p\n",q1,q2);
+	tlsf_free(pool, q1);
+	tlsf_free(pool, q2);
+	tlsf_print_diagnostics(pool);
+
+	/* Nothing left to do. A pass of the idle work fills the zeroed pool, which the next single page request is served from */
+	kernel_idle_work();
+
+	void *zeroed = pgalloc_zeroed(1);
+	pgalloc_stats_t zs;
+	pgalloc_get_stats(&zs);
+	printf(" pgalloc_zeroed(1) gave %p, %d zeroed pages left in the pool\n",zeroed,zs.zero_pool);
+
+	kernel_idle();
 }
\ No newline at end of file
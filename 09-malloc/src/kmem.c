@@ -0,0 +1,355 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kmem.h>
+#include <pgalloc.h>
+#include <trace.h>
+#include <vmm.h>
+
+/* Pool of caches */
+kmem_cache_t kmem_cache_pool[KMEM_CACHE_POOL_SIZE];
+
+/* Set once the shrinker is registered, by the first kmem_cache_create */
+static int kmem_shrinker_registered = 0;
+
+/* Shrinker of the caches. Each one keeps an empty slab, so an object being allocated and freed doesn't thrash pgalloc, which can go when memory is short */
+static uint32_t kmem_shrink(uint32_t pages) {
+    uint32_t freed = 0;
+
+    for (int i=0; i<KMEM_CACHE_POOL_SIZE && freed < pages; i++) {
+        /* Slabs from a source can be demand-zero, and a fault in one can stop its cache halfway through changing its lists */
+        if (kmem_cache_pool[i].source != NULL && vmm_in_fault()) {
+            continue;
+        }
+
+        if (kmem_cache_pool[i].pool_status == KMEM_CACHE_INUSE) {
+            freed += kmem_cache_shrink(kmem_cache_pool + i);
+        }
+    }
+
+    return freed;
+}
+
+/* Get pages for a new slab of a cache. Returns NULL if not successful */
+static kmem_slab_t *kmem_slab_alloc(kmem_cache_t *cache) {
+    if (cache->source != NULL) {
+        return (kmem_slab_t *) cache->source->alloc(cache->pages);
+    }
+
+    kmem_slab_t *slab = (kmem_slab_t *) pgalloc(cache->pages);
+    if (slab != NULL) {
+        pgalloc_set_owner(slab, PGALLOC_OWNER_SLAB);
+    }
+    return slab;
+}
+
+/* Give back the pages of a slab that was taken off the cache's lists. Returns the number of pages freed */
+static uint32_t kmem_slab_release(kmem_cache_t *cache, kmem_slab_t *slab) {
+    trace(TRACE_KMEM_SHRINK, slab, cache->size);
+    slab->magic = 0;
+    cache->slabs--;
+
+    if (cache->source != NULL) {
+        return cache->source->free(slab, cache->pages);
+    }
+
+    pgfree(slab);
+    return cache->pages;
+}
+
+/* Check that memory is the start of an object in a slab. Returns the slab, or NULL if it isn't */
+static kmem_slab_t *kmem_slab_check(kmem_slab_t *slab, void *ptr) {
+    if (slab == NULL || slab->magic != KMEM_SLAB_MAGIC) {
+        return NULL;
+    }
+
+    /* A pointer into the middle of an object, the header or the unused tail of the slab would free the wrong slot */
+    kmem_cache_t *cache = slab->cache;
+    uint32_t offset = (uint32_t) (ptr - (void *) slab);
+    if (offset < cache->first || (offset - cache->first) % cache->size != 0 || (offset - cache->first) / cache->size >= cache->slots) {
+        return NULL;
+    }
+
+    return slab;
+}
+
+/* Allocate an object from a cache. Returns NULL if not successful */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    kmem_slab_t *slab = cache->partial;
+
+    /* No slab with a free slot, get a new one from the page allocator or the cache's source */
+    if (slab == NULL) {
+        slab = kmem_slab_alloc(cache);
+        trace(TRACE_KMEM_GROW, slab, cache->size);
+
+        if (slab == NULL) {
+            trace(TRACE_KMEM_NO_PAGE, NULL, cache->size);
+            return NULL;
+        }
+
+        slab->magic = KMEM_SLAB_MAGIC;
+        slab->next = NULL;
+        slab->prev = NULL;
+        slab->cache = cache;
+        slab->free_count = cache->slots;
+
+        /* Mark every slot that fits in the slab as free */
+        for (uint32_t i=0; i<KMEM_SLAB_BITMAP_WORDS; i++) {
+            uint32_t first = i * 32;
+
+            if (first + 32 <= cache->slots) {
+                slab->bitmap[i] = 0xffffffff;
+            } else if (first < cache->slots) {
+                slab->bitmap[i] = (1u << (cache->slots - first)) - 1;
+            } else {
+                slab->bitmap[i] = 0;
+            }
+        }
+
+        /* Construct every object once. Objects are freed in their constructed state, so this isn't repeated on allocation */
+        if (cache->ctor != NULL) {
+            for (uint32_t i=0; i<cache->slots; i++) {
+                cache->ctor((void *) slab + cache->first + (i * cache->size));
+            }
+        }
+
+        cache->partial = slab;
+        cache->slabs++;
+    }
+
+    /* Find the first free slot. The slab is on the partial list, so there is at least one */
+    uint32_t word = 0;
+    while (slab->bitmap[word] == 0) {
+        word++;
+    }
+    uint32_t bit = __builtin_ctz(slab->bitmap[word]);
+
+    slab->bitmap[word] &= ~(1u << bit);
+    slab->free_count--;
+
+    /* Slab is now full, take it off the partial list */
+    if (slab->free_count == 0) {
+        cache->partial = slab->next;
+        if (cache->partial != NULL) {
+            cache->partial->prev = NULL;
+        }
+    }
+
+    cache->objects_inuse++;
+    cache->allocs++;
+
+    uint32_t slot = (word * 32) + bit;
+    return (void *) slab + cache->first + (slot * cache->size);
+}
+
+/* Create a cache of objects of the given size and alignment (0 for 8 bytes). ctor may be NULL. The name is not copied. Returns NULL if not successful */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor) {
+    /* Check arguments */
+    if (align < 8) {
+        align = 8;
+    }
+
+    if ((align & (align - 1)) != 0) {
+        printf("kmem_cache_create: alignment %d is not a power of two\n",align);
+        return NULL;
+    }
+
+    if (size == 0) {
+        printf("kmem_cache_create: size was zero\n");
+        return NULL;
+    }
+
+    /* Objects are spaced by the alignment, and the first one is aligned after the slab header */
+    size = (size + align - 1) & ~(align - 1);
+    uint32_t first = (sizeof(kmem_slab_t) + align - 1) & ~(align - 1);
+
+    if (first + size > KMEM_SLAB_MAX_PAGES * 4096) {
+        printf("kmem_cache_create: objects of %d bytes don't fit in a slab\n",size);
+        return NULL;
+    }
+
+    /* Large objects leave a lot of a page unused, so their slabs get more pages, until no more than an eighth of the slab is wasted */
+    uint32_t pages = 1;
+    while (pages < KMEM_SLAB_MAX_PAGES) {
+        uint32_t bytes = pages * 4096;
+        uint32_t slots = (bytes - first) / size;
+        if (slots > KMEM_SLAB_BITMAP_WORDS * 32) {
+            slots = KMEM_SLAB_BITMAP_WORDS * 32;
+        }
+
+        if (slots != 0 && bytes - first - (slots * size) <= bytes / 8) {
+            break;
+        }
+        pages *= 2;
+    }
+
+    if (!kmem_shrinker_registered) {
+        kmem_shrinker_registered = !pgalloc_register_shrinker("kmem", kmem_shrink);
+    }
+
+    /* Search for an unused cache in the pool */
+    for (int i=0; i<KMEM_CACHE_POOL_SIZE; i++) {
+        kmem_cache_t *cache = kmem_cache_pool + i;
+
+        if (cache->pool_status == KMEM_CACHE_INUSE) {
+            continue;
+        }
+
+        cache->pool_status = KMEM_CACHE_INUSE;
+        cache->name = name;
+        cache->size = size;
+        cache->first = first;
+        cache->pages = pages;
+        cache->slots = ((pages * 4096) - first) / size;
+        cache->ctor = ctor;
+        cache->source = NULL;
+        cache->partial = NULL;
+        cache->slabs = 0;
+        cache->objects_inuse = 0;
+        cache->allocs = 0;
+        cache->frees = 0;
+
+        /* The bitmap limits the number of objects in a slab */
+        if (cache->slots > KMEM_SLAB_BITMAP_WORDS * 32) {
+            cache->slots = KMEM_SLAB_BITMAP_WORDS * 32;
+        }
+
+        return cache;
+    }
+
+    printf("kmem_cache_create: no caches left in pool\n");
+    return NULL;
+}
+
+/* Destroy a cache. Returns non-zero if it still has objects allocated */
+int kmem_cache_destroy(kmem_cache_t *cache) {
+    if (cache->objects_inuse != 0) {
+        printf("kmem_cache_destroy: %s still has %d objects allocated\n",cache->name,cache->objects_inuse);
+        return 1;
+    }
+
+    /* With no objects allocated, every slab is on the partial list */
+    kmem_slab_t *slab = cache->partial;
+    while (slab != NULL) {
+        kmem_slab_t *next = slab->next;
+        kmem_slab_release(cache, slab);
+        slab = next;
+    }
+
+    cache->partial = NULL;
+    cache->pool_status = KMEM_CACHE_FREE;
+    return 0;
+}
+
+/* Free an object back to its cache */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    kmem_slab_t *slab = (cache->source != NULL) ? kmem_source_slab_of(cache->source, obj) : kmem_slab_of(obj);
+
+    /* Make sure the pointer is an object from this cache */
+    if (slab == NULL || slab->cache != cache) {
+        trace(TRACE_KMEM_BAD_FREE, obj, cache->size);
+        return;
+    }
+
+    uint32_t slot = ((uint32_t) (obj - (void *) slab) - cache->first) / cache->size;
+    uint32_t mask = 1u << (slot % 32);
+
+    /* Catch double frees before they corrupt the free count */
+    if (slab->bitmap[slot / 32] & mask) {
+        trace(TRACE_KMEM_DOUBLE_FREE, obj, cache->size);
+        return;
+    }
+
+    slab->bitmap[slot / 32] |= mask;
+    slab->free_count++;
+    cache->objects_inuse--;
+    cache->frees++;
+
+    /* Slab was full, put it back on the partial list */
+    if (slab->free_count == 1) {
+        slab->prev = NULL;
+        slab->next = cache->partial;
+        if (cache->partial != NULL) {
+            cache->partial->prev = slab;
+        }
+        cache->partial = slab;
+    }
+
+    /* Slab is empty. Return it unless it's the last slab with free slots, so a single object being allocated and freed doesn't thrash pgalloc */
+    if (slab->free_count == cache->slots && (slab->prev != NULL || slab->next != NULL)) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        } else {
+            cache->partial = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+
+        kmem_slab_release(cache, slab);
+    }
+}
+
+/* Take a cache's slabs from a source other than pgalloc. Must be called before the cache has any slabs */
+void kmem_cache_set_source(kmem_cache_t *cache, const kmem_source_t *source) {
+    if (cache->slabs == 0) {
+        cache->source = source;
+    }
+}
+
+/* Return a cache's empty slabs to the page allocator or their source. Returns the number of pages freed */
+uint32_t kmem_cache_shrink(kmem_cache_t *cache) {
+    uint32_t freed = 0;
+
+    /* Empty slabs have free slots, so they are all on the partial list */
+    kmem_slab_t *slab = cache->partial;
+    while (slab != NULL) {
+        kmem_slab_t *next = slab->next;
+
+        if (slab->free_count == cache->slots) {
+            if (slab->prev != NULL) {
+                slab->prev->next = slab->next;
+            } else {
+                cache->partial = slab->next;
+            }
+            if (slab->next != NULL) {
+                slab->next->prev = slab->prev;
+            }
+
+            freed += kmem_slab_release(cache, slab);
+        }
+
+        slab = next;
+    }
+
+    return freed;
+}
+
+/* Print usage of every cache */
+void kmem_print_diagnostics(void) {
+    for (int i=0; i<KMEM_CACHE_POOL_SIZE; i++) {
+        kmem_cache_t *cache = kmem_cache_pool + i;
+
+        if (cache->pool_status == KMEM_CACHE_FREE) {
+            continue;
+        }
+
+        printf(" %s: size=%d pages=%d slabs=%d inuse=%d allocs=%d frees=%d\n",cache->name,cache->size,cache->pages,cache->slabs,cache->objects_inuse,cache->allocs,cache->frees);
+    }
+}
+
+/* Get the slab from pgalloc an object resides in. Returns NULL if the pointer is not the start of an object in a slab */
+kmem_slab_t *kmem_slab_of(void *ptr) {
+    /* The page database is checked before reading the page, which could belong to anything. It also has the first page of a slab of several pages */
+    if (pgalloc_owner(ptr) != PGALLOC_OWNER_SLAB) {
+        return NULL;
+    }
+
+    return kmem_slab_check((kmem_slab_t *) pgalloc_head(ptr), ptr);
+}
+
+/* Get the slab from a source an object resides in. Returns NULL if the pointer is not the start of an object in one of its slabs */
+kmem_slab_t *kmem_source_slab_of(const kmem_source_t *source, void *ptr) {
+    return kmem_slab_check((kmem_slab_t *) source->head(ptr), ptr);
+}
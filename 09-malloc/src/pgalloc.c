@@ -1,376 +1,857 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+#include <bootmem.h>
+#include <io.h>
 #include <multiboot.h>
 #include <pgalloc.h>
+#include <trace.h>
+
+/*
+    Page allocator. Every page frame has an entry in the page database, recording whether it is in an allocation, the
+    allocation's length and its owner, so any address can be traced back to its allocation without searching. Which
+    frames are free, and finding runs of them, is left to the free map (pgalloc_buddy.c or pgalloc_bitmap.c).
+
+    Pages that are only reached through a mapping, such as vmalloc and demand-zero frames, can be moved. When no run
+    is long enough, compaction picks the aligned block that needs the fewest pages moved, copies its movable pages
+    elsewhere and has their owner point at the copies, and the block is free in one piece.
+*/
+
+/* Page database, with an entry for each page frame from the first to the last free frame. It is taken from free memory by pgalloc_init */
+pgalloc_page_t *pgalloc_page_db = NULL;
+uint32_t pgalloc_first_frame = 0;
+uint32_t pgalloc_frame_count = 0;
+
+/* Counters, kept up to date by every operation so they can be read at any time */
+static pgalloc_stats_t pgalloc_stats;
+
+/* Usable memory found by pgalloc_init. The array is taken from boot memory, sized for the memory map */
+static pgalloc_range_t *pgalloc_ranges = NULL;
+static int pgalloc_range_count = 0;
+static int pgalloc_range_max = 0;
+
+/* Names of the zones */
+const char *pgalloc_zone_names[PGALLOC_ZONE_COUNT] = {"DMA", "normal", "high"};
+
+/* Zones each zone falls back to when it is out of memory, in order, starting with the zone itself */
+static pgalloc_zone_t pgalloc_fallback[PGALLOC_ZONE_COUNT][PGALLOC_ZONE_COUNT] = {
+    {PGALLOC_ZONE_DMA},
+    {PGALLOC_ZONE_NORMAL, PGALLOC_ZONE_DMA},
+    {PGALLOC_ZONE_HIGH, PGALLOC_ZONE_NORMAL, PGALLOC_ZONE_DMA}
+};
+static int pgalloc_fallback_count[PGALLOC_ZONE_COUNT] = {1, 2, 3};
+
+/* Pages zeroed while idle, ready for pgalloc_zeroed. They are allocated, so nothing else uses them */
+static void *pgalloc_zero_pool[PGALLOC_ZERO_POOL_SIZE];
+
+/* Whether the CPU has non-temporal stores (SSE2). -1 until it is checked */
+static int pgalloc_has_movnti = -1;
+
+/* Number of page colors of the largest cache, and the color the next allocation starts at while allocations are spread over the colors */
+uint32_t pgalloc_color_count = 1;
+static int pgalloc_coloring = 0;
+static uint32_t pgalloc_next_color = 0;
+
+/* Functions moving the pages of each owner. Owners without one are not movable */
+static pgalloc_migrate_t pgalloc_migrate[PGALLOC_OWNER_COUNT];
+
+/* Caches that give back memory when it runs out, and whether they are being called, so an allocation they make doesn't call them again */
+static pgalloc_shrinker_t pgalloc_shrinkers[PGALLOC_SHRINKER_COUNT];
+static int pgalloc_shrinker_count = 0;
+static int pgalloc_shrinking = 0;
+
+/* Add a run of usable memory to the ranges, split at zone boundaries */
+static void pgalloc_add_range(uint32_t frame, uint32_t pages) {
+    while (pages > 0) {
+        uint32_t count = pages;
+
+        if (frame < PGALLOC_ZONE_NORMAL_START && frame + count > PGALLOC_ZONE_NORMAL_START) {
+            count = PGALLOC_ZONE_NORMAL_START - frame;
+        } else if (frame < PGALLOC_ZONE_HIGH_START && frame + count > PGALLOC_ZONE_HIGH_START) {
+            count = PGALLOC_ZONE_HIGH_START - frame;
+        } else if (frame < PGALLOC_ZONE_HIGH_END && frame + count > PGALLOC_ZONE_HIGH_END) {
+            count = PGALLOC_ZONE_HIGH_END - frame;
+        }
 
-/* Free block linked list */
-pgalloc_free_block_t *pgalloc_free_head = NULL;
-pgalloc_free_block_t *pgalloc_free_tail = NULL;
-
-/* Pool of free block list entries */
-pgalloc_free_block_t pgalloc_free_block_pool[PGALLOC_FREE_BLOCK_POOL_SIZE];
+        if (pgalloc_range_count == pgalloc_range_max) {
+            printf("pgalloc_init: too many ranges of usable memory, ignoring %d pages at frame %x\n", pages, frame);
+            return;
+        }
 
-/* List of allocations longer than 1 page */
-pgalloc_multipage_t pgalloc_multipage_list[PGALLOC_MULTIPAGE_LIST_SIZE];
+        pgalloc_ranges[pgalloc_range_count].frame = frame;
+        pgalloc_ranges[pgalloc_range_count].pages = count;
+        pgalloc_range_count++;
 
-/* Allocate pages. Returns NULL if not successful */
-void *pgalloc(size_t pages) {
-    /* Check argument */
-    if (pages < 1) {
-        printf("pgalloc: tried to allocate less than 1 page\n");
-        return NULL;
+        frame += count;
+        pages -= count;
     }
+}
 
-    /* Get first free block */
-    pgalloc_free_block_t *blk = pgalloc_free_head;
+/* Clear pages with non-temporal stores, which go around the cache, so clearing pages for later doesn't evict data in use */
+static void pgalloc_clear_uncached(void *mem, uint32_t pages) {
+    if (pgalloc_has_movnti < 0) {
+        uint32_t a, b, c, d;
+        cpuid(1, &a, &b, &c, &d);
+        pgalloc_has_movnti = (d >> 26) & 1;
+    }
 
-    /* Is this block valid? If not, there's none in the list */
-    if (blk == NULL) {
-        printf("pgalloc: no free pages!\n");
-        return NULL;
+    if (!pgalloc_has_movnti) {
+        memset(mem, 0, pages << 12);
+        return;
     }
-    
-    /* Check for a block of suitable size*/
-    while (blk != NULL && blk->len < pages) {
-        blk = blk->next;
+
+    for (uint32_t *p = mem; p < (uint32_t *) mem + (pages << 10); p += 4) {
+        asm volatile ( "movnti %1, (%0)\n\t"
+                       "movnti %1, 4(%0)\n\t"
+                       "movnti %1, 8(%0)\n\t"
+                       "movnti %1, 12(%0)"
+                       : : "r"(p), "r"(0) : "memory" );
     }
 
-    /* Check that the block is valid */
-    if (blk == NULL) {
-        printf("pgalloc: no blocks large enough to fill request\n");
-        return NULL;
+    /* Non-temporal stores are weakly ordered, make them visible before the pages are handed out */
+    asm volatile ( "sfence" : : : "memory" );
+}
+
+/* Give the pages of a run that aren't allocated back to the free map */
+static void pgalloc_free_unused(uint32_t frame, uint32_t count) {
+    pgalloc_page_t *page = pgalloc_frame(frame);
+
+    for (uint32_t i=0; i<count; ) {
+        uint32_t end = i;
+        while (end < count && !(page[end].flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+            end++;
+        }
+
+        if (end > i) {
+            pgalloc_map_free(frame + i, end - i);
+            i = end;
+        } else {
+            i++;
+        }
     }
+}
 
-    /* Allocate from the end of this block */
-    uint32_t block_end = blk->base + (blk->len * 0x1000);
-    uint32_t allocation = block_end - (pages * 0x1000);
-    blk->len -= pages;
+/* Find the number of page colors of the largest cache: the bytes of one of its ways, in pages. cpuid leaf 4 describes the caches on Intel CPUs */
+static uint32_t pgalloc_find_colors(void) {
+    uint32_t a, b, c, d;
+    uint32_t colors = 0;
 
-    /* Add to the list of multi-page allocations if necessary */
-    if (pages > 1) {
-        int r = pgalloc_register_multipage(allocation, pages);
-        if (r) {
-            /* Undo allocation */
-            blk->len += pages;
+    cpuid(0, &a, &b, &c, &d);
+    if (a >= 4) {
+        for (uint32_t i=0; i<16; i++) {
+            cpuid_count(4, i, &a, &b, &c, &d);
+            if ((a & 0x1f) == 0) {
+                break;
+            }
 
-            printf("pgalloc: unable to register multipage allocation\n");
-            return NULL;
+            /* Sets times line size is the size of one way. The last level listed is the largest */
+            uint32_t line = (b & 0xfff) + 1;
+            uint32_t partitions = ((b >> 12) & 0x3ff) + 1;
+            uint32_t sets = c + 1;
+            colors = (sets * line * partitions) >> 12;
         }
     }
 
-    return (void *) allocation;
+    if (colors == 0) {
+        return PGALLOC_COLORS_DEFAULT;
+    }
+
+    /* A power of two, so the color is the low bits of the frame */
+    uint32_t count = 1;
+    while (count * 2 <= colors && count < PGALLOC_COLORS_MAX) {
+        count *= 2;
+    }
+
+    return count;
 }
 
-/* Add a block of free memory to the pool. Length in pages. Returns non-zero if not successful */
-int pgalloc_add_free_block(uint32_t base, uint32_t len) {
-    pgalloc_free_block_t *blk = pgalloc_alloc_free_block();
+/* Take a run of free frames from a zone starting at a frame of the given color. Without strict, a run of any color is taken if there is no run of that color. Returns non-zero if not successful */
+static int pgalloc_take_run(pgalloc_zone_t zone, uint32_t pages, uint32_t color, int strict, uint32_t *frame) {
+    if (color == PGALLOC_COLOR_ANY || pgalloc_color_count == 1) {
+        return pgalloc_map_alloc(zone, pages, frame);
+    }
 
-    /* Check that the list entry was allocated */
-    if (blk == NULL) {
-        printf("pgalloc_add_free_block: unable to allocate list entry\n");
-        return 1;
+    if (pgalloc_map_alloc_color(zone, pages, color, frame)) {
+        return strict ? 1 : pgalloc_map_alloc(zone, pages, frame);
     }
 
-    /* Initialize list entry */
-    blk->base = base;
-    blk->len = len;
-    blk->next = NULL;
+    return 0;
+}
+
+/* Shrinker of the zeroed pool. Its pages are only there to save time */
+static uint32_t pgalloc_shrink_zero_pool(uint32_t pages) {
+    uint32_t freed = 0;
 
-    /* Add to list */
-    if (pgalloc_free_head == NULL) {
-        pgalloc_free_head = blk;
-    } else {
-        pgalloc_free_tail->next = blk;
+    while (freed < pages && pgalloc_stats.zero_pool > 0) {
+        pgfree(pgalloc_zero_pool[--pgalloc_stats.zero_pool]);
+        freed++;
+    }
+
+    return freed;
+}
+
+/* Check if a run of frames is all usable memory, in one range */
+static int pgalloc_in_range(uint32_t frame, uint32_t count) {
+    for (int i=0; i<pgalloc_range_count; i++) {
+        if (frame >= pgalloc_ranges[i].frame && frame + count <= pgalloc_ranges[i].frame + pgalloc_ranges[i].pages) {
+            return 1;
+        }
     }
-    pgalloc_free_tail = blk;
 
     return 0;
 }
 
-/* Allocate a free block list entry from the pool. Returns NULL if not successful */
-pgalloc_free_block_t *pgalloc_alloc_free_block() {
-    /* Search for an unallocated block */
-    for (int i=0; i<PGALLOC_FREE_BLOCK_POOL_SIZE; i++) {
-        pgalloc_free_block_t *blk = pgalloc_free_block_pool + i;
+/* Remove memory that is in use from the ranges. Bounds in bytes, any page they touch is removed */
+static void pgalloc_reserve(uint32_t start, uint32_t end) {
+    uint32_t first = start >> 12;
+    uint32_t last = (end + 0xfff) >> 12;
+
+    if (first >= last) {
+        return;
+    }
+
+    for (int i=0; i<pgalloc_range_count; i++) {
+        pgalloc_range_t *range = pgalloc_ranges + i;
+        uint32_t range_end = range->frame + range->pages;
+
+        if (last <= range->frame || first >= range_end) {
+            continue;
+        }
 
-        /* Use this block if it's free */
-        if (blk->pool_status == PGALLOC_BLOCK_FREE) {
-            blk->pool_status = PGALLOC_BLOCK_INUSE;
-            return blk;
+        /* The part after the reserved memory becomes a range of its own */
+        if (last < range_end) {
+            pgalloc_add_range(last, range_end - last);
         }
+
+        range->pages = (first > range->frame) ? first - range->frame : 0;
     }
+}
 
-    /* No free blocks */
-    printf("pgalloc_alloc_free_block: no list entries left in pool\n");
-    return NULL;
+/* Mark a run of frames taken from the free map as an allocation and count it. Returns the first page */
+static void *pgalloc_mark(uint32_t frame, uint32_t pages) {
+    /* The first page holds the length, the others point back to it */
+    pgalloc_page_t *page = pgalloc_frame(frame);
+    for (uint32_t i=0; i<pages; i++) {
+        page[i].flags = i == 0 ? PGALLOC_PAGE_ALLOC : PGALLOC_PAGE_TAIL;
+        page[i].owner = PGALLOC_OWNER_NONE;
+        page[i].pages = i == 0 ? pages : i;
+        page[i].virt = NULL;
+    }
+
+    pgalloc_stats.allocs++;
+    pgalloc_stats.pages_free -= pages;
+    pgalloc_stats.zone_free[pgalloc_zone_of(frame)] -= pages;
+
+    trace(TRACE_PGALLOC, (void *)(frame << 12), pages);
+    return (void *)(frame << 12);
 }
 
-/* Free a free block list entry */
-void pgalloc_free_free_block(pgalloc_free_block_t *blk) {
-    blk->pool_status = PGALLOC_BLOCK_FREE;
+/* Allocate pages from the normal zone, or the zones it falls back to. Returns NULL if not successful */
+void *pgalloc(size_t pages) {
+    return pgalloc_zone(PGALLOC_ZONE_NORMAL, pages);
 }
 
-/* Initialize the page allocator. Returns non-zero if not successful */
-int pgalloc_init(void) {
-    /* Get and adjust bounds of kernel. These symbols are from the linker script */
-    uint32_t kstart = (uint32_t) &kernel_start;
-    uint32_t kend = (uint32_t) &kernel_end;
+/* Move movable pages out of an aligned block of a zone until the whole block is free, so an allocation of the given number of pages fits. Returns non-zero if no block could be freed */
+int pgalloc_compact(pgalloc_zone_t zone, size_t pages) {
+    /* Pages are copied through the direct map, and have to go somewhere else in the zone */
+    uint32_t count = 1;
+    while (count < pages) {
+        count <<= 1;
+    }
+
+    if ((uint32_t) zone >= PGALLOC_ZONE_HIGH || pages < 1 || pgalloc_stats.zone_free[zone] < count) {
+        trace(TRACE_PGALLOC_NO_COMPACT, NULL, pages);
+        return 1;
+    }
+
+    /* Frames of the zone in the page database, in blocks aligned to their size */
+    uint32_t start = (zone == PGALLOC_ZONE_DMA) ? 0 : PGALLOC_ZONE_NORMAL_START;
+    uint32_t end = (zone == PGALLOC_ZONE_DMA) ? PGALLOC_ZONE_NORMAL_START : PGALLOC_ZONE_HIGH_START;
+    if (start < pgalloc_first_frame) {
+        start = pgalloc_first_frame;
+    }
+    if (end > pgalloc_first_frame + pgalloc_frame_count) {
+        end = pgalloc_first_frame + pgalloc_frame_count;
+    }
+    start = (start + count - 1) & ~(count - 1);
+
+    /* The block needing the fewest moves. Every page of it has to be free, or a single page allocation of a movable owner */
+    uint32_t best = 0;
+    uint32_t best_moves = count + 1;
+    for (uint32_t block = start; block < end && end - block >= count && best_moves != 0; block += count) {
+        if (!pgalloc_in_range(block, count)) {
+            continue;
+        }
+
+        pgalloc_page_t *page = pgalloc_frame(block);
+        uint32_t moves = 0;
+        for (uint32_t i=0; i<count && moves <= count; i++) {
+            if (!(page[i].flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+                continue;
+            } else if (page[i].flags != PGALLOC_PAGE_ALLOC || page[i].pages != 1 || pgalloc_migrate[page[i].owner] == NULL) {
+                moves = count + 1;
+            } else {
+                moves++;
+            }
+        }
 
-    kstart &= ~0xfff;
+        if (moves < best_moves) {
+            best = block;
+            best_moves = moves;
+        }
+    }
 
-    if ((kend & 0xfff) != 0) {
-        kend = (kend & ~0xfff) + 0x1000;
+    if (best_moves > count) {
+        trace(TRACE_PGALLOC_NO_COMPACT, NULL, pages);
+        return 1;
+    } else if (best_moves == 0) {
+        return 0;
     }
-    kend--;
 
-    /* Initialize free block pool */
-    for (int i=0; i<PGALLOC_FREE_BLOCK_POOL_SIZE; i++) {
-        pgalloc_free_block_pool[i].pool_status = PGALLOC_BLOCK_FREE;
+    /* Take the free pages of the block out of the free map first, so the copies can't be put in the block */
+    pgalloc_page_t *page = pgalloc_frame(best);
+    for (uint32_t i=0; i<count; ) {
+        uint32_t run = i;
+        while (run < count && !(page[run].flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+            run++;
+        }
+
+        if (run > i && pgalloc_map_claim(best + i, run - i)) {
+            pgalloc_free_unused(best, i);
+            trace(TRACE_PGALLOC_NO_COMPACT, NULL, pages);
+            return 1;
+        }
+        i = (run > i) ? run : i + 1;
     }
 
-    /* Initialize multipage allocation list */
-    for (int i=0; i<PGALLOC_MULTIPAGE_LIST_SIZE; i++) {
-        pgalloc_multipage_list[i].base = 0;
-        pgalloc_multipage_list[i].pages = 0;
+    /* Copy each page and have its owner point at the copy. The original is left out of the free map until the block is done */
+    uint32_t moved = 0;
+    for (uint32_t i=0; i<count; i++) {
+        if (page[i].flags != PGALLOC_PAGE_ALLOC) {
+            continue;
+        }
+
+        uint32_t to;
+        if (pgalloc_map_alloc(zone, 1, &to)) {
+            break;
+        }
+
+        memmove((void *)(to << 12), (void *)((best + i) << 12), 4096);
+        if (pgalloc_migrate[page[i].owner]((void *)((best + i) << 12), (void *)(to << 12))) {
+            pgalloc_map_free(to, 1);
+            break;
+        }
+
+        *pgalloc_frame(to) = page[i];
+        page[i].flags = 0;
+        page[i].owner = PGALLOC_OWNER_NONE;
+        moved++;
     }
 
-    /* Add free blocks from the bootloader */
+    /* A page and its copy are both in the zone, so the free counts don't change */
+    pgalloc_free_unused(best, count);
+    pgalloc_stats.pages_migrated += moved;
+
+    if (moved != best_moves) {
+        trace(TRACE_PGALLOC_NO_COMPACT, NULL, pages);
+        return 1;
+    }
+
+    pgalloc_stats.compactions++;
+    trace(TRACE_PGALLOC_COMPACT, (void *)(best << 12), moved);
+    return 0;
+}
+
+/* Add a run of free memory to the allocator. Length in pages */
+void pgalloc_add_free_block(uint32_t base, uint32_t len) {
+    pgalloc_map_free(base >> 12, len);
+
+    pgalloc_stats.pages_total += len;
+    pgalloc_stats.pages_free += len;
+    pgalloc_stats.zone_total[pgalloc_zone_of(base >> 12)] += len;
+    pgalloc_stats.zone_free[pgalloc_zone_of(base >> 12)] += len;
+}
+
+/* Get the page allocator's counters. They are maintained by every operation, except the largest free run of the bitmap free map which is found by scanning the bitmap */
+void pgalloc_get_stats(pgalloc_stats_t *stats) {
+    *stats = pgalloc_stats;
+    pgalloc_map_get_stats(stats);
+}
+
+/* Allocate pages from the high zone only, without falling back or asking the shrinkers. They can't be read or written until they are mapped, so this is for memory only reached through a mapping. Returns NULL if the zone has no run that long */
+void *pgalloc_high(size_t pages) {
+    /* Callers fall back to the direct map themselves, so an empty zone isn't a failure */
+    uint32_t frame;
+    if (pages < 1 || pgalloc_stats.zone_free[PGALLOC_ZONE_HIGH] < pages || pgalloc_map_alloc(PGALLOC_ZONE_HIGH, pages, &frame)) {
+        return NULL;
+    }
+
+    return pgalloc_mark(frame, pages);
+}
+
+/* Grow a page allocation in place to the given number of pages, using the free pages right after it. Returns non-zero if not successful */
+int pgalloc_grow(void *ptr, size_t pages) {
+    uint32_t frame = (uint32_t) ptr >> 12;
+    uint32_t old_pages = pgalloc_pages(ptr);
+
+    if (pages <= old_pages) {
+        return 0;
+    }
+
+    /* An allocation stays in its zone */
+    uint32_t extra = pages - old_pages;
+    if (pgalloc_zone_of(frame + pages - 1) != pgalloc_zone_of(frame) || pgalloc_map_claim(frame + old_pages, extra)) {
+        trace(TRACE_PGALLOC_NO_GROW, ptr, pages);
+        return 1;
+    }
+
+    pgalloc_page_t *page = pgalloc_frame(frame);
+    for (uint32_t i=old_pages; i<pages; i++) {
+        page[i].flags = PGALLOC_PAGE_TAIL;
+        page[i].owner = page->owner;
+        page[i].pages = i;
+        page[i].virt = NULL;
+    }
+    page->pages = pages;
+
+    pgalloc_stats.pages_free -= extra;
+    pgalloc_stats.zone_free[pgalloc_zone_of(frame)] -= extra;
+
+    trace(TRACE_PGALLOC_GROW, ptr, pages);
+    return 0;
+}
+
+/* Get the first page of the allocation memory is in. Returns NULL if it is not in an allocation */
+void *pgalloc_head(void *ptr) {
+    uint32_t frame = (uint32_t) ptr >> 12;
+    pgalloc_page_t *page = pgalloc_frame(frame);
+
+    if (page == NULL) {
+        return NULL;
+    } else if (page->flags == PGALLOC_PAGE_ALLOC) {
+        return (void *)(frame << 12);
+    } else if (page->flags == PGALLOC_PAGE_TAIL) {
+        return (void *)((frame - page->pages) << 12);
+    }
+
+    return NULL;
+}
+
+/* Initialize the page allocator. Returns non-zero if not successful */
+int pgalloc_init(void) {
     int map_size = multiboot_info->mmap_length / sizeof(multiboot_memory_map_t);
-    for (int i=0;i<map_size;i++) {
-        /* Is the block available? */
+
+    /* Each entry can be split in one range per zone, and each reservation below, including boot memory, adds one more */
+    pgalloc_range_max = (map_size * PGALLOC_ZONE_COUNT) + 5;
+    pgalloc_ranges = bootmem_alloc(pgalloc_range_max * sizeof(pgalloc_range_t), sizeof(uint32_t));
+    if (pgalloc_ranges == NULL) {
+        printf("pgalloc_init: no boot memory for %d ranges\n", pgalloc_range_max);
+        return 1;
+    }
+
+    /* Whole pages of every available entry in the memory map, including memory above 4 GiB */
+    pgalloc_range_count = 0;
+    for (int i=0; i<map_size; i++) {
         if (multiboot_info->mmap_addr[i].type != MULTIBOOT_MEMORY_AVAILABLE) {
             continue;
         }
 
-        /* Does the block start after 32-bit space? Not interested */
-        uint64_t addr = multiboot_info->mmap_addr[i].addr;
-        if ((addr >> 32) != 0) {
-            continue;
+        uint64_t first = (multiboot_info->mmap_addr[i].addr + 0xfff) >> 12;
+        uint64_t last = (multiboot_info->mmap_addr[i].addr + multiboot_info->mmap_addr[i].len) >> 12;
+
+        /* Frame numbers are 32 bits, which is 16 TiB */
+        if (last > 0xffffffff) {
+            last = 0xffffffff;
         }
 
-        /* Does the block end after 32-bit space? Adjust the length */
-        uint64_t len = multiboot_info->mmap_addr[i].len;
-        uint64_t block_end = addr + len - 1;
-        if ((block_end >> 32) != 0) {
-            /* Size of block after the 64-bit boundary */
-            uint64_t unwanted = 0x100000000 - (block_end + 1);
-            
-            /* Subtract the unwanted memory from the block */
-            len -= unwanted;
-            block_end = addr + len - 1;
+        if (first < last) {
+            pgalloc_add_range((uint32_t) first, (uint32_t) (last - first));
         }
+    }
 
-        /* Is the block entirely under 2M? */
-        if (block_end < 0x200000) {
+    /* Take out memory that is in use: the first page, so no allocation is at NULL, the kernel and the multiboot information that is still read */
+    pgalloc_reserve(0, 0x1000);
+    pgalloc_reserve(KERNEL_PHYS(&kernel_start), KERNEL_PHYS(&kernel_end));
+    pgalloc_reserve((uint32_t) multiboot_info, (uint32_t) multiboot_info + sizeof(multiboot_info_t));
+    pgalloc_reserve((uint32_t) multiboot_info->mmap_addr, (uint32_t) multiboot_info->mmap_addr + multiboot_info->mmap_length);
+
+    /* Find the range of frames the page database has to cover, which includes boot memory as it hasn't been reserved yet. Memory above 4 GiB can't be mapped without PAE, so it is only counted */
+    uint32_t first = 0xffffffff;
+    uint32_t last = 0;
+    uint32_t unmappable = 0;
+    for (int i=0; i<pgalloc_range_count; i++) {
+        pgalloc_range_t *range = pgalloc_ranges + i;
+
+        if (range->pages == 0) {
+            continue;
+        } else if (range->frame >= PGALLOC_ZONE_HIGH_END) {
+            unmappable += range->pages;
             continue;
         }
 
-        /* Does the block contain memory under 2M? */
-        if (addr < 0x200000) {
-            addr = 0x200000;
-            len = block_end - addr + 1;
+        if (range->frame < first) {
+            first = range->frame;
         }
+        if (range->frame + range->pages > last) {
+            last = range->frame + range->pages;
+        }
+    }
 
-        /* Does the block include the kernel? Adjust the block */
-        if (addr <= kstart && block_end > kend) {
-            addr = kend + 1;
-            len = block_end - addr + 1;
+    if (last == 0) {
+        printf("pgalloc_init: no usable memory\n");
+        return 1;
+    }
+
+    /* Take the page database and the free map from boot memory, then reserve all of the boot memory that was used */
+    uint32_t db_pages = (((last - first) * sizeof(pgalloc_page_t)) + 0xfff) >> 12;
+    uint32_t array_pages = db_pages + pgalloc_map_pages(last - first);
+    uint32_t base = (uint32_t) bootmem_alloc(array_pages << 12, 0x1000);
+    if (base == 0) {
+        printf("pgalloc_init: no boot memory for the %d page database and free map\n", array_pages);
+        return 1;
+    }
+
+    uint32_t boot_start, boot_end;
+    bootmem_finish(&boot_start, &boot_end);
+    pgalloc_reserve(boot_start, boot_end);
+
+    pgalloc_page_db = (pgalloc_page_t *) base;
+    pgalloc_first_frame = first;
+    pgalloc_frame_count = last - first;
+    memset(pgalloc_page_db, 0, pgalloc_frame_count * sizeof(pgalloc_page_t));
+    pgalloc_map_init((void *)(base + (db_pages << 12)));
+
+    /* Add free blocks from the bootloader */
+    for (int i=0; i<pgalloc_range_count; i++) {
+        pgalloc_range_t *range = pgalloc_ranges + i;
+
+        if (range->pages == 0 || range->frame >= PGALLOC_ZONE_HIGH_END) {
+            continue;
         }
 
         /* Print the finalized block information */
-        uint32_t addr32 = (uint32_t) addr;
-        uint32_t len32 = (uint32_t) len;
-        printf("pgalloc_init: adding block starting at %x of length %x to the free pool\n", addr32, len32);
-
-        /* Add the block to the free blocks list */
-        uint32_t pages = len32 >> 12;
-        int r = pgalloc_add_free_block(addr32, pages);
-        if (r) {
-            printf("pgalloc_init: unable to add free block to pool\n");
-            return 1;
-        }
+        printf("pgalloc_init: adding block starting at %x of length %x to the %s zone\n", range->frame << 12, range->pages << 12, pgalloc_zone_names[pgalloc_zone_of(range->frame)]);
+        pgalloc_add_free_block(range->frame << 12, range->pages);
+    }
+
+    /* Boot memory is kept as an allocation, so it is accounted for and its owner can be looked up */
+    uint32_t boot_frame = boot_start >> 12;
+    uint32_t boot_pages = (boot_end - boot_start) >> 12;
+    for (uint32_t i=0; i<boot_pages; i++) {
+        pgalloc_page_t *page = pgalloc_frame(boot_frame + i);
+        page->flags = (i == 0) ? PGALLOC_PAGE_ALLOC : PGALLOC_PAGE_TAIL;
+        page->owner = PGALLOC_OWNER_BOOT;
+        page->pages = (i == 0) ? boot_pages : i;
+        pgalloc_stats.zone_total[pgalloc_zone_of(boot_frame + i)]++;
+    }
+    pgalloc_stats.pages_total += boot_pages;
+    pgalloc_stats.boot_pages = boot_pages;
+    printf("pgalloc_init: %d pages of boot memory in use starting at %x\n", boot_pages, boot_start);
+
+    pgalloc_register_shrinker("zero pool", pgalloc_shrink_zero_pool);
+
+    pgalloc_color_count = pgalloc_find_colors();
+    printf("pgalloc_init: %d page colors\n", pgalloc_color_count);
+
+    /* High memory below 4 GiB is in the free map. No other zone falls back to it, so only callers that map their pages get it */
+    if (unmappable != 0) {
+        pgalloc_stats.zone_total[PGALLOC_ZONE_HIGH] += unmappable;
+        printf("pgalloc_init: %d pages above 4 GiB would need PAE paging and are not used\n", unmappable);
     }
 
     return 0;
 }
 
+/* Get where the page of a page allocation memory is in was last mapped in kernel space. Returns NULL if it isn't mapped, or isn't allocated */
+void *pgalloc_mapping(void *ptr) {
+    pgalloc_page_t *page = pgalloc_page_of(ptr);
+    if (page == NULL || !(page->flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+        return NULL;
+    }
+
+    return page->virt;
+}
+
+/* Get the owner of the allocation memory is in */
+pgalloc_owner_t pgalloc_owner(void *ptr) {
+    pgalloc_page_t *page = pgalloc_page_of(ptr);
+    if (page == NULL || !(page->flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+        return PGALLOC_OWNER_NONE;
+    }
+
+    return page->owner;
+}
+
+/* Get the database entry of the page memory is in. Returns NULL if the page is not managed by the allocator */
+pgalloc_page_t *pgalloc_page_of(void *ptr) {
+    return pgalloc_frame((uint32_t) ptr >> 12);
+}
+
+/* Get the number of pages in a page allocation */
+size_t pgalloc_pages(void *ptr) {
+    pgalloc_page_t *page = pgalloc_page_of(ptr);
+    if (page == NULL || page->flags != PGALLOC_PAGE_ALLOC) {
+        return 0;
+    }
+
+    return page->pages;
+}
+
 /* Print current state of the page allocator system */
 void pgalloc_print_diagnostics(void) {
-    printf(" free blocks: <");
-
-    pgalloc_free_block_t *blk = pgalloc_free_head;
-    while (blk != NULL) {
-        printf("%x:%d",blk->base,blk->len);
-        if (blk->next != NULL) {
+    /* Free and total pages of each zone */
+    printf(" zones: <");
+    for (int i=0; i<PGALLOC_ZONE_COUNT; i++) {
+        if (i != 0) {
             printf(",");
         }
+        printf("%s:%d/%d",pgalloc_zone_names[i],pgalloc_stats.zone_free[i],pgalloc_stats.zone_total[i]);
+    }
+    printf(">\n");
+    printf(" compaction: %d blocks made free, %d pages moved\n",pgalloc_stats.compactions,pgalloc_stats.pages_migrated);
 
-        blk = blk->next;
+    /* Pages each shrinker gave back */
+    printf(" shrinkers: <");
+    for (int i=0; i<pgalloc_shrinker_count; i++) {
+        if (i != 0) {
+            printf(",");
+        }
+        printf("%s:%d",pgalloc_shrinkers[i].name,pgalloc_shrinkers[i].pages);
     }
     printf(">\n");
+
+    pgalloc_map_print_diagnostics();
 }
 
-/* Register a multi-page allocation in the list of multi-page allocations */
-int pgalloc_register_multipage(uint32_t base, uint32_t pages) {
-    /* Search for an empty entry in the list */
-    for (int i=0; i<PGALLOC_MULTIPAGE_LIST_SIZE; i++) {
-        /* If pages=0 then the list entry is free */
-        if (pgalloc_multipage_list[i].base == 0) {
-            pgalloc_multipage_list[i].base = base;
-            pgalloc_multipage_list[i].pages = pages;
-            return 0;
-        }
+/* Register a cache's shrinker, called before an allocation fails. The name is not copied. Returns non-zero if not successful */
+int pgalloc_register_shrinker(const char *name, pgalloc_shrink_t shrink) {
+    if (shrink == NULL || pgalloc_shrinker_count == PGALLOC_SHRINKER_COUNT) {
+        return 1;
     }
 
-    printf("pgalloc_register_multipage: no free entries in the multipage list\n");
-    return 1;
+    pgalloc_shrinkers[pgalloc_shrinker_count].name = name;
+    pgalloc_shrinkers[pgalloc_shrinker_count].shrink = shrink;
+    pgalloc_shrinkers[pgalloc_shrinker_count].pages = 0;
+    pgalloc_shrinker_count++;
+    return 0;
 }
 
-/* Free a page allocation */
-void pgfree(void *ptr) {
-    uint32_t pages = 1;
-    uint32_t base = (uint32_t) ptr;
-
-    /* Check if it's multipage. If it's not in the list, it's one page */
-    for (int i=0; i<PGALLOC_MULTIPAGE_LIST_SIZE; i++) {
-        /* Check if base matches */
-        if (pgalloc_multipage_list[i].base == base) {
-            /* Retrieve page count */
-            pages = pgalloc_multipage_list[i].pages;
-            
-            /* Mark as unused */
-            pgalloc_multipage_list[i].base = 0;
-            pgalloc_multipage_list[i].pages = 0;
-            break;
+/* Set the zones a zone falls back to when it is out of memory, in the order they are tried, starting with the zone itself. Returns non-zero if the list is not valid */
+int pgalloc_set_fallback(pgalloc_zone_t zone, const pgalloc_zone_t *zones, int count) {
+    if ((uint32_t) zone >= PGALLOC_ZONE_COUNT || count < 1 || count > PGALLOC_ZONE_COUNT || zones[0] != zone) {
+        return 1;
+    }
+
+    for (int i=0; i<count; i++) {
+        if ((uint32_t) zones[i] >= PGALLOC_ZONE_COUNT) {
+            return 1;
         }
     }
 
-    pgalloc_free_block_t *blk = pgalloc_free_head;
+    for (int i=0; i<count; i++) {
+        pgalloc_fallback[zone][i] = zones[i];
+    }
+    pgalloc_fallback_count[zone] = count;
+    return 0;
+}
+
+/* Spread allocations of more than one page over the page colors */
+void pgalloc_set_coloring(int enable) {
+    pgalloc_coloring = enable;
+    pgalloc_next_color = 0;
+}
 
-    /* Shortcut: this allocation is right at the end of a free block */
-    /* Note: when this loop exits, blk should be NULL if the shortcut wasn't taken, and will hold the pointer to the expanded block if the shortcut was taken */
-    while (blk != NULL) {
-        uint32_t block_end = blk->base + (blk->len * 0x1000);
+/* Record where the page of a page allocation memory is in is mapped in kernel space, or NULL once it is unmapped */
+void pgalloc_set_mapping(void *ptr, void *virt) {
+    pgalloc_page_t *page = pgalloc_page_of(ptr);
+    if (page != NULL && (page->flags & (PGALLOC_PAGE_ALLOC | PGALLOC_PAGE_TAIL))) {
+        page->virt = virt;
+    }
+}
 
-        /* The block to free is on the end of this free block */
-        if (base == block_end) {
-            printf("pgfree: adjacent after\n");
-            blk->len += pages;
-            /* leave blk with the pointer to the expanded block */
-            break;
-        } else {
-            /* next in list */
-            blk = blk->next;
-        }
+/* Make single page allocations of an owner movable by compaction, with a function that moves the references to them */
+void pgalloc_set_migrate(pgalloc_owner_t owner, pgalloc_migrate_t migrate) {
+    if ((uint32_t) owner < PGALLOC_OWNER_COUNT && owner != PGALLOC_OWNER_NONE && owner != PGALLOC_OWNER_BOOT) {
+        pgalloc_migrate[owner] = migrate;
     }
+}
 
-    /* Shortcut: this allocation is right at the beginning of a free block */
-    if (blk == NULL) {
-        while (blk != NULL) {
-            uint32_t block_end = base + (pages * 0x1000);
+/* Set the owner of a page allocation */
+void pgalloc_set_owner(void *ptr, pgalloc_owner_t owner) {
+    pgalloc_page_t *page = pgalloc_page_of(ptr);
+    if (page == NULL || page->flags != PGALLOC_PAGE_ALLOC) {
+        return;
+    }
 
-            /* The block to free is at the beginning of this free block */
-            if (blk->base == block_end) {
-                printf("pgfree: adjacent before\n");
-                blk->base = base;
-                blk->len += pages;
+    /* Every page holds the owner, so it can be found from any address in the allocation */
+    for (uint32_t i=0; i<page->pages; i++) {
+        page[i].owner = owner;
+    }
+}
 
-                /* leave blk with the pointer to the expanded block */
-                break;
-            }
-        }
+/* Ask the shrinkers to give back at least the given number of pages, in the order they were registered. Returns the number of pages freed */
+uint32_t pgalloc_shrink(uint32_t pages) {
+    if (pgalloc_shrinking) {
+        return 0;
     }
 
-    /* Not either shortcut case: make a new entry in the free block list */
-    if (blk == NULL) {
-        printf("pgfree: non-adjacent\n");
+    pgalloc_shrinking = 1;
+    pgalloc_stats.shrinks++;
 
-        /* New free block list entry */
-        blk = pgalloc_alloc_free_block();
-        if (blk == NULL) {
-            printf("pgfree: unable to allocate free block list entry\n");
-            return;
-        }
+    uint32_t freed = 0;
+    for (int i=0; i<pgalloc_shrinker_count && freed < pages; i++) {
+        uint32_t given = pgalloc_shrinkers[i].shrink(pages - freed);
+        pgalloc_shrinkers[i].pages += given;
+        freed += given;
+    }
 
-        /* Fill in the list entry */
-        blk->base = base;
-        blk->len = pages;
+    pgalloc_shrinking = 0;
+    trace(TRACE_PGALLOC_SHRINK, NULL, freed);
+    return freed;
+}
 
-        /* Add to the front of the list. Due to how pgalloc works, this will give priority to previously used memory, which is usually closer in size than the free blocks created in pgalloc_init */
-        if (pgalloc_free_tail == NULL) {
-            pgalloc_free_tail = blk;
-        }
-        blk->next = pgalloc_free_head;
-        pgalloc_free_head = blk;
+/* Zero one page for the zeroed pool, for the idle loop to call before halting. Returns non-zero if there was nothing to do */
+int pgalloc_zero_idle(void) {
+    /* The pool doesn't take the last free pages of the normal zone, they are left for real allocations */
+    if (pgalloc_stats.zero_pool == PGALLOC_ZERO_POOL_SIZE || pgalloc_stats.zone_free[PGALLOC_ZONE_NORMAL] <= PGALLOC_ZERO_POOL_SIZE) {
+        return 1;
     }
 
-    /* Merge if this makes the block adjacent to any others */
-    pgalloc_free_block_t *absorber = pgalloc_free_head;
+    void *page = pgalloc_zone(PGALLOC_ZONE_NORMAL, 1);
+    if (page == NULL) {
+        return 1;
+    }
 
-    while (absorber != NULL) {
-        /* Makes no sense for a block to absorb itself */
-        if (absorber == blk) {
-            absorber = absorber->next;
-            continue;
-        }
+    pgalloc_clear_uncached(page, 1);
+    pgalloc_zero_pool[pgalloc_stats.zero_pool++] = page;
 
-        /* Some bounds calculations */
-        uint32_t absorber_begin = absorber->base;
-        uint32_t absorber_end = absorber->base + (absorber->len * 0x1000);
-        uint32_t block_begin = blk->base;
-        uint32_t block_end = blk->base + (blk->len * 0x1000);
-
-        /* Changed block is before the absorber block */
-        int absorbed = 0;
-        if (absorber_begin == block_end) {
-            printf("pgfree: absorb before\n");
-            absorber->base = blk->base;
-            absorber->len = blk->len + absorber->len;
-            absorbed = 1;
-        }
+    trace(TRACE_PGALLOC_ZERO_IDLE, page, pgalloc_stats.zero_pool);
+    return 0;
+}
 
-        /* Changed block is after the absorber block */
-        if ((absorbed == 0) && (absorber_end == block_begin)) {
-            printf("pgfree: absorb after\n");
-            absorber->len += blk->len;
-            absorbed = 1;
-        }
+/* Allocate zeroed pages. Single pages come from the pool zeroed while idle, anything else is cleared on the spot. Returns NULL if not successful */
+void *pgalloc_zeroed(size_t pages) {
+    if (pages == 1 && pgalloc_stats.zero_pool > 0) {
+        void *page = pgalloc_zero_pool[--pgalloc_stats.zero_pool];
+        pgalloc_stats.zero_hits++;
 
-        /* Handle absorption */
-        if (absorbed) {
-            /* Removing the head of the list is a special case */
-            if (blk == pgalloc_free_head) {
-                pgalloc_free_head = blk->next;
-            } else {
-                /* Find the previous block to the absorbed block */
-                pgalloc_free_block_t *prev = pgalloc_free_head;
-                while (prev != NULL) {
-                    /* The next block of this block is blk */
-                    if(prev->next == blk) {
-                        break;
-                    }
-
-                    prev = prev->next;
-                }
+        trace(TRACE_PGALLOC_ZEROED, page, pgalloc_stats.zero_pool);
+        return page;
+    }
 
-                /* Something weird happened and the absorbed block is not in the list? */
-                if (prev == NULL) {
-                    printf("pgfree: absorbed block is not in the list\n");
-                    return;
-                }
+    void *ptr = pgalloc(pages);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    /* The caller is about to use the memory, so it is cleared through the cache */
+    memset(ptr, 0, pages << 12);
+    pgalloc_stats.zero_misses++;
+
+    trace(TRACE_PGALLOC_ZERO_MISS, ptr, pages);
+    return ptr;
+}
 
-                /* Remove from list */
-                prev->next = blk->next;
+/* Allocate pages from a zone, or the zones it falls back to, starting at a frame of the given color. Returns NULL if not successful */
+static void *pgalloc_alloc(pgalloc_zone_t zone, size_t pages, uint32_t color, int strict) {
+    /* Check argument */
+    if (pages < 1) {
+        trace(TRACE_PGALLOC_BAD_SIZE, NULL, pages);
+        pgalloc_stats.failed++;
+        return NULL;
+    }
+
+    if ((uint32_t) zone >= PGALLOC_ZONE_COUNT) {
+        trace(TRACE_PGALLOC_BAD_ZONE, NULL, zone);
+        pgalloc_stats.failed++;
+        return NULL;
+    }
+
+    /* Compaction makes a run at any color, so one for a given color needs room in it to skip to that color */
+    uint32_t needed = (strict && color != PGALLOC_COLOR_ANY) ? pages + pgalloc_color_count - 1 : pages;
+
+    /* Try the zone, then the zones it falls back to */
+    uint32_t frame;
+    int tried = 0;
+    int shrunk = 0;
+    int compacted = 0;
+    while (pgalloc_take_run(pgalloc_fallback[zone][tried], pages, color, strict, &frame)) {
+        tried++;
+        if (tried == pgalloc_fallback_count[zone]) {
+            /* Out of memory. Caches give back what they can do without */
+            if (!shrunk) {
+                shrunk = 1;
+                if (pgalloc_shrink(needed) != 0) {
+                    tried = 0;
+                    continue;
+                }
             }
 
-            /* Free absorbed blk */
-            pgalloc_free_free_block(blk);
+            /* Enough pages may be free, just not next to each other. Moving some can make a run in the zone itself */
+            if (needed > 1 && !compacted && !pgalloc_compact(zone, needed)) {
+                compacted = 1;
+                tried = 0;
+                continue;
+            }
 
-            break;
+            pgalloc_stats.failed++;
+            return NULL;
         }
-        
-        absorber = absorber->next;
+
+        trace(TRACE_PGALLOC_FALLBACK, NULL, pgalloc_fallback[zone][tried]);
+    }
+
+    return pgalloc_mark(frame, pages);
+}
+
+/* Allocate pages from a zone, or the zones it falls back to, starting at a frame of the given color. Returns NULL if not successful */
+void *pgalloc_color(pgalloc_zone_t zone, size_t pages, uint32_t color) {
+    if (color >= pgalloc_color_count) {
+        trace(TRACE_PGALLOC_BAD_COLOR, NULL, color);
+        pgalloc_stats.failed++;
+        return NULL;
+    }
+
+    return pgalloc_alloc(zone, pages, color, 1);
+}
+
+/* Allocate pages from a zone, or the zones it falls back to. Returns NULL if not successful */
+void *pgalloc_zone(pgalloc_zone_t zone, size_t pages) {
+    if (!pgalloc_coloring || pages < 2) {
+        return pgalloc_alloc(zone, pages, PGALLOC_COLOR_ANY, 0);
+    }
+
+    /* The next buffer starts where this one ends, if there is room to pick its color */
+    void *ptr = pgalloc_alloc(zone, pages, pgalloc_next_color, 0);
+    if (ptr != NULL) {
+        pgalloc_next_color = (pgalloc_color_of(ptr) + pages) & (pgalloc_color_count - 1);
+    }
+    return ptr;
+}
+
+/* Free a page allocation */
+void pgfree(void *ptr) {
+    uint32_t frame = (uint32_t) ptr >> 12;
+    pgalloc_page_t *page = pgalloc_frame(frame);
+
+    /* Only the first page of an allocation can be freed, and boot memory is never freed */
+    if (((uint32_t) ptr & 0xfff) != 0 || page == NULL || page->flags != PGALLOC_PAGE_ALLOC || page->owner == PGALLOC_OWNER_BOOT) {
+        trace(TRACE_PGFREE_BAD, ptr, 0);
+        return;
+    }
+
+    uint32_t pages = page->pages;
+    trace(TRACE_PGFREE, ptr, pages);
+
+    for (uint32_t i=0; i<pages; i++) {
+        page[i].flags = 0;
+        page[i].owner = PGALLOC_OWNER_NONE;
     }
-}
\ No newline at end of file
+    pgalloc_map_free(frame, pages);
+
+    pgalloc_stats.frees++;
+    pgalloc_stats.pages_free += pages;
+    pgalloc_stats.zone_free[pgalloc_zone_of(frame)] += pages;
+}
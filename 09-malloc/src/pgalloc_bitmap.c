@@ -0,0 +1,290 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pgalloc.h>
+#include <trace.h>
+
+/*
+    Bitmap free map. Every frame the page database covers has a bit, set while the frame is free, so 1 GiB of memory
+    takes 32 KiB of bitmap and there is no limit on how many separate runs of free frames there are. Runs are found
+    32 frames at a time: a word with no bits set is skipped in one step, and the start and end of a run inside a word
+    are found with a bit scan. Each zone searches its part of the bitmap, and every frame of a zone below its hint is
+    in use, so searches start there. The number of runs changes by one at most per claim or free, going by the bits
+    either side of it. The largest run is kept with where it starts: a free that makes a longer run replaces it, and
+    a claim from it leaves it to be found again the next time the statistics are read.
+*/
+
+/* One bit per frame, from the first frame of the page database */
+uint32_t *pgalloc_bitmap = NULL;
+uint32_t pgalloc_bitmap_words = 0;
+
+/* Index of the lowest frame of each zone that may be free */
+static uint32_t pgalloc_bitmap_hint[PGALLOC_ZONE_COUNT];
+
+/* First frame of each zone, and of the zone after it */
+static const uint32_t pgalloc_zone_start[PGALLOC_ZONE_COUNT + 1] = {0, PGALLOC_ZONE_NORMAL_START, PGALLOC_ZONE_HIGH_START, 0xffffffff};
+
+/* Number of runs of free frames */
+static uint32_t pgalloc_bitmap_runs = 0;
+
+/* Bit index and length of the largest run of free frames, if valid. Cleared when frames are claimed from it */
+static uint32_t pgalloc_bitmap_largest_start = 0;
+static uint32_t pgalloc_bitmap_largest = 0;
+static int pgalloc_bitmap_largest_valid = 1;
+
+/* Check if the frame at a bit index is free. Frames outside the bitmap are never free */
+static inline int pgalloc_bitmap_test(uint32_t bit) {
+    if (bit >= pgalloc_frame_count) {
+        return 0;
+    }
+
+    return (pgalloc_bitmap[bit >> 5] >> (bit & 31)) & 1;
+}
+
+/* Mask of the bits from a bit index to the end of its word, limited to count bits */
+static inline uint32_t pgalloc_bitmap_mask(uint32_t bit, uint32_t count) {
+    uint32_t offset = bit & 31;
+    uint32_t n = (32 - offset < count) ? 32 - offset : count;
+
+    return ((n == 32) ? ~0u : ((1u << n) - 1)) << offset;
+}
+
+/* Find the end of the run of free frames starting at a bit index */
+static uint32_t pgalloc_bitmap_run_end(uint32_t bit) {
+    while ((bit >> 5) < pgalloc_bitmap_words) {
+        /* Bits past the last frame are never set, so the run always ends in the bitmap */
+        uint32_t used = ~pgalloc_bitmap[bit >> 5] & (~0u << (bit & 31));
+        if (used != 0) {
+            return (bit & ~31) + __builtin_ctz(used);
+        }
+
+        bit = (bit | 31) + 1;
+    }
+
+    return bit;
+}
+
+/* Find the start of the run of free frames ending at a bit index */
+static uint32_t pgalloc_bitmap_run_start(uint32_t bit) {
+    while (bit > 0) {
+        uint32_t word = (bit - 1) >> 5;
+        uint32_t used = ~pgalloc_bitmap[word] & ((2u << ((bit - 1) & 31)) - 1);
+        if (used != 0) {
+            return (word << 5) + 32 - __builtin_clz(used);
+        }
+
+        bit = word << 5;
+    }
+
+    return 0;
+}
+
+/* Find the first free frame at or after a bit index. Returns pgalloc_frame_count if there is none */
+static uint32_t pgalloc_bitmap_next_free(uint32_t bit) {
+    while ((bit >> 5) < pgalloc_bitmap_words) {
+        uint32_t avail = pgalloc_bitmap[bit >> 5] & (~0u << (bit & 31));
+        if (avail != 0) {
+            return (bit & ~31) + __builtin_ctz(avail);
+        }
+
+        bit = (bit | 31) + 1;
+    }
+
+    return pgalloc_frame_count;
+}
+
+/* Get the bit indexes of the frames of a zone the bitmap covers */
+static void pgalloc_bitmap_zone(pgalloc_zone_t zone, uint32_t *start, uint32_t *end) {
+    uint32_t last = pgalloc_first_frame + pgalloc_frame_count;
+    uint32_t first = pgalloc_zone_start[zone];
+    uint32_t limit = pgalloc_zone_start[zone + 1];
+
+    *start = (first > pgalloc_first_frame) ? ((first < last) ? first : last) - pgalloc_first_frame : 0;
+    *end = (limit > pgalloc_first_frame) ? ((limit < last) ? limit : last) - pgalloc_first_frame : 0;
+}
+
+/* Take a run of free frames from a zone. Returns non-zero if there is no run that long */
+int pgalloc_map_alloc(pgalloc_zone_t zone, uint32_t pages, uint32_t *frame) {
+    uint32_t start, limit;
+    pgalloc_bitmap_zone(zone, &start, &limit);
+
+    /* First run in the zone that is long enough. Runs are cut at the end of the zone */
+    uint32_t bit = pgalloc_bitmap_next_free((pgalloc_bitmap_hint[zone] > start) ? pgalloc_bitmap_hint[zone] : start);
+    pgalloc_bitmap_hint[zone] = bit;
+
+    while (bit < limit) {
+        uint32_t end = pgalloc_bitmap_run_end(bit);
+        if (end > limit) {
+            end = limit;
+        }
+
+        if (end - bit >= pages) {
+            *frame = pgalloc_first_frame + bit;
+            pgalloc_map_claim(*frame, pages);
+            return 0;
+        }
+
+        bit = pgalloc_bitmap_next_free(end);
+    }
+
+    trace(TRACE_PGALLOC_NO_FIT, NULL, pages);
+    return 1;
+}
+
+/* Take a run of free frames from a zone, starting at a frame of the given color. Returns non-zero if there is no such run */
+int pgalloc_map_alloc_color(pgalloc_zone_t zone, uint32_t pages, uint32_t color, uint32_t *frame) {
+    uint32_t start, limit;
+    pgalloc_bitmap_zone(zone, &start, &limit);
+
+    /* First run in the zone with a frame of that color far enough from its end */
+    uint32_t bit = pgalloc_bitmap_next_free((pgalloc_bitmap_hint[zone] > start) ? pgalloc_bitmap_hint[zone] : start);
+
+    while (bit < limit) {
+        uint32_t end = pgalloc_bitmap_run_end(bit);
+        if (end > limit) {
+            end = limit;
+        }
+
+        uint32_t first = bit + ((color - pgalloc_first_frame - bit) & (pgalloc_color_count - 1));
+        if (first < end && end - first >= pages) {
+            *frame = pgalloc_first_frame + first;
+            pgalloc_map_claim(*frame, pages);
+            return 0;
+        }
+
+        bit = pgalloc_bitmap_next_free(end);
+    }
+
+    trace(TRACE_PGALLOC_NO_FIT, NULL, pages);
+    return 1;
+}
+
+/* Take the given run of frames out of the free map. Returns non-zero if any of them is not free, nothing is taken then */
+int pgalloc_map_claim(uint32_t frame, uint32_t count) {
+    if (frame < pgalloc_first_frame || frame - pgalloc_first_frame + count > pgalloc_frame_count) {
+        return 1;
+    }
+
+    uint32_t start = frame - pgalloc_first_frame;
+
+    /* Check the whole run first */
+    for (uint32_t bit = start; bit < start + count; bit = (bit | 31) + 1) {
+        uint32_t mask = pgalloc_bitmap_mask(bit, start + count - bit);
+        if ((pgalloc_bitmap[bit >> 5] & mask) != mask) {
+            return 1;
+        }
+    }
+
+    for (uint32_t bit = start; bit < start + count; bit = (bit | 31) + 1) {
+        pgalloc_bitmap[bit >> 5] &= ~pgalloc_bitmap_mask(bit, start + count - bit);
+    }
+
+    /* The run it was taken from is split, shortened or gone */
+    int before = start > 0 && pgalloc_bitmap_test(start - 1);
+    int after = pgalloc_bitmap_test(start + count);
+    pgalloc_bitmap_runs += before + after - 1;
+
+    if (start < pgalloc_bitmap_largest_start + pgalloc_bitmap_largest && start + count > pgalloc_bitmap_largest_start) {
+        pgalloc_bitmap_largest_valid = 0;
+    }
+
+    pgalloc_zone_t zone = pgalloc_zone_of(frame);
+    if (start == pgalloc_bitmap_hint[zone]) {
+        pgalloc_bitmap_hint[zone] = start + count;
+    }
+
+    return 0;
+}
+
+/* Add a run of frames to the free map */
+void pgalloc_map_free(uint32_t frame, uint32_t count) {
+    uint32_t start = frame - pgalloc_first_frame;
+
+    for (uint32_t bit = start; bit < start + count; bit = (bit | 31) + 1) {
+        pgalloc_bitmap[bit >> 5] |= pgalloc_bitmap_mask(bit, start + count - bit);
+    }
+
+    /* The frames join the runs on either side, if they are free */
+    int before = start > 0 && pgalloc_bitmap_test(start - 1);
+    int after = pgalloc_bitmap_test(start + count);
+    pgalloc_bitmap_runs += 1 - before - after;
+
+    /* The run the frames are now part of, using the largest run's bounds rather than finding them again if it is next to it */
+    if (pgalloc_bitmap_largest_valid) {
+        uint32_t largest_end = pgalloc_bitmap_largest_start + pgalloc_bitmap_largest;
+        uint32_t first = start;
+        uint32_t end = start + count;
+
+        if (before) {
+            first = (pgalloc_bitmap_largest != 0 && start == largest_end) ? pgalloc_bitmap_largest_start : pgalloc_bitmap_run_start(start);
+        }
+        if (after) {
+            end = (pgalloc_bitmap_largest != 0 && end == pgalloc_bitmap_largest_start) ? largest_end : pgalloc_bitmap_run_end(end);
+        }
+
+        if (end - first > pgalloc_bitmap_largest) {
+            pgalloc_bitmap_largest_start = first;
+            pgalloc_bitmap_largest = end - first;
+        }
+    }
+
+    pgalloc_zone_t zone = pgalloc_zone_of(frame);
+    if (start < pgalloc_bitmap_hint[zone]) {
+        pgalloc_bitmap_hint[zone] = start;
+    }
+}
+
+/* Fill in the largest free run and the number of free runs. The bitmap is only scanned if frames were claimed from the largest run since it was last found */
+void pgalloc_map_get_stats(pgalloc_stats_t *stats) {
+    if (!pgalloc_bitmap_largest_valid) {
+        pgalloc_bitmap_largest_start = 0;
+        pgalloc_bitmap_largest = 0;
+
+        uint32_t bit = pgalloc_bitmap_next_free(0);
+        while (bit < pgalloc_frame_count) {
+            uint32_t end = pgalloc_bitmap_run_end(bit);
+
+            if (end - bit > pgalloc_bitmap_largest) {
+                pgalloc_bitmap_largest_start = bit;
+                pgalloc_bitmap_largest = end - bit;
+            }
+
+            bit = pgalloc_bitmap_next_free(end);
+        }
+
+        pgalloc_bitmap_largest_valid = 1;
+    }
+
+    stats->free_blocks = pgalloc_bitmap_runs;
+    stats->largest_free = pgalloc_bitmap_largest;
+}
+
+/* Initialize the free map, with no free frames, in the memory reserved for it */
+void pgalloc_map_init(void *mem) {
+    pgalloc_bitmap = (uint32_t *) mem;
+    pgalloc_bitmap_words = (pgalloc_frame_count + 31) / 32;
+    memset(pgalloc_bitmap, 0, pgalloc_bitmap_words * sizeof(uint32_t));
+
+    for (int i=0; i<PGALLOC_ZONE_COUNT; i++) {
+        pgalloc_bitmap_hint[i] = 0;
+    }
+    pgalloc_bitmap_runs = 0;
+    pgalloc_bitmap_largest_start = 0;
+    pgalloc_bitmap_largest = 0;
+    pgalloc_bitmap_largest_valid = 1;
+}
+
+/* Get the number of pages the free map needs to be reserved for it */
+uint32_t pgalloc_map_pages(uint32_t frames) {
+    return ((((frames + 31) / 32) * sizeof(uint32_t)) + 0xfff) >> 12;
+}
+
+/* Print the number of runs of free frames and the largest one */
+void pgalloc_map_print_diagnostics(void) {
+    pgalloc_stats_t stats;
+    pgalloc_map_get_stats(&stats);
+
+    printf(" free runs: %d, largest %d pages\n", stats.free_blocks, stats.largest_free);
+}
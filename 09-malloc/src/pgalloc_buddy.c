@@ -0,0 +1,311 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pgalloc.h>
+#include <trace.h>
+
+/*
+    Binary buddy free map. Free memory is kept in blocks of 2^n pages, aligned to their size, with a free list for
+    each order. A block's buddy is the other half of the block of the next order, found by flipping one bit of its
+    frame number, so freeing a block merges it with its buddy in a fixed number of steps per order. Each zone has its
+    own lists, and blocks are never merged across a zone boundary. The list links are in the first page of each free
+    block, except in high memory, which isn't in the direct map, where they are in the block's page database entry.
+*/
+
+/* Free blocks of each zone and order, and how many there are */
+pgalloc_free_block_t *pgalloc_free_lists[PGALLOC_ZONE_COUNT][PGALLOC_ORDER_COUNT];
+uint32_t pgalloc_free_counts[PGALLOC_ZONE_COUNT][PGALLOC_ORDER_COUNT];
+static uint32_t pgalloc_free_blocks = 0;
+
+/* Check if a frame is the first frame of a free block of the given order */
+static inline int pgalloc_is_free_block(uint32_t frame, uint32_t order) {
+    pgalloc_page_t *page = pgalloc_frame(frame);
+    return page != NULL && page->flags == PGALLOC_PAGE_FREE && page->order == order;
+}
+
+/* Get the list links of a free block */
+static inline pgalloc_free_block_t *pgalloc_links(uint32_t frame) {
+    if (pgalloc_zone_of(frame) == PGALLOC_ZONE_HIGH) {
+        return &pgalloc_frame(frame)->links;
+    }
+
+    return (pgalloc_free_block_t *)(frame << 12);
+}
+
+/* Get the first frame of a free block from its list links, in the zone of its list */
+static inline uint32_t pgalloc_links_frame(pgalloc_free_block_t *blk, pgalloc_zone_t zone) {
+    if (zone == PGALLOC_ZONE_HIGH) {
+        return pgalloc_first_frame + (uint32_t)((pgalloc_page_t *)((void *) blk - offsetof(pgalloc_page_t, links)) - pgalloc_page_db);
+    }
+
+    return (uint32_t) blk >> 12;
+}
+
+/* Add a free block to the list for its order */
+static void pgalloc_push(uint32_t frame, uint32_t order) {
+    pgalloc_free_block_t *blk = pgalloc_links(frame);
+    pgalloc_zone_t zone = pgalloc_zone_of(frame);
+
+    blk->prev = NULL;
+    blk->next = pgalloc_free_lists[zone][order];
+    if (blk->next != NULL) {
+        blk->next->prev = blk;
+    }
+    pgalloc_free_lists[zone][order] = blk;
+
+    pgalloc_page_t *page = pgalloc_frame(frame);
+    page->flags = PGALLOC_PAGE_FREE;
+    page->order = order;
+    pgalloc_free_counts[zone][order]++;
+    pgalloc_free_blocks++;
+}
+
+/* Remove a free block from the list for its order */
+static void pgalloc_unlink(uint32_t frame, uint32_t order) {
+    pgalloc_free_block_t *blk = pgalloc_links(frame);
+    pgalloc_zone_t zone = pgalloc_zone_of(frame);
+
+    if (blk->prev != NULL) {
+        blk->prev->next = blk->next;
+    } else {
+        pgalloc_free_lists[zone][order] = blk->next;
+    }
+    if (blk->next != NULL) {
+        blk->next->prev = blk->prev;
+    }
+
+    pgalloc_frame(frame)->flags = 0;
+    pgalloc_free_counts[zone][order]--;
+    pgalloc_free_blocks--;
+}
+
+/* Free a block, merging it with its buddy for as long as the buddy is free and in the same zone */
+static void pgalloc_free_order(uint32_t frame, uint32_t order) {
+    while (order < PGALLOC_ORDER_COUNT - 1) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (!pgalloc_is_free_block(buddy, order) || pgalloc_zone_of(buddy) != pgalloc_zone_of(frame)) {
+            break;
+        }
+
+        pgalloc_unlink(buddy, order);
+        frame &= buddy;
+        order++;
+        trace(TRACE_PGFREE_MERGE, (void *)(frame << 12), order);
+    }
+
+    pgalloc_push(frame, order);
+}
+
+/* Find the free block a frame is in. Returns non-zero if the frame is not free */
+static int pgalloc_find_free(uint32_t frame, uint32_t *head, uint32_t *order) {
+    for (uint32_t i=0; i<PGALLOC_ORDER_COUNT; i++) {
+        uint32_t first = frame & ~((1u << i) - 1);
+
+        if (pgalloc_is_free_block(first, i)) {
+            *head = first;
+            *order = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Take a run of frames out of a free block. The block is split in halves for as long as the run fits in one of them, freeing the other halves, then the pages of the block that weren't requested are freed */
+static void pgalloc_take(uint32_t head, uint32_t order, uint32_t frame, uint32_t pages) {
+    pgalloc_unlink(head, order);
+
+    while (order > 0) {
+        uint32_t half = 1u << (order - 1);
+
+        if (frame + pages <= head + half) {
+            pgalloc_push(head + half, order - 1);
+        } else if (frame >= head + half) {
+            pgalloc_push(head, order - 1);
+            head += half;
+        } else {
+            break;
+        }
+
+        order--;
+        trace(TRACE_PGALLOC_SPLIT, (void *)(head << 12), order);
+    }
+
+    if (head < frame) {
+        pgalloc_map_free(head, frame - head);
+    }
+    if (frame + pages < head + (1u << order)) {
+        pgalloc_map_free(frame + pages, head + (1u << order) - frame - pages);
+    }
+}
+
+/* Get the smallest order that holds a number of pages. Returns PGALLOC_ORDER_COUNT if no block is that large */
+static uint32_t pgalloc_order_of(uint32_t pages) {
+    uint32_t order = 0;
+    while (order < PGALLOC_ORDER_COUNT && (1u << order) < pages) {
+        order++;
+    }
+
+    return order;
+}
+
+/* Take a run of free frames from a zone. Returns non-zero if there is no run that long */
+int pgalloc_map_alloc(pgalloc_zone_t zone, uint32_t pages, uint32_t *frame) {
+    uint32_t order = pgalloc_order_of(pages);
+    if (order == PGALLOC_ORDER_COUNT) {
+        trace(TRACE_PGALLOC_TOO_LARGE, NULL, pages);
+        return 1;
+    }
+
+    /* Smallest free block of at least that order */
+    uint32_t found = order;
+    while (found < PGALLOC_ORDER_COUNT && pgalloc_free_lists[zone][found] == NULL) {
+        found++;
+    }
+
+    if (found == PGALLOC_ORDER_COUNT) {
+        trace(TRACE_PGALLOC_NO_FIT, NULL, pages);
+        return 1;
+    }
+
+    *frame = pgalloc_links_frame(pgalloc_free_lists[zone][found], zone);
+    pgalloc_take(*frame, found, *frame, pages);
+    return 0;
+}
+
+/* Take a run of free frames from a zone, starting at a frame of the given color. Returns non-zero if there is no such run */
+int pgalloc_map_alloc_color(pgalloc_zone_t zone, uint32_t pages, uint32_t color, uint32_t *frame) {
+    uint32_t order = pgalloc_order_of(pages);
+    if (order == PGALLOC_ORDER_COUNT) {
+        trace(TRACE_PGALLOC_TOO_LARGE, NULL, pages);
+        return 1;
+    }
+
+    /* Smallest free block with a frame of that color far enough from its end */
+    for (uint32_t found = order; found < PGALLOC_ORDER_COUNT; found++) {
+        for (pgalloc_free_block_t *blk = pgalloc_free_lists[zone][found]; blk != NULL; blk = blk->next) {
+            uint32_t head = pgalloc_links_frame(blk, zone);
+            uint32_t skip = (color - head) & (pgalloc_color_count - 1);
+
+            if (skip + pages <= (1u << found)) {
+                *frame = head + skip;
+                pgalloc_take(head, found, *frame, pages);
+                return 0;
+            }
+
+            /* Blocks at least as large as the number of colors all start at color 0, so if the first doesn't fit none do */
+            if ((1u << found) >= pgalloc_color_count) {
+                break;
+            }
+        }
+    }
+
+    trace(TRACE_PGALLOC_NO_FIT, NULL, pages);
+    return 1;
+}
+
+/* Take the given run of frames out of the free map. The rest of the blocks they are in is freed again. Returns non-zero if any of them is not free, nothing is taken then */
+int pgalloc_map_claim(uint32_t frame, uint32_t count) {
+    uint32_t head, order;
+
+    /* Check the whole run first */
+    for (uint32_t f = frame; f < frame + count; f = head + (1u << order)) {
+        if (pgalloc_find_free(f, &head, &order)) {
+            return 1;
+        }
+    }
+
+    for (uint32_t f = frame; f < frame + count; ) {
+        pgalloc_find_free(f, &head, &order);
+        pgalloc_unlink(head, order);
+
+        uint32_t end = head + (1u << order);
+        uint32_t claim_end = (end < frame + count) ? end : frame + count;
+
+        /* Give back the parts of the block before and after the run */
+        if (head < f) {
+            pgalloc_map_free(head, f - head);
+        }
+        if (claim_end < end) {
+            pgalloc_map_free(claim_end, end - claim_end);
+        }
+
+        f = claim_end;
+    }
+
+    return 0;
+}
+
+/* Add a run of frames to the free map, as the largest aligned blocks that fit in it */
+void pgalloc_map_free(uint32_t frame, uint32_t count) {
+    while (count > 0) {
+        uint32_t order = 0;
+        while (order < PGALLOC_ORDER_COUNT - 1 && (frame & ((2u << order) - 1)) == 0 && (2u << order) <= count) {
+            order++;
+        }
+
+        pgalloc_free_order(frame, order);
+        frame += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+/* Fill in the largest free block and the number of free blocks */
+void pgalloc_map_get_stats(pgalloc_stats_t *stats) {
+    stats->free_blocks = pgalloc_free_blocks;
+
+    /* The largest free block is in the highest non-empty order of any zone */
+    stats->largest_free = 0;
+    for (int zone=0; zone<PGALLOC_ZONE_COUNT; zone++) {
+        for (int i=PGALLOC_ORDER_COUNT - 1; i>=0; i--) {
+            if (pgalloc_free_lists[zone][i] != NULL) {
+                if ((1u << i) > stats->largest_free) {
+                    stats->largest_free = 1u << i;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/* Initialize the free map. The lists are stored in the free blocks and the page database, so no memory is reserved for them */
+void pgalloc_map_init(void *mem) {
+    (void) mem;
+
+    for (int zone=0; zone<PGALLOC_ZONE_COUNT; zone++) {
+        for (int i=0; i<PGALLOC_ORDER_COUNT; i++) {
+            pgalloc_free_lists[zone][i] = NULL;
+            pgalloc_free_counts[zone][i] = 0;
+        }
+    }
+    pgalloc_free_blocks = 0;
+}
+
+/* Get the number of pages the free map needs to be reserved for it */
+uint32_t pgalloc_map_pages(uint32_t frames) {
+    (void) frames;
+    return 0;
+}
+
+/* Print the number of free blocks of each size that has any in each zone, in pages */
+void pgalloc_map_print_diagnostics(void) {
+    for (int zone=0; zone<PGALLOC_ZONE_COUNT; zone++) {
+        printf(" %s free blocks: <", pgalloc_zone_names[zone]);
+
+        int first = 1;
+        for (int i=0; i<PGALLOC_ORDER_COUNT; i++) {
+            if (pgalloc_free_counts[zone][i] == 0) {
+                continue;
+            }
+
+            if (!first) {
+                printf(",");
+            }
+            printf("%d:%d",1 << i,pgalloc_free_counts[zone][i]);
+            first = 0;
+        }
+
+        printf(">\n");
+    }
+}
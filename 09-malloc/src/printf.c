@@ -5,210 +5,831 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+
+#include <dtoa.h>
 #include <terminal.h>
 
+/*
+    Formatted output. printf, vprintf, snprintf and vsnprintf all go through print_format, which writes to a
+    printf_out_t: either a buffer on the stack that is written to the terminal whenever it fills up, or the caller's
+    buffer, which keeps as much as fits. Nothing is allocated. Supports the flags - + space # 0, width and precision
+    (including *), the length modifiers hh h l ll j z t L, and the conversions d i u o x X p c s n % e E f F g G a A.
+    The extra flag ! makes e, f and g without a precision print the shortest digits that read back as the same
+    double, instead of 6.
+*/
+
 const char *HEX_LOWERCASE = "0123456789abcdef";
 const char *HEX_UPPERCASE = "0123456789ABCDEF";
 
+/* Size of the buffer printf formats into before writing to the terminal */
+#define PRINTF_BUFFER_SIZE 128
+
+/* Flags of a conversion */
+#define PRINTF_LEFT 0x01        /* -: pad on the right */
+#define PRINTF_PLUS 0x02        /* +: sign even if positive */
+#define PRINTF_SPACE 0x04       /* space: space if positive */
+#define PRINTF_ALT 0x08         /* #: 0 before octal, 0x before hex */
+#define PRINTF_ZERO 0x10        /* 0: pad with zeros */
+#define PRINTF_SHORTEST 0x20    /* !: shortest digits of a double that read back the same, if there is no precision */
+
+/* Length modifiers of a conversion */
+enum e_printf_length {
+    PRINTF_LENGTH_NONE,
+    PRINTF_LENGTH_HH,
+    PRINTF_LENGTH_H,
+    PRINTF_LENGTH_L,
+    PRINTF_LENGTH_LL,
+    PRINTF_LENGTH_J,
+    PRINTF_LENGTH_Z,
+    PRINTF_LENGTH_T,
+    PRINTF_LENGTH_LONG_DOUBLE,
+};
+typedef enum e_printf_length printf_length_t;
+
+/* Where formatted output goes */
+struct s_printf_out {
+    char *buf;          /* characters not written yet */
+    size_t size;        /* room in buf */
+    size_t length;      /* characters in buf */
+    size_t written;     /* characters formatted, including any that didn't fit */
+    bool terminal;      /* write buf to the terminal when it fills up, instead of dropping the rest */
+};
+typedef struct s_printf_out printf_out_t;
+
 /* Print a single character */
 int putchar(int ic) {
-	char c = (char) ic;
-	terminal_write(&c, sizeof(c));
-	return ic;
+    char c = (char) ic;
+    terminal_write(&c, sizeof(c));
+    return ic;
+}
+
+/* Write the buffered output to the terminal */
+static void flush(printf_out_t *out) {
+    if (out->terminal && out->length != 0) {
+        terminal_write(out->buf, out->length);
+        out->length = 0;
+    }
 }
 
 /* Print a string of a given length */
-static int print(const char* data, size_t length) {
-	const unsigned char* bytes = (const unsigned char*) data;
-	for (size_t i = 0; i < length; i++)
-		if (putchar(bytes[i]) == EOF)
-			return 0;
-	return 1;
-}
-
-/* Print a decimal number*/
-static int print_number(unsigned int v) {
-    /* print the digits into the buffer in reverse order */
-    char buf[16];
-    for (int i=0;i<16;i++) {
-        if (v > 0) {
-            buf[i] = '0' + (v % 10);
+static void print(printf_out_t *out, const char *data, size_t length) {
+    out->written += length;
+
+    while (length != 0) {
+        if (out->length == out->size) {
+            if (!out->terminal) {
+                return;
+            }
+            flush(out);
+        }
+
+        size_t amount = out->size - out->length;
+        if (amount > length) {
+            amount = length;
+        }
+        memmove(out->buf + out->length, data, amount);
+        out->length += amount;
+        data += amount;
+        length -= amount;
+    }
+}
+
+/* Print a character a number of times */
+static void print_repeat(printf_out_t *out, char c, int count) {
+    for (int i=0; i<count; i++) {
+        out->written++;
+
+        if (out->length == out->size) {
+            if (!out->terminal) {
+                continue;
+            }
+            flush(out);
+        }
+        out->buf[out->length++] = c;
+    }
+}
+
+/* Print a string padded to a width */
+static void print_padded(printf_out_t *out, const char *data, size_t length, int flags, int width) {
+    int pad = (width > (int) length) ? width - (int) length : 0;
+
+    if (!(flags & PRINTF_LEFT)) {
+        print_repeat(out, ' ', pad);
+    }
+    print(out, data, length);
+    if (flags & PRINTF_LEFT) {
+        print_repeat(out, ' ', pad);
+    }
+}
+
+/* Pairs of decimal digits, 00 to 99 */
+static const char DECIMAL_PAIRS[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+/* Powers of ten, to count the decimal digits of a number */
+static const uint64_t POWERS_OF_10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL,
+    100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+    10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/* Count the digits of a number in a base of 8, 10 or 16. Zero has none */
+static int count_digits(uint64_t v, unsigned int base) {
+    if (v == 0) {
+        return 0;
+    }
+
+    if (base == 10) {
+        int n = 1;
+        while (n < 20 && v >= POWERS_OF_10[n]) {
+            n++;
+        }
+        return n;
+    }
+
+    int bits = 64 - __builtin_clzll(v);
+    int shift = (base == 16) ? 4 : 3;
+    return (bits + shift - 1) / shift;
+}
+
+/* Write the decimal digits of a 32 bit number, two at a time, ending before end. Returns the first digit */
+static char *format_decimal32(char *end, uint32_t v) {
+    char *p = end;
+
+    while (v >= 100) {
+        const char *pair = DECIMAL_PAIRS + (v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        p[0] = pair[0];
+        p[1] = pair[1];
+    }
+
+    if (v >= 10) {
+        p -= 2;
+        p[0] = DECIMAL_PAIRS[v * 2];
+        p[1] = DECIMAL_PAIRS[v * 2 + 1];
+    } else if (v != 0) {
+        *--p = '0' + v;
+    }
+
+    return p;
+}
+
+/* Write the digits of a number in a base of 8, 10 or 16 into a buffer, in order. Returns the number of digits */
+static int format_unsigned(char *buf, uint64_t v, unsigned int base, const char *digits) {
+    int n = count_digits(v, base);
+    char *p = buf + n;
+
+    if (base == 10) {
+        /* 64 bit division is a call into libgcc, so it only splits off 9 digits at a time until the rest fits in 32 bits */
+        while (v > UINT32_MAX) {
+            char *chunk = p - 9;
+            p = format_decimal32(p, v % 1000000000);
+            while (p > chunk) {
+                *--p = '0';
+            }
+            v /= 1000000000;
+        }
+        format_decimal32(p, (uint32_t) v);
+    } else if (base == 16) {
+        /* A byte at a time */
+        while (p - buf >= 2) {
+            p -= 2;
+            p[0] = digits[(v >> 4) & 0xf];
+            p[1] = digits[v & 0xf];
+            v >>= 8;
+        }
+        if (p != buf) {
+            *--p = digits[v & 0xf];
+        }
+    } else {
+        while (p != buf) {
+            *--p = '0' + (v & 0x7);
+            v >>= 3;
+        }
+    }
+
+    return n;
+}
+
+/* Print an integer conversion */
+static void print_integer(printf_out_t *out, uint64_t v, bool negative, unsigned int base, const char *digits, int flags, int width, int precision) {
+    /* 22 octal digits are enough for 64 bits */
+    char start[24];
+    int ndigits = format_unsigned(start, v, base, digits);
+
+    /* Sign, or 0x before hex */
+    char prefix[2];
+    int nprefix = 0;
+    if (negative) {
+        prefix[nprefix++] = '-';
+    } else if (flags & PRINTF_PLUS) {
+        prefix[nprefix++] = '+';
+    } else if (flags & PRINTF_SPACE) {
+        prefix[nprefix++] = ' ';
+    }
+    if ((flags & PRINTF_ALT) && base == 16 && v != 0) {
+        prefix[nprefix++] = '0';
+        prefix[nprefix++] = (digits == HEX_UPPERCASE) ? 'X' : 'x';
+    }
+
+    /* Zeros to make up the precision. Zero with no precision prints nothing, and # makes octal start with 0 */
+    int zeros = 0;
+    if (precision < 0) {
+        precision = 1;
+    }
+    if (precision > ndigits) {
+        zeros = precision - ndigits;
+    }
+    if ((flags & PRINTF_ALT) && base == 8 && zeros == 0 && (ndigits == 0 || start[0] != '0')) {
+        zeros = 1;
+    }
+
+    int length = nprefix + zeros + ndigits;
+    int pad = (width > length) ? width - length : 0;
+
+    /* The 0 flag pads with zeros after the sign, unless a precision was given */
+    if ((flags & PRINTF_ZERO) && !(flags & PRINTF_LEFT)) {
+        zeros += pad;
+        pad = 0;
+    }
+
+    if (!(flags & PRINTF_LEFT)) {
+        print_repeat(out, ' ', pad);
+    }
+    print(out, prefix, nprefix);
+    print_repeat(out, '0', zeros);
+    print(out, start, ndigits);
+    if (flags & PRINTF_LEFT) {
+        print_repeat(out, ' ', pad);
+    }
+}
+
+/* Print the sign or prefix of a number of a given length, padded to a width with spaces before it or with the 0 flag zeros after it. Returns the spaces to print after the number for the - flag */
+static int print_number_start(printf_out_t *out, const char *prefix, int nprefix, int length, int flags, int width) {
+    int pad = (width > length) ? width - length : 0;
+
+    if (!(flags & (PRINTF_LEFT | PRINTF_ZERO))) {
+        print_repeat(out, ' ', pad);
+        pad = 0;
+    }
+    print(out, prefix, nprefix);
+    if ((flags & PRINTF_ZERO) && !(flags & PRINTF_LEFT)) {
+        print_repeat(out, '0', pad);
+        pad = 0;
+    }
+
+    return pad;
+}
+
+/* Length of digits printed as a fixed point number with a number of digits after the point, the first digit at 10 to the exponent */
+static int fixed_length(int exponent, int fraction, int flags) {
+    int whole = (exponent >= 0) ? exponent + 1 : 1;
+    return whole + ((fraction > 0 || (flags & PRINTF_ALT)) ? 1 + fraction : 0);
+}
+
+/* Print digits as a fixed point number. Digits past the ones given are 0 */
+static void print_fixed(printf_out_t *out, const char *digits, int n, int exponent, int fraction, int flags) {
+    /* Whole part */
+    if (exponent >= 0) {
+        int whole = (n < exponent + 1) ? n : exponent + 1;
+        print(out, digits, whole);
+        print_repeat(out, '0', exponent + 1 - whole);
+    } else {
+        print(out, "0", 1);
+    }
+
+    if (fraction > 0 || (flags & PRINTF_ALT)) {
+        print(out, ".", 1);
+    }
+
+    /* Fraction: zeros before the first digit, the digits, then zeros */
+    int zeros = (exponent < -1) ? -exponent - 1 : 0;
+    if (zeros > fraction) {
+        zeros = fraction;
+    }
+    int start = (exponent >= 0) ? exponent + 1 : 0;
+    int count = n - start;
+    if (count > fraction - zeros) {
+        count = fraction - zeros;
+    }
+    if (count < 0) {
+        count = 0;
+    }
+
+    print_repeat(out, '0', zeros);
+    print(out, digits + start, count);
+    print_repeat(out, '0', fraction - zeros - count);
+}
+
+/* Length of digits printed in scientific notation */
+static int exp_length(int exponent, int fraction, int flags) {
+    int digits = (exponent >= 100 || exponent <= -100) ? 3 : 2;
+    return 1 + ((fraction > 0 || (flags & PRINTF_ALT)) ? 1 + fraction : 0) + 2 + digits;
+}
+
+/* Print digits in scientific notation, with at least two digits of exponent. Digits past the ones given are 0 */
+static void print_exp(printf_out_t *out, const char *digits, int n, int exponent, int fraction, int flags, bool upper) {
+    print(out, (n > 0) ? digits : "0", 1);
+
+    if (fraction > 0 || (flags & PRINTF_ALT)) {
+        print(out, ".", 1);
+    }
+
+    int count = (n - 1 < fraction) ? n - 1 : fraction;
+    if (count < 0) {
+        count = 0;
+    }
+    print(out, digits + 1, count);
+    print_repeat(out, '0', fraction - count);
+
+    char buf[5];
+    int length = 0;
+    uint32_t e = (exponent < 0) ? -exponent : exponent;
+    buf[length++] = upper ? 'E' : 'e';
+    buf[length++] = (exponent < 0) ? '-' : '+';
+    if (e >= 100) {
+        buf[length++] = '0' + e / 100;
+    }
+    buf[length++] = '0' + (e / 10) % 10;
+    buf[length++] = '0' + e % 10;
+    print(out, buf, length);
+}
+
+/* Print a double in hex, 1.mantissa or 0.mantissa below the normal range. Without a precision all the digits that aren't 0 */
+static void print_hex_float(printf_out_t *out, char *prefix, int nprefix, uint64_t bits, bool upper, int flags, int width, int precision) {
+    const char *digits = upper ? HEX_UPPERCASE : HEX_LOWERCASE;
+    uint64_t value = bits & ((1ULL << DTOA_MANTISSA_BITS) - 1);
+    uint32_t biased = (uint32_t)(bits >> DTOA_MANTISSA_BITS);
+    int exponent = 0;
+    if (biased != 0) {
+        value |= 1ULL << DTOA_MANTISSA_BITS;
+        exponent = (int) biased - DTOA_EXPONENT_BIAS;
+    } else if (value != 0) {
+        exponent = 1 - DTOA_EXPONENT_BIAS;
+    }
+
+    /* 13 hex digits after the point. Fewer are rounded to nearest, ties to even, which can carry into the first digit */
+    int ndigits = DTOA_MANTISSA_BITS / 4;
+    if (precision < 0) {
+        while (ndigits > 0 && (value & 0xf) == 0) {
+            value >>= 4;
+            ndigits--;
+        }
+        precision = ndigits;
+    } else if (precision < ndigits) {
+        int shift = 4 * (ndigits - precision);
+        uint64_t rest = value & ((1ULL << shift) - 1);
+        uint64_t half = 1ULL << (shift - 1);
+        value >>= shift;
+        if (rest > half || (rest == half && (value & 1))) {
+            value++;
+        }
+        ndigits = precision;
+    }
+
+    char fraction[DTOA_MANTISSA_BITS / 4];
+    for (int i=0; i<ndigits; i++) {
+        fraction[i] = digits[(value >> (4 * (ndigits - 1 - i))) & 0xf];
+    }
+    char lead = digits[value >> (4 * ndigits)];
+
+    /* The exponent is in decimal */
+    char buf[8];
+    uint32_t e = (exponent < 0) ? -exponent : exponent;
+    buf[0] = upper ? 'P' : 'p';
+    buf[1] = (exponent < 0) ? '-' : '+';
+    int nexp = 2 + ((e != 0) ? format_unsigned(buf + 2, e, 10, HEX_LOWERCASE) : 0);
+    if (e == 0) {
+        buf[nexp++] = '0';
+    }
+
+    prefix[nprefix++] = '0';
+    prefix[nprefix++] = upper ? 'X' : 'x';
+    bool point = precision > 0 || (flags & PRINTF_ALT);
+    int length = nprefix + 1 + (point ? 1 + precision : 0) + nexp;
+
+    int right = print_number_start(out, prefix, nprefix, length, flags, width);
+    print(out, &lead, 1);
+    if (point) {
+        print(out, ".", 1);
+    }
+    print(out, fraction, ndigits);
+    print_repeat(out, '0', precision - ndigits);
+    print(out, buf, nexp);
+    print_repeat(out, ' ', right);
+}
+
+/* Print a floating point conversion */
+static void print_float(printf_out_t *out, double v, char conversion, int flags, int width, int precision) {
+    bool upper = conversion >= 'A' && conversion <= 'Z';
+    char c = upper ? conversion + ('a' - 'A') : conversion;
+
+    union { double d; uint64_t u; } bits = { .d = v };
+    uint64_t mantissa = bits.u & ((1ULL << DTOA_MANTISSA_BITS) - 1);
+    uint32_t biased = (uint32_t)(bits.u >> DTOA_MANTISSA_BITS) & 0x7ff;
+
+    /* Sign, and room for 0x after it */
+    char prefix[3];
+    int nprefix = 0;
+    if (bits.u >> 63) {
+        prefix[nprefix++] = '-';
+    } else if (flags & PRINTF_PLUS) {
+        prefix[nprefix++] = '+';
+    } else if (flags & PRINTF_SPACE) {
+        prefix[nprefix++] = ' ';
+    }
+
+    /* Infinity and NaN are never padded with zeros */
+    if (biased == 0x7ff) {
+        const char *text = (mantissa != 0) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+        int right = print_number_start(out, prefix, nprefix, nprefix + 3, flags & ~PRINTF_ZERO, width);
+        print(out, text, 3);
+        print_repeat(out, ' ', right);
+        return;
+    }
+
+    /* The rest works on the magnitude */
+    bits.u &= ~(1ULL << 63);
+    bool zero = bits.u == 0;
+
+    if (c == 'a') {
+        print_hex_float(out, prefix, nprefix, bits.u, upper, flags, width, precision);
+        return;
+    }
+
+    /* n digits, the first at 10 to the exponent, printed with a number of digits after the point */
+    char digits[DTOA_DIGITS_MAX];
+    int n = 0;
+    int exponent = 0;
+    int fraction;
+    bool exp_style = c == 'e';
+
+    /* Without a precision, 6 like C, unless the shortest digits were asked for */
+    bool shortest = precision < 0 && (flags & PRINTF_SHORTEST);
+    if (precision < 0) {
+        precision = 6;
+    }
+
+    if (shortest) {
+        /* The shortest digits that read back as the same double */
+        if (zero) {
+            digits[0] = '0';
+            n = 1;
         } else {
-            if (i != 0) {
-				buf[i] = 0;
-			} else {
-				// v was zero, special case
-				buf[i] = '0';
-			}
+            int e10;
+            uint64_t shortest = dtoa_shortest(bits.d, &e10);
+            n = format_unsigned(digits, shortest, 10, HEX_LOWERCASE);
+            while (n > 1 && digits[n - 1] == '0') {
+                n--;
+                e10++;
+            }
+            exponent = e10 + n - 1;
+        }
+
+        /* g picks e for exponents below -4, or from 6 up unless all the digits are before the point */
+        if (c == 'g') {
+            exp_style = exponent < -4 || exponent >= ((n > 6) ? n : 6);
+        }
+        fraction = exp_style ? n - 1 : ((n - 1 - exponent > 0) ? n - 1 - exponent : 0);
+    } else if (c == 'f') {
+        if (!zero) {
+            n = dtoa_round(bits.d, precision, true, digits, &exponent);
+        }
+        fraction = precision;
+    } else {
+        int significant = (c == 'e') ? precision + 1 : ((precision == 0) ? 1 : precision);
+        if (!zero) {
+            n = dtoa_round(bits.d, significant, false, digits, &exponent);
+        }
+        fraction = significant - 1;
+
+        /* g picks e for exponents below -4 or from the precision up, and drops trailing zeros without # */
+        if (c == 'g') {
+            exp_style = exponent < -4 || exponent >= significant;
+            if (!exp_style) {
+                fraction = significant - 1 - exponent;
+            }
+
+            if (!(flags & PRINTF_ALT)) {
+                while (n > 0 && digits[n - 1] == '0') {
+                    n--;
+                }
+                int kept = exp_style ? n - 1 : n - 1 - exponent;
+                if (kept < 0) {
+                    kept = 0;
+                }
+                if (fraction > kept) {
+                    fraction = kept;
+                }
+            }
         }
-        v /= 10;
     }
 
-    /* reverse the digits */
-    int l = strlen(buf);
-    int h = l / 2;
-    for (int i=0;i<h;i++) {
-        char tmp = buf[i];
-        buf[i] = buf[l-1-i];
-        buf[l-1-i] = tmp;
+    int length = nprefix + (exp_style ? exp_length(exponent, fraction, flags) : fixed_length(exponent, fraction, flags));
+    int right = print_number_start(out, prefix, nprefix, length, flags, width);
+    if (exp_style) {
+        print_exp(out, digits, n, exponent, fraction, flags, upper);
+    } else {
+        print_fixed(out, digits, n, exponent, fraction, flags);
     }
+    print_repeat(out, ' ', right);
+}
 
-    print(buf,l);
-    return l;
+/* Get a signed integer argument of a length */
+static int64_t arg_signed(va_list *ap, printf_length_t length) {
+    switch (length) {
+        case PRINTF_LENGTH_HH:
+            return (signed char) va_arg(*ap, int);
+        case PRINTF_LENGTH_H:
+            return (short) va_arg(*ap, int);
+        case PRINTF_LENGTH_L:
+            return va_arg(*ap, long);
+        case PRINTF_LENGTH_LL:
+            return va_arg(*ap, long long);
+        case PRINTF_LENGTH_J:
+            return va_arg(*ap, intmax_t);
+        case PRINTF_LENGTH_Z:
+        case PRINTF_LENGTH_T:
+            return va_arg(*ap, ptrdiff_t);
+        default:
+            return va_arg(*ap, int);
+    }
 }
 
-/* Print a formatted string */
-int printf(const char* restrict format, ...) {
-	va_list parameters;
-	va_start(parameters, format);
-
-    char c;
-    const char *hex_chars = 0;
-	int written = 0;
- 
-	while (*format != '\0') {
-		size_t maxrem = INT_MAX - written;
- 
-		if (format[0] != '%' || format[1] == '%') {
-			if (format[0] == '%')
-				format++;
-			size_t amount = 1;
-			while (format[amount] && format[amount] != '%')
-				amount++;
-			if (maxrem < amount) {
-				// TODO: Set errno to EOVERFLOW.
-				return -1;
-			}
-			if (!print(format, amount))
-				return -1;
-			format += amount;
-			written += amount;
-			continue;
-		}
- 
-		format++;
-
-		// print based on specifier:
-		switch (*format) {
-			case 'd':
-			case 'i': // signed decimal integer
-                int d = va_arg(parameters, int);
-                
-                /* if negative, put the minus out front */
-                if (d < 0) {
-                    d = -d;
-                    putchar('-');
-                    written++;
+/* Get an unsigned integer argument of a length */
+static uint64_t arg_unsigned(va_list *ap, printf_length_t length) {
+    switch (length) {
+        case PRINTF_LENGTH_HH:
+            return (unsigned char) va_arg(*ap, unsigned int);
+        case PRINTF_LENGTH_H:
+            return (unsigned short) va_arg(*ap, unsigned int);
+        case PRINTF_LENGTH_L:
+            return va_arg(*ap, unsigned long);
+        case PRINTF_LENGTH_LL:
+            return va_arg(*ap, unsigned long long);
+        case PRINTF_LENGTH_J:
+            return va_arg(*ap, uintmax_t);
+        case PRINTF_LENGTH_Z:
+        case PRINTF_LENGTH_T:
+            return va_arg(*ap, size_t);
+        default:
+            return va_arg(*ap, unsigned int);
+    }
+}
+
+/* Store the number of characters printed so far for %n */
+static void store_count(va_list *ap, printf_length_t length, size_t count) {
+    switch (length) {
+        case PRINTF_LENGTH_HH:
+            *va_arg(*ap, signed char *) = count;
+            break;
+        case PRINTF_LENGTH_H:
+            *va_arg(*ap, short *) = count;
+            break;
+        case PRINTF_LENGTH_L:
+            *va_arg(*ap, long *) = count;
+            break;
+        case PRINTF_LENGTH_LL:
+            *va_arg(*ap, long long *) = count;
+            break;
+        case PRINTF_LENGTH_J:
+            *va_arg(*ap, intmax_t *) = count;
+            break;
+        case PRINTF_LENGTH_Z:
+        case PRINTF_LENGTH_T:
+            *va_arg(*ap, size_t *) = count;
+            break;
+        default:
+            *va_arg(*ap, int *) = count;
+            break;
+    }
+}
+
+/* Format a string with its arguments. Returns the number of characters formatted, or -1 if it is more than INT_MAX */
+static int print_format(printf_out_t *out, const char *format, va_list *ap) {
+    while (*format != '\0') {
+        /* Print up to the next conversion in one go */
+        if (format[0] != '%') {
+            size_t amount = 1;
+            while (format[amount] && format[amount] != '%') {
+                amount++;
+            }
+            print(out, format, amount);
+            format += amount;
+            continue;
+        }
+
+        const char *conversion = format++;
+
+        /* Flags */
+        int flags = 0;
+        for (;; format++) {
+            if (*format == '-') {
+                flags |= PRINTF_LEFT;
+            } else if (*format == '+') {
+                flags |= PRINTF_PLUS;
+            } else if (*format == ' ') {
+                flags |= PRINTF_SPACE;
+            } else if (*format == '#') {
+                flags |= PRINTF_ALT;
+            } else if (*format == '0') {
+                flags |= PRINTF_ZERO;
+            } else if (*format == '!') {
+                flags |= PRINTF_SHORTEST;
+            } else {
+                break;
+            }
+        }
+
+        /* Width. A negative * width means - */
+        int width = 0;
+        if (*format == '*') {
+            width = va_arg(*ap, int);
+            if (width < 0) {
+                flags |= PRINTF_LEFT;
+                width = -width;
+            }
+            format++;
+        } else {
+            while (*format >= '0' && *format <= '9') {
+                width = width * 10 + (*format++ - '0');
+            }
+        }
+
+        /* Precision. A negative * precision is the same as none */
+        int precision = -1;
+        if (*format == '.') {
+            format++;
+            precision = 0;
+            if (*format == '*') {
+                precision = va_arg(*ap, int);
+                format++;
+            } else {
+                while (*format >= '0' && *format <= '9') {
+                    precision = precision * 10 + (*format++ - '0');
                 }
+            }
+        }
 
-                written += print_number(d);
+        /* Length */
+        printf_length_t length = PRINTF_LENGTH_NONE;
+        switch (*format) {
+            case 'h':
+                length = (format[1] == 'h') ? PRINTF_LENGTH_HH : PRINTF_LENGTH_H;
+                format += (length == PRINTF_LENGTH_HH) ? 2 : 1;
+                break;
+            case 'l':
+                length = (format[1] == 'l') ? PRINTF_LENGTH_LL : PRINTF_LENGTH_L;
+                format += (length == PRINTF_LENGTH_LL) ? 2 : 1;
+                break;
+            case 'j':
+                length = PRINTF_LENGTH_J;
+                format++;
+                break;
+            case 'z':
+                length = PRINTF_LENGTH_Z;
+                format++;
+                break;
+            case 't':
+                length = PRINTF_LENGTH_T;
+                format++;
+                break;
+            case 'L':
+                length = PRINTF_LENGTH_LONG_DOUBLE;
+                format++;
                 break;
-			case 'u': // unsigned decimal integer
-                unsigned int u = va_arg(parameters, unsigned int);
+        }
+
+        /* A precision turns off the 0 flag of integers */
+        int int_flags = (precision >= 0) ? (flags & ~PRINTF_ZERO) : flags;
 
-                written += print_number(u);
-				break;
-			case 'o':  // unsigned octal
+        switch (*format) {
+            case 'd':
+            case 'i': // signed decimal integer
                 {
-                    uint32_t v = va_arg(parameters, uint32_t);
-                    int s = 33; // must be a multiple of 3. It is ok for this to be >32 since the >> operator doesn't care
-                    uint32_t v2 = 0;
-
-                    do {
-                        s-=3;
-                        v2 = v >> s;
-                        v2 &= 0x7;
-                    } while (v2 == 0 && s>=0); // skip leading zeros
-                    if (s < 0) {
-                        print(hex_chars,1); // 0
-                        written++;
-                    }
-                    while (s >= 0) {
-                        uint32_t v2 = v >> s;
-                        v2 &= 0x7;
-                        putchar('0' + v2);
-                        written++;
-                        s-=3;
-                    }
+                    int64_t d = arg_signed(ap, length);
+                    uint64_t v = (d < 0) ? -(uint64_t) d : (uint64_t) d;
+                    print_integer(out, v, d < 0, 10, HEX_LOWERCASE, int_flags, width, precision);
                 }
-				break;
-			case 'p': // pointer
-			case 'x': // unsigned hex
-				hex_chars = HEX_LOWERCASE;
-				__attribute__((fallthrough));
-			case 'X': // unsigned hex uppercase
+                break;
+            case 'u': // unsigned decimal integer
+                print_integer(out, arg_unsigned(ap, length), false, 10, HEX_LOWERCASE, int_flags & ~(PRINTF_PLUS | PRINTF_SPACE), width, precision);
+                break;
+            case 'o': // unsigned octal
+                print_integer(out, arg_unsigned(ap, length), false, 8, HEX_LOWERCASE, int_flags & ~(PRINTF_PLUS | PRINTF_SPACE), width, precision);
+                break;
+            case 'x': // unsigned hex
+                print_integer(out, arg_unsigned(ap, length), false, 16, HEX_LOWERCASE, int_flags & ~(PRINTF_PLUS | PRINTF_SPACE), width, precision);
+                break;
+            case 'X': // unsigned hex uppercase
+                print_integer(out, arg_unsigned(ap, length), false, 16, HEX_UPPERCASE, int_flags & ~(PRINTF_PLUS | PRINTF_SPACE), width, precision);
+                break;
+            case 'p': // pointer, in hex
+                print_integer(out, (uintptr_t) va_arg(*ap, void *), false, 16, HEX_LOWERCASE, int_flags & ~(PRINTF_PLUS | PRINTF_SPACE), width, precision);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                {
+                    double v = (length == PRINTF_LENGTH_LONG_DOUBLE) ? (double) va_arg(*ap, long double) : va_arg(*ap, double);
+                    print_float(out, v, *format, flags, width, precision);
+                }
+                break;
+            case 'c': // char
+                {
+                    char c = (char) va_arg(*ap, int /* char promotes to int */);
+                    print_padded(out, &c, 1, flags, width);
+                }
+                break;
+            case 's': // string, up to precision characters of it
                 {
-                    if (!hex_chars) hex_chars = HEX_UPPERCASE;
-                    uint32_t v = va_arg(parameters, uint32_t);
-                    int s = 32;
-                    uint32_t v2 = 0;
-
-                    do {
-                        s-=4;
-                        v2 = v >> s;
-                        v2 &= 0xf;
-                    } while (v2 == 0 && s>=0); // skip leading zeros
-                    if (s < 0) {
-                        print(hex_chars,1); // 0
-                        written++;
+                    const char *str = va_arg(*ap, const char *);
+                    if (str == NULL) {
+                        str = "(null)";
                     }
-                    while (s >= 0) {
-                        uint32_t v2 = v >> s;
-                        v2 &= 0xf;
-                        print(hex_chars+v2,1);
-                        written++;
-                        s-=4;
+
+                    size_t len = 0;
+                    while ((precision < 0 || len < (size_t) precision) && str[len] != '\0') {
+                        len++;
                     }
+                    print_padded(out, str, len, flags, width);
                 }
-				break;
-			case 'f':
-				// decimal float lowercase
-				break;
-			case 'F':
-				// decimal float uppercase
-				break;
-			case 'e':
-				// scientific lowercase
-				break;
-			case 'E':
-				// scientific uppercase
-				break;
-			case 'g':
-				// shortest e or f
-				break;
-			case 'G':
-				// shortest E or F
-				break;
-			case 'a':
-				// hex float lowercase
-				break;
-			case 'A':
-				// hex float uppercase
-				break;
-			case 'c': // char
-				c = (char) va_arg(parameters, int /* char promotes to int */);
-				if (!maxrem) {
-					// TODO: Set errno to EOVERFLOW.
-					return -1;
-				}
-				if (!print(&c, sizeof(c)))
-					return -1;
-				written++;
-				break;
-			case 's': // string
-				const char* str = va_arg(parameters, const char*);
-				size_t len = strlen(str);
-				if (!print(str, len))
-					return -1;
-				written += len;
-				break;
-			case 'n':
-				// put char count into argument of signed int
-				break;
-		}
-		format++;
-	}
-
-	va_end(parameters);
-	return written;
-}
\ No newline at end of file
+                break;
+            case 'n': // put char count into argument
+                store_count(ap, length, out->written);
+                break;
+            case '%':
+                print(out, "%", 1);
+                break;
+            default:
+                // unknown conversion, print it as it is
+                if (*format == '\0') {
+                    format--;
+                }
+                print(out, conversion, format + 1 - conversion);
+                break;
+        }
+        format++;
+    }
+
+    if (out->written > INT_MAX) {
+        // TODO: Set errno to EOVERFLOW.
+        return -1;
+    }
+    return (int) out->written;
+}
+
+/* Print a formatted string */
+int printf(const char* restrict format, ...) {
+    va_list parameters;
+    va_start(parameters, format);
+    int written = vprintf(format, parameters);
+    va_end(parameters);
+    return written;
+}
+
+/* Format a string into a buffer of a given size, always null terminated if size isn't 0. Returns the length the whole string would have */
+int snprintf(char* restrict buf, size_t size, const char* restrict format, ...) {
+    va_list parameters;
+    va_start(parameters, format);
+    int written = vsnprintf(buf, size, format, parameters);
+    va_end(parameters);
+    return written;
+}
+
+/* Print a formatted string with its arguments in a va_list. It is formatted into a buffer on the stack, and written to the terminal in as few pieces as fit */
+int vprintf(const char* restrict format, va_list parameters) {
+    char buf[PRINTF_BUFFER_SIZE];
+    printf_out_t out = { buf, sizeof(buf), 0, 0, true };
+
+    va_list ap;
+    va_copy(ap, parameters);
+    int written = print_format(&out, format, &ap);
+    va_end(ap);
+
+    flush(&out);
+    return written;
+}
+
+/* Format a string into a buffer of a given size with its arguments in a va_list */
+int vsnprintf(char* restrict buf, size_t size, const char* restrict format, va_list parameters) {
+    printf_out_t out = { buf, (size != 0) ? size - 1 : 0, 0, 0, false };
+
+    va_list ap;
+    va_copy(ap, parameters);
+    int written = print_format(&out, format, &ap);
+    va_end(ap);
+
+    if (size != 0) {
+        buf[out.length] = '\0';
+    }
+    return written;
+}
@@ -15,6 +15,14 @@ void* memmove(void* dstptr, const void* srcptr, size_t size) {
 	return dstptr;
 }
 
+/* Fill memory with a byte */
+void* memset(void* dstptr, int value, size_t size) {
+	unsigned char* dst = (unsigned char*) dstptr;
+	for (size_t i = 0; i < size; i++)
+		dst[i] = (unsigned char) value;
+	return dstptr;
+}
+
 /* Get length of a null-terminated string */
 size_t strlen(const char* str) 
 {
@@ -64,8 +64,8 @@ void terminal_putentryat(char c, uint8_t color, size_t x, size_t y)
 	terminal_buffer[index] = vga_entry(c, color);
 }
 
-/* Print one character and update cursor */
-void terminal_putchar(char c) 
+/* Print one character without moving the cursor */
+static void terminal_put(char c)
 {
 	/* handle \n (newline) specially */
 	if (c == '\n') {
@@ -87,16 +87,24 @@ void terminal_putchar(char c)
 	while (terminal_row >= VGA_HEIGHT) {
 		terminal_scroll();
 	}
+}
+
+/* Print one character and update cursor */
+void terminal_putchar(char c) 
+{
+	terminal_put(c);
 
 	/* move cursor to position of the next character */
 	terminal_set_cursor(terminal_column, terminal_row);
 }
 
-/* Write a string of a given size */
+/* Write a string of a given size. The cursor is moved once, after the last character, as each move takes four port writes */
 void terminal_write(const char* data, size_t size) 
 {
 	for (size_t i = 0; i < size; i++)
-		terminal_putchar(data[i]);
+		terminal_put(data[i]);
+
+	terminal_set_cursor(terminal_column, terminal_row);
 }
 
 /* Write a null-terminated string */
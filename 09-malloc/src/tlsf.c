@@ -0,0 +1,225 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <tlsf.h>
+#include <trace.h>
+
+/*
+    Two-Level Segregated Fit allocator. Every operation is a fixed number of steps: the free list for a size is found
+    from its two most significant bit positions, and the first non-empty list is found with one bit scan per level.
+    There are no loops over blocks, and no calls to the page allocator or printf on the allocation paths, so it can be
+    used where malloc can't, like interrupt handlers. It is not reentrant, so a pool shared with an interrupt handler
+    must only be used with interrupts disabled. The pool counts its list insertions, removals and bit scans, so the
+    benchmark can check that no operation takes more than TLSF_MALLOC_MAX_STEPS or TLSF_FREE_MAX_STEPS of them.
+*/
+
+/* Get the block after this one in memory */
+static inline tlsf_block_t *tlsf_next_phys(tlsf_block_t *blk) {
+    return (tlsf_block_t *)((void *) blk + TLSF_BLOCK_HEADER_SIZE + (blk->size & ~TLSF_BLOCK_FREE));
+}
+
+/* Get the first and second-level indexes of the list holding blocks of this size */
+static inline void tlsf_mapping(uint32_t size, uint32_t *fl, uint32_t *sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+    } else {
+        uint32_t msb = 31 - __builtin_clz(size);
+        *sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = msb - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+/* Add a free block to the list for its size */
+static void tlsf_insert(tlsf_t *tlsf, tlsf_block_t *blk) {
+    uint32_t fl, sl;
+    tlsf_mapping(blk->size & ~TLSF_BLOCK_FREE, &fl, &sl);
+
+    tlsf_block_t *head = tlsf->blocks[fl][sl];
+    blk->next_free = head;
+    blk->prev_free = NULL;
+    if (head != NULL) {
+        head->prev_free = blk;
+    }
+
+    tlsf->blocks[fl][sl] = blk;
+    tlsf->fl_bitmap |= 1u << fl;
+    tlsf->sl_bitmap[fl] |= 1u << sl;
+    tlsf->steps++;
+}
+
+/* Remove a free block from the list for its size */
+static void tlsf_remove(tlsf_t *tlsf, tlsf_block_t *blk) {
+    uint32_t fl, sl;
+    tlsf_mapping(blk->size & ~TLSF_BLOCK_FREE, &fl, &sl);
+
+    if (blk->next_free != NULL) {
+        blk->next_free->prev_free = blk->prev_free;
+    }
+
+    if (blk->prev_free != NULL) {
+        blk->prev_free->next_free = blk->next_free;
+    } else {
+        tlsf->blocks[fl][sl] = blk->next_free;
+
+        /* List is now empty, clear its bits */
+        if (blk->next_free == NULL) {
+            tlsf->sl_bitmap[fl] &= ~(1u << sl);
+            if (tlsf->sl_bitmap[fl] == 0) {
+                tlsf->fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+    tlsf->steps++;
+}
+
+/* Create a pool in the given memory. Returns NULL if the memory is too small */
+tlsf_t *tlsf_create(void *mem, size_t bytes) {
+    /* Control structure, followed by one free block and an empty in-use block that ends the pool */
+    uint32_t control = (sizeof(tlsf_t) + 7) & ~7;
+    uint32_t start = ((uint32_t) mem + 7) & ~7;
+    uint32_t end = ((uint32_t) mem + bytes) & ~7;
+
+    if (mem == NULL || end < start + control + (3 * TLSF_BLOCK_HEADER_SIZE) + 8) {
+        printf("tlsf_create: memory is too small for a pool\n");
+        return NULL;
+    }
+
+    uint32_t size = end - start - control - (2 * TLSF_BLOCK_HEADER_SIZE);
+
+    /* The largest block must still map to a first-level class */
+    if (size >= (1u << TLSF_FL_MAX)) {
+        size = (1u << TLSF_FL_MAX) - 8;
+    }
+
+    tlsf_t *tlsf = (tlsf_t *) start;
+    tlsf->fl_bitmap = 0;
+    tlsf->steps = 0;
+    for (int i=0; i<TLSF_FL_COUNT; i++) {
+        tlsf->sl_bitmap[i] = 0;
+        for (int j=0; j<TLSF_SL_COUNT; j++) {
+            tlsf->blocks[i][j] = NULL;
+        }
+    }
+
+    tlsf_block_t *blk = (tlsf_block_t *)(start + control);
+    blk->prev_phys = NULL;
+    blk->size = size | TLSF_BLOCK_FREE;
+
+    tlsf_block_t *sentinel = tlsf_next_phys(blk);
+    sentinel->prev_phys = blk;
+    sentinel->size = 0;
+
+    tlsf_insert(tlsf, blk);
+    return tlsf;
+}
+
+/* Free memory back to a pool */
+void tlsf_free(tlsf_t *tlsf, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    tlsf_block_t *blk = (tlsf_block_t *)(ptr - TLSF_BLOCK_HEADER_SIZE);
+
+    /* Catch double frees before they corrupt the free lists */
+    if (blk->size & TLSF_BLOCK_FREE) {
+        trace(TRACE_TLSF_DOUBLE_FREE, ptr, 0);
+        return;
+    }
+
+    /* Merge with the following block if it is free */
+    tlsf_block_t *next = tlsf_next_phys(blk);
+    if (next->size & TLSF_BLOCK_FREE) {
+        tlsf_remove(tlsf, next);
+        blk->size += TLSF_BLOCK_HEADER_SIZE + (next->size & ~TLSF_BLOCK_FREE);
+    }
+
+    /* Merge into the previous block if it is free */
+    tlsf_block_t *prev = blk->prev_phys;
+    if (prev != NULL && (prev->size & TLSF_BLOCK_FREE)) {
+        tlsf_remove(tlsf, prev);
+        prev->size += TLSF_BLOCK_HEADER_SIZE + blk->size;
+        blk = prev;
+    }
+
+    blk->size |= TLSF_BLOCK_FREE;
+    tlsf_next_phys(blk)->prev_phys = blk;
+    tlsf_insert(tlsf, blk);
+}
+
+/* Allocate memory from a pool. Returns NULL if not successful */
+void *tlsf_malloc(tlsf_t *tlsf, size_t size) {
+    /* Round up size to nearest 8 bytes. Free blocks need 8 bytes for their list links */
+    if (size == 0 || size >= (1u << TLSF_FL_MAX) / 2) {
+        return NULL;
+    }
+    size = (size + 7) & ~7;
+
+    /* Round the size up to the next list boundary, so any block in the list found is large enough */
+    uint32_t search = size;
+    if (search >= TLSF_SMALL_BLOCK) {
+        search += (1u << (31 - __builtin_clz(search) - TLSF_SL_LOG2)) - 1;
+    }
+
+    uint32_t fl, sl;
+    tlsf_mapping(search, &fl, &sl);
+
+    /* First non-empty list in this first-level class, otherwise in the next non-empty first-level class */
+    uint32_t sl_map = tlsf->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        uint32_t fl_map = tlsf->fl_bitmap & (~0u << (fl + 1));
+        if (fl_map == 0) {
+            return NULL;
+        }
+
+        fl = __builtin_ctz(fl_map);
+        sl_map = tlsf->sl_bitmap[fl];
+        tlsf->steps++;
+    }
+    sl = __builtin_ctz(sl_map);
+    tlsf->steps++;
+
+    tlsf_block_t *blk = tlsf->blocks[fl][sl];
+    tlsf_remove(tlsf, blk);
+    blk->size &= ~TLSF_BLOCK_FREE;
+
+    /* Split off the rest of the block if it can hold a free block */
+    if (blk->size >= size + TLSF_BLOCK_HEADER_SIZE + 8) {
+        uint32_t remaining = blk->size - size - TLSF_BLOCK_HEADER_SIZE;
+        blk->size = size;
+
+        tlsf_block_t *rest = tlsf_next_phys(blk);
+        rest->prev_phys = blk;
+        rest->size = remaining | TLSF_BLOCK_FREE;
+        tlsf_next_phys(rest)->prev_phys = rest;
+        tlsf_insert(tlsf, rest);
+    }
+
+    return (void *) blk + TLSF_BLOCK_HEADER_SIZE;
+}
+
+/* Print the free lists of a pool */
+void tlsf_print_diagnostics(tlsf_t *tlsf) {
+    printf(" tlsf free lists: <");
+
+    int first = 1;
+    for (int i=0; i<TLSF_FL_COUNT; i++) {
+        for (int j=0; j<TLSF_SL_COUNT; j++) {
+            tlsf_block_t *blk = tlsf->blocks[i][j];
+
+            while (blk != NULL) {
+                if (!first) {
+                    printf(",");
+                }
+                printf("%p:%d",blk,blk->size & ~TLSF_BLOCK_FREE);
+                first = 0;
+
+                blk = blk->next_free;
+            }
+        }
+    }
+
+    printf(">\n");
+}
@@ -0,0 +1,106 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <trace.h>
+
+/* Trace ring and the count of records ever written to it */
+trace_record_t trace_ring[TRACE_RING_SIZE];
+uint32_t trace_count = 0;
+
+/* Names of the events */
+static const char *trace_event_names[TRACE_EVENT_COUNT] = {
+    [TRACE_NONE] = "none",
+    [TRACE_MALLOC] = "malloc",
+    [TRACE_MALLOC_ZERO] = "malloc: size was zero",
+    [TRACE_MALLOC_PAGES] = "malloc: using pgalloc",
+    [TRACE_MALLOC_EXACT] = "malloc: found block of exact size",
+    [TRACE_MALLOC_LARGEST] = "malloc: using largest block",
+    [TRACE_MALLOC_NO_FIT] = "malloc: largest block is not large enough",
+    [TRACE_MALLOC_EXPAND] = "malloc: expanding from pgalloc",
+    [TRACE_MALLOC_NO_PAGE] = "malloc: could not obtain a page to fill request",
+    [TRACE_MALLOC_VMALLOC] = "malloc: no contiguous pages, using vmalloc",
+    [TRACE_MALLOC_SPLIT] = "malloc: splitting the block",
+    [TRACE_MALLOC_WHOLE] = "malloc: removing block from list",
+    [TRACE_MALLOC_ALIGNED] = "aligned_alloc",
+    [TRACE_MALLOC_BAD_ALIGN] = "aligned_alloc: alignment is not a supported power of two",
+    [TRACE_REALLOC] = "realloc",
+    [TRACE_REALLOC_IN_PLACE] = "realloc: resized in place",
+    [TRACE_REALLOC_MOVE] = "realloc: moved to new memory",
+    [TRACE_FREE] = "free",
+    [TRACE_FREE_DOUBLE] = "free: block is already free",
+    [TRACE_FREE_MERGE_NEXT] = "free: merged with following block",
+    [TRACE_FREE_MERGE_PREV] = "free: merged into previous block",
+    [TRACE_FREE_INSERT] = "free: block not merged, adding to the list",
+    [TRACE_FREE_INVALID] = "free: memory was not allocated by malloc",
+    [TRACE_FREE_KEEP_ARENA] = "free: keeping empty arena",
+    [TRACE_FREE_RELEASE] = "free: returning arena to pgalloc",
+    [TRACE_HEAP_REMOVE_NULL] = "heap_remove_free_block: tried to remove NULL from free list",
+    [TRACE_KMEM_GROW] = "kmem_cache_alloc: expanding from pgalloc",
+    [TRACE_KMEM_NO_PAGE] = "kmem_cache_alloc: could not obtain a page to fill request",
+    [TRACE_KMEM_SHRINK] = "kmem_cache_free: returning slab to pgalloc",
+    [TRACE_KMEM_BAD_FREE] = "kmem_cache_free: not an object of this cache",
+    [TRACE_KMEM_DOUBLE_FREE] = "kmem_cache_free: object is already free",
+    [TRACE_BOOTMEM] = "bootmem_alloc",
+    [TRACE_BOOTMEM_NO_ROOM] = "bootmem_alloc: not enough boot memory left",
+    [TRACE_BOOTMEM_DONE] = "bootmem_alloc: called after bootmem_finish",
+    [TRACE_PGALLOC] = "pgalloc",
+    [TRACE_PGALLOC_BAD_SIZE] = "pgalloc: tried to allocate less than 1 page",
+    [TRACE_PGALLOC_TOO_LARGE] = "pgalloc: request is larger than the largest block order",
+    [TRACE_PGALLOC_NO_FIT] = "pgalloc: no blocks large enough to fill request",
+    [TRACE_PGALLOC_BAD_ZONE] = "pgalloc_zone: no such zone",
+    [TRACE_PGALLOC_FALLBACK] = "pgalloc_zone: zone is out of memory, falling back",
+    [TRACE_PGALLOC_SPLIT] = "pgalloc: splitting block",
+    [TRACE_PGALLOC_GROW] = "pgalloc_grow: took following free pages",
+    [TRACE_PGALLOC_NO_GROW] = "pgalloc_grow: following pages are not free",
+    [TRACE_PGFREE] = "pgfree",
+    [TRACE_PGFREE_BAD] = "pgfree: not the start of a page allocation",
+    [TRACE_PGFREE_MERGE] = "pgfree: merged with buddy",
+    [TRACE_PGALLOC_ZEROED] = "pgalloc_zeroed: took page from the zeroed pool",
+    [TRACE_PGALLOC_ZERO_MISS] = "pgalloc_zeroed: no zeroed page, clearing now",
+    [TRACE_PGALLOC_ZERO_IDLE] = "pgalloc_zero_idle: cleared page for the pool",
+    [TRACE_PGALLOC_COMPACT] = "pgalloc_compact: moved pages out of a block",
+    [TRACE_PGALLOC_NO_COMPACT] = "pgalloc_compact: no block can be made free",
+    [TRACE_PGALLOC_SHRINK] = "pgalloc: out of memory, shrinking caches",
+    [TRACE_PGALLOC_BAD_COLOR] = "pgalloc_color: no such color",
+    [TRACE_VMM_MAP] = "vmm_map",
+    [TRACE_VMM_BAD_MAP] = "vmm_map: page is already mapped, or in a 4 MiB page",
+    [TRACE_VMM_NO_TABLE] = "vmm_map: could not obtain a page table",
+    [TRACE_VMM_UNMAP] = "vmm_unmap",
+    [TRACE_VMM_BAD_UNMAP] = "vmm_unmap: page is not mapped",
+    [TRACE_VMM_FAULT] = "page fault: mapped zeroed pages in a demand-zero region",
+    [TRACE_VMALLOC] = "vmalloc",
+    [TRACE_VMALLOC_NO_SPACE] = "vmalloc: no room left in kernel space",
+    [TRACE_VMALLOC_NO_PAGE] = "vmalloc: could not obtain a page to fill request",
+    [TRACE_VMALLOC_FLUSH] = "vmalloc: unmapped freed areas and flushed the TLB",
+    [TRACE_VFREE] = "vfree",
+    [TRACE_VFREE_BAD] = "vfree: not the start of a vmalloc area",
+    [TRACE_TLSF_DOUBLE_FREE] = "tlsf_free: block is already free"
+};
+
+/* Print the records in the trace ring, oldest first */
+void trace_dump(void) {
+    uint32_t count = trace_count;
+    uint32_t first = 0;
+
+    /* Older records have been overwritten */
+    if (count > TRACE_RING_SIZE) {
+        first = count - TRACE_RING_SIZE;
+    }
+
+    printf(" trace: %d records, %d overwritten\n",count - first,first);
+
+    uint32_t prev_tsc = trace_ring[first & (TRACE_RING_SIZE - 1)].tsc;
+    for (uint32_t i=first; i<count; i++) {
+        trace_record_t *rec = trace_ring + (i & (TRACE_RING_SIZE - 1));
+
+        const char *name = "unknown";
+        if (rec->event < TRACE_EVENT_COUNT) {
+            name = trace_event_names[rec->event];
+        }
+
+        /* Time is shown as cycles since the previous record */
+        printf("  +%u %s (%x, %u)\n",rec->tsc - prev_tsc,name,rec->ptr,rec->arg);
+        prev_tsc = rec->tsc;
+    }
+}
@@ -0,0 +1,225 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kmem.h>
+#include <pgalloc.h>
+#include <trace.h>
+#include <vmalloc.h>
+#include <vmm.h>
+
+/*
+    Virtually contiguous allocations. An area of kernel space is mapped page by page to frames taken one at a time
+    from pgalloc, so a large allocation succeeds as long as enough frames are free anywhere, however fragmented the
+    free map is. Freed areas stay mapped until VMALLOC_LAZY_PAGES of them have piled up. Then they are all unmapped,
+    the TLB is flushed once instead of with an invlpg per page, and only after that are their frames freed and their
+    space reused.
+*/
+
+/* Areas in order of address, including freed areas that are still mapped, and the cache they are allocated from */
+static vmalloc_area_t *vmalloc_areas = NULL;
+static kmem_cache_t *vmalloc_area_cache = NULL;
+
+/* Pages mapped by areas in use, pages of freed areas waiting for a flush, and the number of flushes */
+static uint32_t vmalloc_mapped = 0;
+static uint32_t vmalloc_lazy = 0;
+static uint32_t vmalloc_flushes = 0;
+
+/* Shrinker of the freed areas waiting for a flush, which still hold their frames */
+static uint32_t vmalloc_shrink(uint32_t pages) {
+    (void) pages;
+
+    uint32_t freed = vmalloc_lazy;
+    if (freed != 0) {
+        vmalloc_flush();
+    }
+
+    return freed;
+}
+
+/* Find the area in use starting at an address. Returns NULL if there is none */
+static vmalloc_area_t *vmalloc_find(void *ptr) {
+    for (vmalloc_area_t *area = vmalloc_areas; area != NULL; area = area->next) {
+        if (area->start == (uint32_t) ptr) {
+            return area->freed ? NULL : area;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the first gap of kernel space with room for the given number of pages, and the area before it. Returns 0 if there is none */
+static uint32_t vmalloc_find_space(uint32_t pages, vmalloc_area_t **prev) {
+    uint32_t start = VMALLOC_START;
+    *prev = NULL;
+
+    for (vmalloc_area_t *area = vmalloc_areas; area != NULL; area = area->next) {
+        if (area->start - start >= pages << 12) {
+            return start;
+        }
+
+        start = area->start + ((area->pages + 1) << 12);
+        *prev = area;
+    }
+
+    if (VMALLOC_END - start >= pages << 12) {
+        return start;
+    }
+
+    return 0;
+}
+
+/* Free memory allocated with vmalloc */
+void vfree(void *ptr) {
+    vmalloc_area_t *area = vmalloc_find(ptr);
+    if (area == NULL) {
+        trace(TRACE_VFREE_BAD, ptr, 0);
+        return;
+    }
+
+    trace(TRACE_VFREE, ptr, area->pages);
+
+    /* The area stays mapped until the next flush, so its frames can't be reused before then */
+    area->freed = 1;
+    vmalloc_mapped -= area->pages;
+    vmalloc_lazy += area->pages;
+
+    if (vmalloc_lazy >= VMALLOC_LAZY_PAGES) {
+        vmalloc_flush();
+    }
+}
+
+/* Allocate memory that is contiguous in kernel space, mapped from frames anywhere in memory. Always page aligned. Returns NULL if not successful, or if vmalloc_init hasn't been called */
+void *vmalloc(size_t size) {
+    if (vmalloc_area_cache == NULL || size == 0) {
+        return NULL;
+    }
+
+    uint32_t pages = (size / 4096) + ((size % 4096) != 0);
+    trace(TRACE_VMALLOC, NULL, pages);
+
+    /* Room for the area and its guard page. Space held by freed areas is only reused after a flush */
+    vmalloc_area_t *prev = NULL;
+    uint32_t start = 0;
+    if (pages < (VMALLOC_END - VMALLOC_START) >> 12) {
+        start = vmalloc_find_space(pages + 1, &prev);
+        if (start == 0 && vmalloc_lazy != 0) {
+            vmalloc_flush();
+            start = vmalloc_find_space(pages + 1, &prev);
+        }
+    }
+
+    if (start == 0) {
+        trace(TRACE_VMALLOC_NO_SPACE, NULL, pages);
+        return NULL;
+    }
+
+    vmalloc_area_t *area = kmem_cache_alloc(vmalloc_area_cache);
+    if (area == NULL) {
+        trace(TRACE_VMALLOC_NO_PAGE, NULL, pages);
+        return NULL;
+    }
+
+    /* The area goes in the list first, so a flush while mapping it doesn't touch its space */
+    area->start = start;
+    area->pages = 0;
+    area->freed = 0;
+    area->next = (prev != NULL) ? prev->next : vmalloc_areas;
+    if (prev != NULL) {
+        prev->next = area;
+    } else {
+        vmalloc_areas = area;
+    }
+
+    /* Frames are only reached through the area, so high memory is used first */
+    for (uint32_t i=0; i<pages; i++) {
+        void *frame = pgalloc_high(1);
+        if (frame == NULL) {
+            frame = pgalloc(1);
+        }
+        if (frame == NULL && vmalloc_lazy != 0) {
+            vmalloc_flush();
+            frame = pgalloc(1);
+        }
+
+        if (frame == NULL || vmm_map((void *)(start + (i << 12)), (uint32_t) frame, VMM_WRITE)) {
+            /* Give back what was mapped so far with the next flush */
+            if (frame != NULL) {
+                pgfree(frame);
+            }
+            trace(TRACE_VMALLOC_NO_PAGE, NULL, pages);
+
+            area->freed = 1;
+            vmalloc_lazy += area->pages;
+            return NULL;
+        }
+
+        pgalloc_set_owner(frame, PGALLOC_OWNER_VMALLOC);
+        area->pages++;
+    }
+
+    vmalloc_mapped += pages;
+    return (void *) start;
+}
+
+/* Unmap freed areas and return their frames to pgalloc, with a single TLB flush */
+void vmalloc_flush(void) {
+    /* Frames to free once the TLB is flushed. Frames in high memory can't be written, so they are linked through the mapping in their page database entry, which vmm_unmap_lazy cleared */
+    uint32_t frames = 0;
+
+    vmalloc_area_t **link = &vmalloc_areas;
+    while (*link != NULL) {
+        vmalloc_area_t *area = *link;
+        if (!area->freed) {
+            link = &area->next;
+            continue;
+        }
+
+        for (uint32_t i=0; i<area->pages; i++) {
+            uint32_t phys;
+            if (!vmm_unmap_lazy((void *)(area->start + (i << 12)), &phys)) {
+                pgalloc_set_mapping((void *) phys, (void *) frames);
+                frames = phys;
+            }
+        }
+
+        *link = area->next;
+        kmem_cache_free(vmalloc_area_cache, area);
+    }
+
+    vmm_flush();
+    vmalloc_flushes++;
+    trace(TRACE_VMALLOC_FLUSH, NULL, vmalloc_lazy);
+    vmalloc_lazy = 0;
+
+    while (frames != 0) {
+        uint32_t next = (uint32_t) pgalloc_mapping((void *) frames);
+        pgfree((void *) frames);
+        frames = next;
+    }
+}
+
+/* Initialize vmalloc. Must be called after vmm_init and pgalloc_init */
+void vmalloc_init(void) {
+    vmalloc_area_cache = kmem_cache_create("vmalloc_area", sizeof(vmalloc_area_t), 0, NULL);
+
+    /* Area frames are only reached through their mapping, so compaction can move them */
+    pgalloc_set_migrate(PGALLOC_OWNER_VMALLOC, vmm_migrate);
+    pgalloc_register_shrinker("vmalloc", vmalloc_shrink);
+}
+
+/* Get the number of pages of a vmalloc area. Returns 0 if the pointer is not the start of one */
+size_t vmalloc_pages(void *ptr) {
+    vmalloc_area_t *area = vmalloc_find(ptr);
+    return (area != NULL) ? area->pages : 0;
+}
+
+/* Print current state of vmalloc */
+void vmalloc_print_diagnostics(void) {
+    uint32_t areas = 0;
+    for (vmalloc_area_t *area = vmalloc_areas; area != NULL; area = area->next) {
+        areas += !area->freed;
+    }
+
+    printf(" vmalloc: %d areas, %d pages mapped, %d freed pages waiting for a flush, %d flushes\n", areas, vmalloc_mapped, vmalloc_lazy, vmalloc_flushes);
+}
@@ -0,0 +1,342 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <io.h>
+#include <multiboot.h>
+#include <pgalloc.h>
+#include <trace.h>
+#include <vmm.h>
+
+/*
+    Kernel address space. Physical memory is mapped at its own address (the direct map), so the allocators keep
+    using physical addresses as pointers, and the kernel is mapped again at KERNEL_VMA, where it is linked. Both use
+    4 MiB pages, which need no page tables and take one TLB entry for every 4 MiB. Other pages of kernel space are
+    mapped one at a time with vmm_map, with page tables from pgalloc. There is one address space, so a page table
+    is never freed.
+
+    Demand-zero regions are reserved without mapping anything. The first touch of one of their pages faults, and
+    vmm_page_fault maps a zeroed frame there, along with the other unmapped pages of its fault-around group, so a
+    region only takes memory for the pages actually used and a run of touches takes one fault instead of several.
+*/
+
+/* Page directory of the kernel's address space. boot.s fills in the first entries */
+uint32_t vmm_page_directory[1024] __attribute__((aligned(4096)));
+
+/* 4 MiB pages in the direct map and mapping the kernel, and page tables allocated by vmm_map */
+static uint32_t vmm_direct_pages = 0;
+static uint32_t vmm_kernel_pages = 0;
+static uint32_t vmm_tables = 0;
+
+/* Demand-zero regions, page faults they handled and frames mapped by the faults */
+static vmm_region_t vmm_regions[VMM_REGION_COUNT];
+static uint32_t vmm_faults = 0;
+static uint32_t vmm_fault_pages = 0;
+
+/* Set while a page fault is being handled */
+static int vmm_faulting = 0;
+
+/* Get the page table entry of a page, allocating the page table if alloc is set. Returns NULL if the page is in a 4 MiB page or there is no page table for it */
+static uint32_t *vmm_entry(void *virt, int alloc) {
+    uint32_t *pde = vmm_page_directory + ((uint32_t) virt >> 22);
+
+    if (*pde & VMM_LARGE) {
+        return NULL;
+    }
+
+    if (!(*pde & VMM_PRESENT)) {
+        if (!alloc) {
+            return NULL;
+        }
+
+        /* The table is in the direct map, so its physical address is also a pointer to it */
+        uint32_t *table = pgalloc_zeroed(1);
+        if (table == NULL) {
+            trace(TRACE_VMM_NO_TABLE, virt, 0);
+            return NULL;
+        }
+
+        pgalloc_set_owner(table, PGALLOC_OWNER_PGTABLE);
+        *pde = (uint32_t) table | VMM_PRESENT | VMM_WRITE;
+        vmm_tables++;
+    }
+
+    return (uint32_t *)(*pde & ~0xfff) + (((uint32_t) virt >> 12) & 0x3ff);
+}
+
+/* Print what caused a page fault that can't be handled, and stop */
+static void vmm_fault_halt(uint32_t addr, uint32_t error, const char *reason) {
+    printf("page fault at %x, error %x: %s\n", addr, error, reason);
+
+    for (;;) {
+        asm volatile ( "cli; hlt" );
+    }
+}
+
+/* Map an unmapped page of a demand-zero region to a zeroed frame. Returns non-zero if not successful */
+static int vmm_fault_in(uint32_t page) {
+    uint32_t phys;
+    if (!vmm_phys((void *) page, &phys)) {
+        return 0;
+    }
+
+    /* The page is only reached through its mapping, so high memory is used first and cleared through the mapping. Without any, the frame comes from the pool zeroed while idle */
+    void *frame = pgalloc_high(1);
+    int high = (frame != NULL);
+    if (!high) {
+        frame = pgalloc_zeroed(1);
+    }
+    if (frame == NULL) {
+        return 1;
+    }
+
+    if (vmm_map((void *) page, (uint32_t) frame, VMM_WRITE)) {
+        pgfree(frame);
+        return 1;
+    }
+    if (high) {
+        memset((void *) page, 0, 4096);
+    }
+
+    pgalloc_set_owner(frame, PGALLOC_OWNER_DEMAND);
+    vmm_fault_pages++;
+    return 0;
+}
+
+/* Reserve pages of kernel space that are mapped to zeroed frames on first touch, with fault_around pages mapped at a time. Returns non-zero if not successful, or if vmm_init hasn't been called */
+int vmm_demand_zero(void *start, size_t pages, uint32_t fault_around) {
+    uint32_t first = (uint32_t) start;
+
+    if (vmm_direct_pages == 0 || (first & 0xfff) != 0 || pages == 0 || (first >> 12) < VMM_DIRECT_MAP_FRAMES) {
+        return 1;
+    }
+    if (fault_around == 0 || (fault_around & (fault_around - 1)) != 0) {
+        return 1;
+    }
+
+    for (int i=0; i<VMM_REGION_COUNT; i++) {
+        if (vmm_regions[i].start == 0) {
+            vmm_regions[i].start = first;
+            vmm_regions[i].end = first + (pages << 12);
+            vmm_regions[i].fault_around = fault_around;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Flush the whole TLB, after pages were unmapped with vmm_unmap_lazy */
+void vmm_flush(void) {
+    /* Nothing is mapped global, so reloading the page directory flushes everything */
+    load_cr3(KERNEL_PHYS(vmm_page_directory));
+}
+
+/* Map the direct map and the whole kernel with 4 MiB pages. Must be called before anything uses memory above the first 4 MiB, including bootmem_alloc and pgalloc_init */
+void vmm_init(void) {
+    int map_size = multiboot_info->mmap_length / sizeof(multiboot_memory_map_t);
+    uint64_t limit = (uint64_t) VMM_DIRECT_MAP_FRAMES << 12;
+
+    /* The direct map covers available memory up to the start of kernel space, and the multiboot information, which is still read */
+    uint64_t top = (uint32_t) multiboot_info->mmap_addr + multiboot_info->mmap_length;
+    if ((uint32_t) multiboot_info + sizeof(multiboot_info_t) > top) {
+        top = (uint32_t) multiboot_info + sizeof(multiboot_info_t);
+    }
+
+    for (int i=0; i<map_size; i++) {
+        uint64_t end = multiboot_info->mmap_addr[i].addr + multiboot_info->mmap_addr[i].len;
+
+        if (multiboot_info->mmap_addr[i].type != MULTIBOOT_MEMORY_AVAILABLE || multiboot_info->mmap_addr[i].addr >= limit) {
+            continue;
+        }
+
+        if (end > limit) {
+            end = limit;
+        }
+        if (end > top) {
+            top = end;
+        }
+    }
+
+    vmm_direct_pages = (top + 0x3fffff) >> 22;
+    for (uint32_t i=0; i<vmm_direct_pages; i++) {
+        vmm_page_directory[i] = (i << 22) | VMM_PRESENT | VMM_WRITE | VMM_LARGE;
+    }
+
+    /* The kernel from physical address 0, as it is linked at KERNEL_VMA plus its physical address */
+    vmm_kernel_pages = (KERNEL_PHYS(&kernel_end) + 0x3fffff) >> 22;
+    for (uint32_t i=0; i<vmm_kernel_pages; i++) {
+        vmm_page_directory[(KERNEL_VMA >> 22) + i] = (i << 22) | VMM_PRESENT | VMM_WRITE | VMM_LARGE;
+    }
+
+    vmm_flush();
+
+    /* Demand-zero frames are only reached through their mapping, so compaction can move them */
+    pgalloc_set_migrate(PGALLOC_OWNER_DEMAND, vmm_migrate);
+
+    printf("vmm_init: direct map of %d MiB, kernel mapped at %x\n", vmm_direct_pages * 4, KERNEL_VMA);
+}
+
+/* Map a page of kernel space to a frame. Page tables are allocated from pgalloc. Returns non-zero if not successful, or if the page is already mapped */
+int vmm_map(void *virt, uint32_t phys, uint32_t flags) {
+    if (vmm_page_directory[(uint32_t) virt >> 22] & VMM_LARGE) {
+        trace(TRACE_VMM_BAD_MAP, virt, phys);
+        return 1;
+    }
+
+    uint32_t *pte = vmm_entry(virt, 1);
+    if (pte == NULL) {
+        return 1;
+    } else if (*pte & VMM_PRESENT) {
+        trace(TRACE_VMM_BAD_MAP, virt, phys);
+        return 1;
+    }
+
+    /* A page that wasn't present is never in the TLB, so nothing has to be invalidated */
+    *pte = (phys & ~0xfff) | (flags & 0xfff) | VMM_PRESENT;
+    pgalloc_set_mapping((void *) phys, virt);
+
+    trace(TRACE_VMM_MAP, virt, phys);
+    return 0;
+}
+
+/* Point the mapping of a frame at another frame, once its contents were copied there. The page database records where vmm_map mapped the frame, so the page table entry is found without a search. Returns non-zero if the frame is not mapped by a page table */
+int vmm_migrate(void *from, void *to) {
+    void *virt = pgalloc_mapping(from);
+    uint32_t *pte = (virt != NULL) ? vmm_entry(virt, 0) : NULL;
+    if (pte == NULL || !(*pte & VMM_PRESENT) || (*pte & ~0xfff) != (uint32_t) from) {
+        return 1;
+    }
+
+    *pte = (uint32_t) to | (*pte & 0xfff);
+    invlpg(virt);
+    return 0;
+}
+
+/* Handle a page fault. A page of a demand-zero region is mapped to a zeroed frame, anything else halts the kernel */
+void vmm_page_fault(uint32_t addr, uint32_t error) {
+    vmm_region_t *region = NULL;
+    for (int i=0; i<VMM_REGION_COUNT; i++) {
+        if (vmm_regions[i].start != 0 && addr >= vmm_regions[i].start && addr - vmm_regions[i].start < vmm_regions[i].end - vmm_regions[i].start) {
+            region = &vmm_regions[i];
+            break;
+        }
+    }
+
+    if (region == NULL) {
+        vmm_fault_halt(addr, error, "not in a demand-zero region");
+    } else if (error & VMM_FAULT_PRESENT) {
+        vmm_fault_halt(addr, error, "protection violation");
+    }
+
+    /* The page that was touched has to be mapped, the rest of its group is only mapped while memory is left */
+    vmm_faulting = 1;
+    uint32_t page = addr & ~0xfff;
+    if (vmm_fault_in(page)) {
+        vmm_fault_halt(addr, error, "out of memory");
+    }
+
+    uint32_t group = page & ~((region->fault_around << 12) - 1);
+    uint32_t mapped = 1;
+    for (uint32_t i=0; i<region->fault_around; i++) {
+        uint32_t near = group + (i << 12);
+        if (near == page || near < region->start || near - region->start >= region->end - region->start) {
+            continue;
+        }
+        if (vmm_fault_in(near)) {
+            break;
+        }
+        mapped++;
+    }
+
+    vmm_faulting = 0;
+    vmm_faults++;
+    trace(TRACE_VMM_FAULT, (void *) addr, mapped);
+}
+
+/* Check if a page fault is being handled. The code that faulted may be stopped halfway through changing its data */
+int vmm_in_fault(void) {
+    return vmm_faulting;
+}
+
+/* Get the physical address virtual memory is mapped to. Returns non-zero if it is not mapped */
+int vmm_phys(void *virt, uint32_t *phys) {
+    uint32_t pde = vmm_page_directory[(uint32_t) virt >> 22];
+
+    if ((pde & (VMM_PRESENT | VMM_LARGE)) == (VMM_PRESENT | VMM_LARGE)) {
+        *phys = (pde & ~0x3fffff) | ((uint32_t) virt & 0x3fffff);
+        return 0;
+    }
+
+    uint32_t *pte = vmm_entry(virt, 0);
+    if (pte == NULL || !(*pte & VMM_PRESENT)) {
+        return 1;
+    }
+
+    *phys = (*pte & ~0xfff) | ((uint32_t) virt & 0xfff);
+    return 0;
+}
+
+/* Print current state of the kernel's address space */
+void vmm_print_diagnostics(void) {
+    printf(" vmm: direct map %d MiB, kernel %d MiB at %x, %d page tables\n", vmm_direct_pages * 4, vmm_kernel_pages * 4, KERNEL_VMA, vmm_tables);
+    printf(" vmm: %d page faults mapped %d demand-zero pages\n", vmm_faults, vmm_fault_pages);
+}
+
+/* Unmap the pages of a demand-zero region that have been touched and free their frames, so they read as zero again. Returns the number of frames freed */
+uint32_t vmm_release(void *start, size_t pages) {
+    uint32_t freed = 0;
+
+    for (size_t i=0; i<pages; i++) {
+        uint32_t phys;
+        void *page = start + (i << 12);
+
+        /* Pages that were never touched have nothing to free */
+        if (vmm_phys(page, &phys)) {
+            continue;
+        }
+
+        vmm_unmap(page);
+        pgfree((void *) phys);
+        freed++;
+    }
+
+    return freed;
+}
+
+/* Remove the mapping of a page */
+void vmm_unmap(void *virt) {
+    uint32_t *pte = vmm_entry(virt, 0);
+    if (pte == NULL || !(*pte & VMM_PRESENT)) {
+        trace(TRACE_VMM_BAD_UNMAP, virt, 0);
+        return;
+    }
+
+    uint32_t phys = *pte & ~0xfff;
+    *pte = 0;
+    invlpg(virt);
+    if (pgalloc_mapping((void *) phys) == virt) {
+        pgalloc_set_mapping((void *) phys, NULL);
+    }
+
+    trace(TRACE_VMM_UNMAP, virt, phys);
+}
+
+/* Remove the mapping of a page without invalidating its TLB entry, so many pages can be unmapped with one vmm_flush. The frame must not be reused before then. Returns non-zero if the page was not mapped */
+int vmm_unmap_lazy(void *virt, uint32_t *phys) {
+    uint32_t *pte = vmm_entry(virt, 0);
+    if (pte == NULL || !(*pte & VMM_PRESENT)) {
+        trace(TRACE_VMM_BAD_UNMAP, virt, 0);
+        return 1;
+    }
+
+    *phys = *pte & ~0xfff;
+    *pte = 0;
+    if (pgalloc_mapping((void *) *phys) == virt) {
+        pgalloc_set_mapping((void *) *phys, NULL);
+    }
+
+    trace(TRACE_VMM_UNMAP, virt, *phys);
+    return 0;
+}